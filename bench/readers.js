@@ -0,0 +1,54 @@
+//
+//  Compare concurrent SELECT throughput of the default shared cache connection with the readers pool in WAL mode
+//
+//  Usage: UV_THREADPOOL_SIZE=8 node bench/readers.js [-readers N] [-queries N] [-concurrency N] [-rows N]
+//
+
+var sqlite = require(__dirname + "/../build/Release/binding");
+var fs = require("fs");
+
+var args = {};
+for (var i = 2; i < process.argv.length - 1; i += 2) args[process.argv[i].substr(1)] = parseInt(process.argv[i + 1]);
+var readers = args.readers || 4;
+var queries = args.queries || 20000;
+var concurrency = args.concurrency || 32;
+var rows = args.rows || 10000;
+var file = __dirname + "/readers.db";
+
+function setup()
+{
+    for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    var db = new sqlite.Database(file);
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a int, b text)");
+    db.runSync("BEGIN");
+    for (var i = 0; i < rows; i++) db.runSync("INSERT INTO test VALUES(?,?,?)", [i, i % 100, "value" + i]);
+    db.runSync("COMMIT");
+    db.closeSync();
+}
+
+function run(name, opts, callback)
+{
+    var db = new sqlite.Database(file, opts, function(err) {
+        if (err) throw err;
+        var started = Date.now(), sent = 0, done = 0;
+        function next() {
+            if (sent >= queries) return;
+            sent++;
+            db.query("SELECT count(*), sum(length(b)) FROM test WHERE a=?", [sent % 100], function(err) {
+                if (err) throw err;
+                if (++done < queries) return next();
+                var elapsed = Date.now() - started;
+                console.log(name, ":", queries, "queries in", elapsed, "ms,", Math.round(queries * 1000 / elapsed), "queries/sec");
+                db.close(callback);
+            });
+        }
+        for (var i = 0; i < concurrency; i++) next();
+    });
+}
+
+setup();
+run("shared cache", sqlite.OPEN_SHAREDCACHE, function() {
+    run("readers pool(" + readers + ")", { readers: readers }, function() {
+        for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    });
+});
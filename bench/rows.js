@@ -0,0 +1,48 @@
+//
+//  Time to turn wide results into JS rows, sync and async
+//
+//  Usage: node bench/rows.js [-rows N] [-cols N] [-loops N]
+//
+
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+var args = {};
+for (var i = 2; i < process.argv.length - 1; i += 2) args[process.argv[i].substr(1)] = parseInt(process.argv[i + 1]);
+var rows = args.rows || 50000;
+var cols = args.cols || 20;
+var loops = args.loops || 5;
+
+var db = new sqlite.Database(":memory:");
+var names = [];
+for (var c = 0; c < cols; c++) names.push("c" + c + (c % 2 ? " text" : " int"));
+db.runSync("CREATE TABLE test(" + names.join(",") + ")");
+db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < " + rows + ") " +
+           "INSERT INTO test SELECT " + names.map((x, c) => (c % 2 ? "'value' || i" : "i * " + c)).join(",") + " FROM n");
+
+function report(name, times)
+{
+    times.sort((a, b) => a - b);
+    console.log(name, ":", rows, "rows x", cols, "columns, best", times[0], "ms, median", times[Math.floor(times.length / 2)], "ms");
+}
+
+var times = [];
+for (var i = 0; i < loops; i++) {
+    var started = Date.now();
+    db.querySync("SELECT * FROM test");
+    times.push(Date.now() - started);
+}
+report("querySync", times);
+
+times = [];
+(function next() {
+    if (times.length == loops) {
+        report("query", times);
+        return db.close(function() {});
+    }
+    var started = Date.now();
+    db.query("SELECT * FROM test", function(err) {
+        if (err) throw err;
+        times.push(Date.now() - started);
+        next();
+    });
+})();
@@ -0,0 +1,63 @@
+//
+//  Compare random and sequential read throughput of the default VFS with the io_uring VFS, a small page cache
+//  makes every query go to the VFS
+//
+//  Usage: UV_THREADPOOL_SIZE=8 node bench/vfs.js [-readers N] [-queries N] [-concurrency N] [-rows N] [-cache N]
+//
+
+var sqlite = require(__dirname + "/../build/Release/binding");
+var fs = require("fs");
+
+var args = {};
+for (var i = 2; i < process.argv.length - 1; i += 2) args[process.argv[i].substr(1)] = parseInt(process.argv[i + 1]);
+var readers = args.readers || 4;
+var queries = args.queries || 20000;
+var concurrency = args.concurrency || 32;
+var rows = args.rows || 100000;
+var cache = args.cache || 10;
+var file = __dirname + "/vfs.db";
+
+function setup()
+{
+    for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    var db = new sqlite.Database(file);
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a int, b text)");
+    db.runSync("BEGIN");
+    for (var i = 0; i < rows; i++) db.runSync("INSERT INTO test VALUES(?,?,?)", [i, i % 100, "value" + i]);
+    db.runSync("COMMIT");
+    db.closeSync();
+}
+
+function run(name, vfs, callback)
+{
+    var opts = { mode: sqlite.OPEN_READWRITE | sqlite.OPEN_URI, readers: readers, cache_size: cache };
+    var db = new sqlite.Database("file:" + file + "?vfs=" + vfs, opts, function(err) {
+        if (err) throw err;
+        var started = Date.now(), sent = 0, done = 0;
+        function next() {
+            if (sent >= queries) return;
+            sent++;
+            db.query("SELECT b FROM test WHERE id=?", [Math.floor(Math.random() * rows)], function(err) {
+                if (err) throw err;
+                if (++done < queries) return next();
+                var elapsed = Date.now() - started;
+                console.log(name, ": random", queries, "queries in", elapsed, "ms,", Math.round(queries * 1000 / elapsed), "queries/sec");
+                started = Date.now();
+                db.query("SELECT count(*), sum(length(b)) FROM test", function(err) {
+                    if (err) throw err;
+                    console.log(name, ": full scan in", Date.now() - started, "ms");
+                    db.close(callback);
+                });
+            });
+        }
+        for (var i = 0; i < concurrency; i++) next();
+    });
+}
+
+setup();
+run("unix", "unix", function() {
+    run("io_uring", "io_uring", function() {
+        console.log(sqlite.stats().io_uring);
+        for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    });
+});
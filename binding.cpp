@@ -17,11 +17,29 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <list>
+#include <deque>
 
 #ifdef _MSC_VER
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 #else
 #include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// The io_uring VFS reads the descriptor from the private unixFile struct, its layout is checked up to the bundled
+// SQLite version, a newer SQLite must be verified against os_unix.c before raising the limit
+#if defined(__linux__) && defined(__has_include) && SQLITE_VERSION_NUMBER >= 3007000 && SQLITE_VERSION_NUMBER <= 3038001
+#if __has_include(<linux/io_uring.h>)
+#define SQLITE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
 #endif
 
 using namespace node;
@@ -54,23 +72,693 @@ using namespace std;
         Nan::Set(name ##_obj, Nan::New("code").ToLocalChecked(), Nan::New(sqlite_code_string(errno)).ToLocalChecked());
 
 struct SQLiteField {
-    inline SQLiteField(unsigned short _index, unsigned short _type = SQLITE_NULL, double n = 0, string s = string()): type(_type), index(_index), nvalue(n), svalue(s) {}
-    inline SQLiteField(const char *_name, unsigned short _type = SQLITE_NULL, double n = 0, string s = string()): type(_type), index(0), name(_name), nvalue(n), svalue(s) {}
+    inline SQLiteField(unsigned short _index, unsigned short _type = SQLITE_NULL, double n = 0, string s = string()): type(_type), index(_index), nvalue(n), ivalue(n), svalue(s), blob(NULL), length(0) {}
     unsigned short type;
     unsigned short index;
-    string name;
     double nvalue;
+    // Integers are kept as is, nvalue is the same as a double
+    sqlite3_int64 ivalue;
     string svalue;
+    // BLOB data: a malloc'ed buffer for results which is handed over to a JS Buffer as is, or a pinned Buffer for parameters
+    char *blob;
+    size_t length;
+};
+
+typedef vector<SQLiteField> Row;
+
+static inline SQLiteField IntegerField(unsigned short index, sqlite3_int64 value)
+{
+    SQLiteField field(index, SQLITE_INTEGER, value);
+    field.ivalue = value;
+    return field;
+}
+
+static SQLiteField GetBlob(sqlite3_stmt *stmt, int i)
+{
+    SQLiteField field(i, SQLITE_BLOB);
+    field.length = sqlite3_column_bytes(stmt, i);
+    if (field.length) {
+        field.blob = (char*)malloc(field.length);
+        if (field.blob) {
+            memcpy(field.blob, sqlite3_column_blob(stmt, i), field.length);
+        } else {
+            field.length = 0;
+        }
+    }
+    return field;
+}
+
+// Free blobs not passed to JS
+static void FreeRow(Row &row)
+{
+    for (uint i = 0; i < row.size(); i++) free(row[i].blob);
+    row.clear();
+}
+
+// Statement parameters, bound with SQLITE_STATIC: strings are encoded once into the fields,
+// Buffers are bound in place and kept alive by the pinned list, the statement is unbound once the execution is done
+struct SQLiteParams: public Row {
+    ~SQLiteParams() {
+        pinned.Reset();
+    }
+    Nan::Persistent<Array> pinned;
+};
+
+// Column names and types of a prepared statement, resolved once per statement instead of for every row
+struct SQLiteColumns {
+    void Init(sqlite3_stmt *stmt) {
+        names.clear();
+        json.clear();
+        key.clear();
+        int cols = stmt ? sqlite3_column_count(stmt) : 0;
+        for (int i = 0; i < cols; i++) {
+            const char* name = sqlite3_column_name(stmt, i);
+            const char* dtype = sqlite3_column_decltype(stmt, i);
+            names.push_back(name ? name : "");
+            json.push_back(dtype && !strcasecmp(dtype, "json"));
+            key += names.back();
+            key += '\x01';
+        }
+    }
+
+    // Called on the first row of every execution, a statement reprepared after a schema change may return other columns.
+    // The reprepare counter is reset when the execution is collected, so it is not 0 only if it happened since then
+    inline bool Check(sqlite3_stmt *stmt) {
+        if (sqlite3_column_count(stmt) == size() && !sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0)) return false;
+        Init(stmt);
+        return true;
+    }
+
+    // JSON columns are always returned as text
+    inline int Type(sqlite3_stmt *stmt, int i) {
+        int type = sqlite3_column_type(stmt, i);
+        return json[i] && type != SQLITE_NULL ? SQLITE_TEXT : type;
+    }
+
+    inline int size() { return names.size(); }
+
+    vector<string> names;
+    vector<bool> json;
+    string key;
+};
+
+struct SQLiteCell {
+    int type;
+    int length;
+    union {
+        double nvalue;
+        sqlite3_int64 ivalue;
+        size_t offset;
+        char *blob;
+    };
+};
+
+// Rows of an async query: cells of all rows in one array with text in one byte buffer, the column names
+// are kept once in SQLiteColumns, blobs are separate malloc'ed buffers to be passed to JS as is
+struct SQLiteRows {
+    SQLiteRows(): ncols(0) {}
+    ~SQLiteRows() {
+        Clear();
+    }
+
+    void Add(sqlite3_stmt *stmt, SQLiteColumns &cols) {
+        ncols = cols.size();
+        for (int i = 0; i < ncols; i++) {
+            SQLiteCell cell;
+            cell.type = cols.Type(stmt, i);
+            cell.length = 0;
+            switch (cell.type) {
+            case SQLITE_INTEGER:
+                cell.ivalue = sqlite3_column_int64(stmt, i);
+                break;
+            case SQLITE_FLOAT:
+                cell.nvalue = sqlite3_column_double(stmt, i);
+                break;
+            case SQLITE_TEXT: {
+                const char *text = (const char*)sqlite3_column_text(stmt, i);
+                cell.length = sqlite3_column_bytes(stmt, i);
+                cell.offset = bytes.size();
+                bytes.insert(bytes.end(), text, text + cell.length);
+                break;
+            }
+            case SQLITE_BLOB:
+                cell.length = sqlite3_column_bytes(stmt, i);
+                cell.blob = cell.length ? (char*)malloc(cell.length) : NULL;
+                if (cell.blob) {
+                    memcpy(cell.blob, sqlite3_column_blob(stmt, i), cell.length);
+                } else {
+                    cell.length = 0;
+                }
+                break;
+            default:
+                cell.type = SQLITE_NULL;
+            }
+            cells.push_back(cell);
+        }
+    }
+
+    // Storage is kept for the next batch
+    void Clear() {
+        for (uint i = 0; i < cells.size(); i++) {
+            if (cells[i].type == SQLITE_BLOB) free(cells[i].blob);
+        }
+        cells.clear();
+        bytes.clear();
+    }
+
+    inline size_t size() { return ncols ? cells.size() / ncols : 0; }
+
+    int ncols;
+    vector<SQLiteCell> cells;
+    vector<char> bytes;
+};
+
+enum { FORMAT_OBJECTS, FORMAT_COLUMNS, FORMAT_RAW };
+enum { BIGINT_NEVER, BIGINT_AUTO, BIGINT_ALWAYS };
+
+// Integers beyond this lose precision as doubles
+#define MAX_SAFE_INTEGER 9007199254740991LL
+
+// Per query options: { format: "objects|columns|raw", bigint: "never|auto|always", batch: N }
+struct SQLiteOptions {
+    SQLiteOptions(): format(FORMAT_OBJECTS), bigint(BIGINT_NEVER), batch(0) {}
+    int format;
+    int bigint;
+    int batch;
+};
+
+// Connection settings from the open options, applied to every connection of the database when it is opened,
+// the main connection also gets the settings that only a writer can change
+struct SQLiteTuning {
+    SQLiteTuning(): busy_timeout(-1) {}
+    string writer;
+    string pragmas;
+    int busy_timeout;
+};
+
+// Page cache counters of a database, shared by the page caches of all its connections and freed with the last of them
+struct SQLitePageStats {
+    SQLitePageStats(): refs(1), pages(0), bytes(0), hits(0), misses(0), evictions(0) {}
+    int refs;
+    sqlite3_int64 pages;
+    sqlite3_int64 bytes;
+    sqlite3_int64 hits;
+    sqlite3_int64 misses;
+    sqlite3_int64 evictions;
+};
+
+// Execution counters of a statement, times are in milliseconds, memused is the largest seen
+struct SQLiteStmtStats {
+    SQLiteStmtStats(): count(0), time(0), max_time(0), rows(0), fullscan(0), sort(0), autoindex(0), vmstep(0), reprepare(0), run(0), memused(0) {}
+
+    void Add(const SQLiteStmtStats &s) {
+        count += s.count;
+        time += s.time;
+        max_time = max(max_time, s.max_time);
+        rows += s.rows;
+        fullscan += s.fullscan;
+        sort += s.sort;
+        autoindex += s.autoindex;
+        vmstep += s.vmstep;
+        reprepare += s.reprepare;
+        run += s.run;
+        memused = max(memused, s.memused);
+    }
+
+    void Set(Local<Object> obj) {
+        Nan::Set(obj, Nan::New("count").ToLocalChecked(), Nan::New(count));
+        Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New(time));
+        Nan::Set(obj, Nan::New("max_time").ToLocalChecked(), Nan::New(max_time));
+        Nan::Set(obj, Nan::New("rows").ToLocalChecked(), Nan::New(rows));
+        Nan::Set(obj, Nan::New("fullscan_steps").ToLocalChecked(), Nan::New(fullscan));
+        Nan::Set(obj, Nan::New("sorts").ToLocalChecked(), Nan::New(sort));
+        Nan::Set(obj, Nan::New("autoindexes").ToLocalChecked(), Nan::New(autoindex));
+        Nan::Set(obj, Nan::New("vm_steps").ToLocalChecked(), Nan::New(vmstep));
+        Nan::Set(obj, Nan::New("reprepares").ToLocalChecked(), Nan::New(reprepare));
+        Nan::Set(obj, Nan::New("runs").ToLocalChecked(), Nan::New(run));
+        Nan::Set(obj, Nan::New("memused").ToLocalChecked(), Nan::New(memused));
+    }
+
+    double count;
+    double time;
+    double max_time;
+    double rows;
+    double fullscan;
+    double sort;
+    double autoindex;
+    double vmstep;
+    double reprepare;
+    double run;
+    double memused;
 };
 
-static bool sqliteInitDb(sqlite3 *handle);
-static int sqlitePrepare(sqlite3 *db, sqlite3_stmt **stmt, string sql, int count = 1, int timeout = 100);
+// Counters of a statement object, added by the thread that ran it and read by stats() in the main thread
+struct SQLiteStmtCounters {
+    SQLiteStmtCounters() { uv_mutex_init(&mutex); }
+    ~SQLiteStmtCounters() { uv_mutex_destroy(&mutex); }
+
+    void Add(const SQLiteStmtStats &s) {
+        uv_mutex_lock(&mutex);
+        stats.Add(s);
+        uv_mutex_unlock(&mutex);
+    }
+
+    SQLiteStmtStats Get() {
+        uv_mutex_lock(&mutex);
+        SQLiteStmtStats rc = stats;
+        uv_mutex_unlock(&mutex);
+        return rc;
+    }
+
+    uv_mutex_t mutex;
+    SQLiteStmtStats stats;
+};
+
+// Page caches created by the current thread belong to this database, set while a job or a sync call uses its connections
+// because SQLite creates caches later as well: again once the page size is read from the file, for ATTACH and temp tables
+static thread_local SQLitePageStats *_pcache_owner = NULL;
+
+struct SQLitePCacheOwner {
+    SQLitePCacheOwner(SQLitePageStats *stats): prev(_pcache_owner) { _pcache_owner = stats; }
+    ~SQLitePCacheOwner() { _pcache_owner = prev; }
+    SQLitePageStats *prev;
+};
+
+// Column values for the columnar format, numbers are stored as doubles with a null bitmap in malloc'ed buffers
+// which are handed over to typed arrays as is, a column switches to generic values once a text or blob is seen.
+// Integer columns keep int64 values in the same buffer until the first float is seen
+struct SQLiteColumnData {
+    SQLiteColumnData(int index_): index(index_), numeric(true), integer(true), unsafe(false), hasnulls(false), count(0), size(0), data(NULL), nulls(NULL) {}
+    ~SQLiteColumnData() {
+        free(data);
+        free(nulls);
+        FreeRow(values);
+    }
+
+    void Add(sqlite3_stmt *stmt, int type) {
+        if (numeric) {
+            if (count == size) {
+                size = size ? size * 2 : 64;
+                data = (double*)realloc(data, size * sizeof(double));
+                nulls = (uint8_t*)realloc(nulls, size / 8);
+                memset(nulls + count / 8, 0, (size - count) / 8);
+            }
+            switch (type) {
+            case SQLITE_INTEGER: {
+                sqlite3_int64 value = sqlite3_column_int64(stmt, index);
+                if (integer) {
+                    ints()[count++] = value;
+                    if (value > MAX_SAFE_INTEGER || value < -MAX_SAFE_INTEGER) unsafe = true;
+                } else {
+                    data[count++] = value;
+                }
+                return;
+            }
+            case SQLITE_FLOAT:
+                if (integer) Float();
+                data[count++] = sqlite3_column_double(stmt, index);
+                return;
+            case SQLITE_NULL:
+                data[count] = 0;
+                nulls[count / 8] |= 1 << (count % 8);
+                hasnulls = true;
+                count++;
+                return;
+            }
+            Generic();
+        }
+        const char *text;
+        switch (type) {
+        case SQLITE_INTEGER:
+            values.push_back(IntegerField(index, sqlite3_column_int64(stmt, index)));
+            break;
+        case SQLITE_FLOAT:
+            values.push_back(SQLiteField(index, type, sqlite3_column_double(stmt, index)));
+            break;
+        case SQLITE_TEXT:
+            text = (const char*)sqlite3_column_text(stmt, index);
+            values.push_back(SQLiteField(index, type, 0, string(text, sqlite3_column_bytes(stmt, index))));
+            break;
+        case SQLITE_BLOB:
+            values.push_back(GetBlob(stmt, index));
+            break;
+        default:
+            values.push_back(SQLiteField(index));
+        }
+        count++;
+    }
+
+    inline sqlite3_int64 *ints() { return (sqlite3_int64*)data; }
+
+    // Convert integers collected so far into doubles in place
+    void Float() {
+        integer = false;
+        sqlite3_int64 *list = ints();
+        for (int i = 0; i < count; i++) data[i] = list[i];
+    }
+
+    // Move all numbers collected so far into generic values
+    void Generic() {
+        numeric = false;
+        for (int i = 0; i < count; i++) {
+            if (nulls[i / 8] & (1 << (i % 8))) {
+                values.push_back(SQLiteField(index));
+            } else
+            if (integer) {
+                values.push_back(IntegerField(index, ints()[i]));
+            } else {
+                values.push_back(SQLiteField(index, SQLITE_FLOAT, data[i]));
+            }
+        }
+        free(data);
+        free(nulls);
+        data = NULL;
+        nulls = NULL;
+    }
+
+    int index;
+    bool numeric;
+    bool integer;
+    bool unsafe;
+    bool hasnulls;
+    int count;
+    int size;
+    double *data;
+    uint8_t *nulls;
+    Row values;
+};
+
+static void GetColumns(vector<SQLiteColumnData*> &columns, sqlite3_stmt *stmt, SQLiteColumns &cols)
+{
+    if (columns.empty()) {
+        for (int i = 0; i < cols.size(); i++) columns.push_back(new SQLiteColumnData(i));
+    }
+    for (int i = 0; i < cols.size(); i++) columns[i]->Add(stmt, cols.Type(stmt, i));
+}
+
+static void FreeColumns(vector<SQLiteColumnData*> &columns)
+{
+    for (uint i = 0; i < columns.size(); i++) delete columns[i];
+    columns.clear();
+}
+
+// V8 layout for rows with the same columns: internalized keys and an object template with all columns,
+// rows created from the template share the same hidden class
+struct SQLiteShape {
+    SQLiteShape(SQLiteColumns &cols) {
+        Nan::HandleScope scope;
+        Isolate *isolate = Isolate::GetCurrent();
+        Local<Array> list = Nan::New<Array>(cols.size());
+        Local<ObjectTemplate> t = Nan::New<ObjectTemplate>();
+        set<string> seen;
+        for (int i = 0; i < cols.size(); i++) {
+            Local<String> name = String::NewFromUtf8(isolate, cols.names[i].c_str(), NewStringType::kInternalized, cols.names[i].size()).ToLocalChecked();
+            Nan::Set(list, i, name);
+            if (seen.insert(cols.names[i]).second) t->Set(name, Nan::Null());
+        }
+        keys.Reset(list);
+        tpl.Reset(t);
+    }
+    ~SQLiteShape() {
+        keys.Reset();
+        tpl.Reset();
+    }
+    Nan::Persistent<Array> keys;
+    Nan::Persistent<ObjectTemplate> tpl;
+};
+
+// Creates row objects of the same shape in the current handle scope
+struct SQLiteRowBuilder {
+    SQLiteRowBuilder(SQLiteShape *shape, int bigint_ = BIGINT_NEVER): context(Nan::GetCurrentContext()), tpl(Nan::New(shape->tpl)), bigint(bigint_) {
+        Local<Array> list = Nan::New(shape->keys);
+        for (uint i = 0; i < list->Length(); i++) keys.push_back(Nan::Get(list, i).ToLocalChecked().As<String>());
+    }
+    inline Local<Object> New() {
+        return tpl->NewInstance(context).ToLocalChecked();
+    }
+    inline void Set(Local<Object> obj, int i, Local<Value> val) {
+        obj->CreateDataProperty(context, keys[i], val).FromJust();
+    }
+    // Column names for the raw format
+    inline Local<Array> Names() {
+        vector<Local<Value> > names(keys.begin(), keys.end());
+        return Array::New(Isolate::GetCurrent(), names.data(), names.size());
+    }
+    Local<Context> context;
+    Local<ObjectTemplate> tpl;
+    vector<Local<String> > keys;
+    int bigint;
+    // Reused for every positional row
+    vector<Local<Value> > values;
+};
+
+static bool sqliteInitDb(sqlite3 *handle, SQLiteTuning *tuning = NULL, bool reader = false);
+static int sqlitePrepare(sqlite3 *db, sqlite3_stmt **stmt, string sql, int count = 1, int timeout = 100, int flags = 0);
 static int sqliteStep(sqlite3_stmt *stmt, int count = 1, int timeout = 100);
 
-typedef vector<SQLiteField> Row;
+static bool sqliteIsWriter(const string &sql);
+static void sqliteStmtCollect(sqlite3_stmt *stmt, uint64_t start, int rows, SQLiteStmtCounters *own = NULL, int count = 1);
+static Local<Array> sqliteStmtQueries();
+static void sqliteMemInit();
+static bool sqliteMemConfigure(bool arena, string &message);
+static Local<Object> sqliteMemStats();
+static void sqlitePCacheInit();
+static void sqlitePCacheConfigure(double budget, int hugepages);
+static void sqlitePageRelease(SQLitePageStats *stats);
+static Local<Object> sqlitePCacheStats();
+#ifdef SQLITE_IO_URING
+static void sqliteUringInit();
+static Local<Object> sqliteUringStats();
+#endif
+static void sqliteQueueWork(uv_work_t *req, uv_work_cb work, uv_after_work_cb after);
+static Local<Value> GetOption(Local<Object> opts, const char *name);
+static int GetOptionInt(Local<Object> opts, const char *name, int dflt);
+static int BindField(sqlite3_stmt *stmt, int index, SQLiteField &field);
+static bool BindParameters(Row &params, sqlite3_stmt *stmt);
+
 class SQLiteStatement;
+class SQLiteDatabase;
+class SQLiteTransaction;
 
 static map<SQLiteStatement*,bool> _stmts;
+static map<SQLiteDatabase*,bool> _dbs;
+// Set once the first database is created, SQLite memory may be in use from then on
+static bool _opened = false;
+
+// Databases with jobs collected in the current loop iteration, flushed by the check handle
+static set<SQLiteDatabase*> _batching;
+static uv_check_t *_check = NULL;
+static uv_idle_t *_idle = NULL;
+
+// LRU cache of prepared statements for a connection keyed by SQL text, a statement is taken out of the cache
+// for exclusive use by a single query and put back after it is done, the same SQL can have several idle copies
+class SQLiteCache {
+public:
+    SQLiteCache(int size = 64): max(size), hits(0), misses(0), evictions(0) { uv_mutex_init(&mutex); }
+    ~SQLiteCache() { Clear(); uv_mutex_destroy(&mutex); }
+
+    int Prepare(sqlite3 *db, sqlite3_stmt **stmt, const string &sql, int count, int timeout) {
+        uv_mutex_lock(&mutex);
+        multimap<string,Items::iterator>::iterator it = index.find(sql);
+        if (it != index.end()) {
+            *stmt = it->second->second;
+            items.erase(it->second);
+            index.erase(it);
+            hits++;
+            uv_mutex_unlock(&mutex);
+            return SQLITE_OK;
+        }
+        misses++;
+        uv_mutex_unlock(&mutex);
+        return sqlitePrepare(db, stmt, sql, count, timeout, max > 0 ? SQLITE_PREPARE_PERSISTENT : 0);
+    }
+
+    // Return the statement back, statements that failed because of the schema change are not reused
+    void Release(const string &sql, sqlite3_stmt *stmt, int status) {
+        if (!stmt) return;
+        if (max <= 0 || status == SQLITE_SCHEMA || sqlite3_reset(stmt) == SQLITE_SCHEMA) {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        sqlite3_clear_bindings(stmt);
+        uv_mutex_lock(&mutex);
+        items.push_front(pair<string,sqlite3_stmt*>(sql, stmt));
+        index.insert(pair<string,Items::iterator>(sql, items.begin()));
+        while ((int)items.size() > max) {
+            Items::iterator last = --items.end();
+            Remove(last);
+            sqlite3_finalize(last->second);
+            items.erase(last);
+            evictions++;
+        }
+        uv_mutex_unlock(&mutex);
+    }
+
+    void Clear() {
+        uv_mutex_lock(&mutex);
+        for (Items::iterator it = items.begin(); it != items.end(); it++) sqlite3_finalize(it->second);
+        items.clear();
+        index.clear();
+        uv_mutex_unlock(&mutex);
+    }
+
+    int size() { return items.size(); }
+
+    int max;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+
+private:
+    typedef list<pair<string,sqlite3_stmt*> > Items;
+
+    void Remove(Items::iterator item) {
+        pair<multimap<string,Items::iterator>::iterator,multimap<string,Items::iterator>::iterator> range = index.equal_range(item->first);
+        for (multimap<string,Items::iterator>::iterator it = range.first; it != range.second; it++) {
+            if (it->second == item) {
+                index.erase(it);
+                break;
+            }
+        }
+    }
+
+    Items items;
+    multimap<string,Items::iterator> index;
+    uv_mutex_t mutex;
+};
+
+// Dedicated worker threads for all database jobs so long queries do not block the libuv pool used by fs, dns and crypto,
+// completed jobs are passed back to the loop via an async handle
+class SQLiteWorkers {
+public:
+    struct Job {
+        uv_work_t *req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+    };
+
+    SQLiteWorkers(): size(4), busy(0), completed(0), pending(0), started(false) {}
+
+    void Start() {
+        if (started) return;
+        started = true;
+        uv_mutex_init(&mutex);
+        uv_cond_init(&cond);
+        uv_async_init(uv_default_loop(), &async, Done);
+        uv_unref((uv_handle_t*)&async);
+        async.data = this;
+    }
+
+    // The pool can only grow, zero means use the libuv pool
+    void Resize(int n) {
+        size = n;
+        if (!size) return;
+        Start();
+        while ((int)threads.size() < size) {
+            uv_thread_t tid;
+            if (uv_thread_create(&tid, Run, this)) break;
+            threads.push_back(tid);
+        }
+    }
+
+    void Queue(uv_work_t *req, uv_work_cb work, uv_after_work_cb after) {
+        if (!size) {
+            uv_queue_work(uv_default_loop(), req, work, after);
+            return;
+        }
+        if (!threads.size()) Resize(size);
+        if (pending++ == 0) uv_ref((uv_handle_t*)&async);
+        Job job = { req, work, after };
+        uv_mutex_lock(&mutex);
+        jobs.push_back(job);
+        uv_cond_signal(&cond);
+        uv_mutex_unlock(&mutex);
+    }
+
+    static void Run(void *arg) {
+        SQLiteWorkers *self = (SQLiteWorkers*)arg;
+        uv_mutex_lock(&self->mutex);
+        while (1) {
+            while (self->jobs.empty()) uv_cond_wait(&self->cond, &self->mutex);
+            Job job = self->jobs.front();
+            self->jobs.pop_front();
+            self->busy++;
+            uv_mutex_unlock(&self->mutex);
+
+            job.work(job.req);
+
+            uv_mutex_lock(&self->mutex);
+            self->busy--;
+            self->completed++;
+            self->done.push_back(job);
+            uv_async_send(&self->async);
+        }
+    }
+
+    static void Done(uv_async_t *async) {
+        SQLiteWorkers *self = (SQLiteWorkers*)async->data;
+        deque<Job> list;
+        uv_mutex_lock(&self->mutex);
+        list.swap(self->done);
+        uv_mutex_unlock(&self->mutex);
+        for (uint i = 0; i < list.size(); i++) {
+            list[i].after(list[i].req, 0);
+            if (--self->pending == 0) uv_unref((uv_handle_t*)&self->async);
+        }
+    }
+
+    int size;
+    int busy;
+    unsigned long completed;
+    int pending;
+    bool started;
+    vector<uv_thread_t> threads;
+    deque<Job> jobs;
+    deque<Job> done;
+    uv_mutex_t mutex;
+    uv_cond_t cond;
+    uv_async_t async;
+};
+
+static SQLiteWorkers _workers;
+
+static void sqliteQueueWork(uv_work_t *req, uv_work_cb work, uv_after_work_cb after)
+{
+    _workers.Queue(req, work, after);
+}
+
+// Read-only connection from the database readers pool, used exclusively by one query at a time
+struct SQLiteReader {
+    SQLiteReader(int size): handle(NULL), cache(size) {}
+    ~SQLiteReader() {
+        cache.Clear();
+        sqlite3_close_v2(handle);
+    }
+    sqlite3 *handle;
+    SQLiteCache cache;
+};
+
+// Jobs on the main connection are started by the database in order: while a transaction handle owns the connection
+// only its jobs run, one at a time, the rest waits unless it can run on a reader. Read jobs start once they have a reader
+struct SQLiteJob {
+    uv_work_t request;
+    uv_work_t *req;
+    uv_work_cb work;
+    uv_after_work_cb after;
+    SQLiteDatabase *db;
+    SQLiteTransaction *owner;
+    SQLiteReader **reader;
+    bool read;
+    bool exclusive;
+    bool drain;
+    unsigned long seq;
+};
+
+// Jobs started in the same loop iteration run in one worker call
+struct SQLiteJobs {
+    uv_work_t request;
+    vector<SQLiteJob*> jobs;
+};
 
 class SQLiteDatabase: public Nan::ObjectWrap {
 public:
@@ -90,7 +778,15 @@ public:
         Nan::SetPrototypeMethod(tpl, "runSync", RunSync);
         Nan::SetPrototypeMethod(tpl, "query", Query);
         Nan::SetPrototypeMethod(tpl, "querySync", QuerySync);
+        Nan::SetPrototypeMethod(tpl, "iterate", Iterate);
+        Nan::SetPrototypeMethod(tpl, "runBatch", RunBatch);
+        Nan::SetPrototypeMethod(tpl, "insertColumns", InsertColumns);
+        Nan::SetPrototypeMethod(tpl, "transaction", Transaction);
+        Nan::SetPrototypeMethod(tpl, "pipeline", Pipeline);
+        Nan::SetPrototypeMethod(tpl, "backup", Backup);
         Nan::SetPrototypeMethod(tpl, "copy", Copy);
+        Nan::SetPrototypeMethod(tpl, "serialize", Serialize);
+        Nan::SetPrototypeMethod(tpl, "deserialize", Deserialize);
 
         constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
         Nan::Set(target, Nan::New("Database").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
@@ -112,7 +808,7 @@ public:
         sqlite3_int64 inserted_id;
         int changes;
 
-        Baton(SQLiteDatabase* db_, Local<Function> cb_, string s = "", int i = 0): db(db_), status(SQLITE_OK), sparam(s), iparam(i) {
+        Baton(SQLiteDatabase* db_, Local<Function> cb_, string s = "", int i = 0): db(db_), status(SQLITE_OK), sparam(s), iparam(i), inserted_id(0), changes(0) {
             db->Ref();
             request.data = this;
             if (!cb_.IsEmpty()) callback.Reset(cb_);
@@ -123,10 +819,198 @@ public:
         }
     };
 
+    // One statement executed for many parameter sets, errors are collected per row
+    struct BatchError {
+        uint index;
+        int status;
+        string message;
+    };
+    struct BatchBaton: Baton {
+        deque<SQLiteParams> rows;
+        vector<BatchError> errors;
+        bool stop;
+
+        BatchBaton(SQLiteDatabase* db_, Local<Function> cb_, string sql): Baton(db_, cb_, sql), stop(false) {}
+        virtual uint Size() {
+            return rows.size();
+        }
+        // Returns a status, SQLite errors are taken from the connection, other errors are described in the message
+        virtual int Bind(sqlite3_stmt *stmt, uint row, string &message) {
+            if (rows[row].empty()) sqlite3_clear_bindings(stmt);
+            return BindParameters(rows[row], stmt) ? SQLITE_OK : SQLITE_ERROR;
+        }
+    };
+
+    // Rows taken by index from typed arrays or from parsed arrays of values, one per column
+    enum { COLUMN_VALUES, COLUMN_FLOAT64, COLUMN_FLOAT32, COLUMN_INT32, COLUMN_UINT32, COLUMN_INT16, COLUMN_UINT16,
+           COLUMN_INT8, COLUMN_UINT8, COLUMN_BIGINT64, COLUMN_BIGUINT64 };
+    struct BatchColumn {
+        int type;
+        const char *data;
+        uint values;
+    };
+    struct ColumnsBaton: BatchBaton {
+        vector<BatchColumn> columns;
+        Nan::Persistent<Array> pinned;
+        uint count;
+
+        ColumnsBaton(SQLiteDatabase* db_, Local<Function> cb_): BatchBaton(db_, cb_, string()), count(0) {}
+        virtual ~ColumnsBaton() {
+            pinned.Reset();
+        }
+        virtual uint Size() {
+            return count;
+        }
+        virtual int Bind(sqlite3_stmt *stmt, uint row, string &message) {
+            sqlite3_reset(stmt);
+            for (uint i = 0; i < columns.size(); i++) {
+                const char *data = columns[i].data;
+                int status = SQLITE_OK;
+                switch (columns[i].type) {
+                case COLUMN_VALUES:
+                    status = BindField(stmt, i + 1, rows[columns[i].values][row]);
+                    break;
+                case COLUMN_FLOAT64:
+                    status = sqlite3_bind_double(stmt, i + 1, ((const double*)data)[row]);
+                    break;
+                case COLUMN_FLOAT32:
+                    status = sqlite3_bind_double(stmt, i + 1, ((const float*)data)[row]);
+                    break;
+                case COLUMN_INT32:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const int32_t*)data)[row]);
+                    break;
+                case COLUMN_UINT32:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const uint32_t*)data)[row]);
+                    break;
+                case COLUMN_INT16:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const int16_t*)data)[row]);
+                    break;
+                case COLUMN_UINT16:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const uint16_t*)data)[row]);
+                    break;
+                case COLUMN_INT8:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const int8_t*)data)[row]);
+                    break;
+                case COLUMN_UINT8:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const uint8_t*)data)[row]);
+                    break;
+                case COLUMN_BIGINT64:
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const int64_t*)data)[row]);
+                    break;
+                case COLUMN_BIGUINT64:
+                    if (((const uint64_t*)data)[row] > INT64_MAX) {
+                        message = "Value of column " + to_string(i) + " is out of the 64-bit integer range";
+                        return SQLITE_RANGE;
+                    }
+                    status = sqlite3_bind_int64(stmt, i + 1, ((const uint64_t*)data)[row]);
+                    break;
+                }
+                if (status != SQLITE_OK) return status;
+            }
+            return SQLITE_OK;
+        }
+    };
+
+    // Statement batons of db.run calls committed together
+    struct GroupBaton: Baton {
+        vector<uv_work_t*> reqs;
+
+        GroupBaton(SQLiteDatabase* db_): Baton(db_, Local<Function>()) {}
+    };
+
+    // Independent statements run back to back in one worker call, each with its own result or error
+    struct PipelineItem {
+        string sql;
+        SQLiteParams params;
+        SQLiteColumns cols;
+        SQLiteRows rows;
+        vector<SQLiteColumnData*> columns;
+        int status;
+        string message;
+
+        PipelineItem(): status(SQLITE_OK) {}
+        ~PipelineItem() {
+            FreeColumns(columns);
+        }
+    };
+    struct PipelineBaton: Baton {
+        deque<PipelineItem> items;
+        SQLiteOptions opts;
+        SQLiteReader *reader;
+        bool snapshot;
+        bool read;
+
+        PipelineBaton(SQLiteDatabase* db_, Local<Function> cb_): Baton(db_, cb_), reader(NULL), snapshot(false), read(false) {}
+    };
+
+    // Online backup into another database, one step per job so other jobs can run in between
+    struct BackupBaton: Baton {
+        SQLiteDatabase *dest;
+        sqlite3 *handle2;
+        sqlite3_backup *backup;
+        Nan::Persistent<Function> progress;
+        uv_timer_t *timer;
+        int pages;
+        int sleep;
+        int remaining;
+        int pagecount;
+        bool done;
+        // Busy or locked steps are retried for up to busy_timeout ms since the first of them
+        int busy_timeout;
+        uint64_t busy;
+
+        BackupBaton(SQLiteDatabase* db_, Local<Function> cb_, string file): Baton(db_, cb_, file), dest(NULL), handle2(NULL), backup(NULL), timer(NULL),
+                                                                            pages(100), sleep(0), remaining(0), pagecount(0), done(false),
+                                                                            busy_timeout(5000), busy(0) {}
+        virtual ~BackupBaton() {
+            progress.Reset();
+            if (dest) dest->Unref();
+            if (timer) uv_close((uv_handle_t*)timer, FreeTimer);
+        }
+    };
+
     friend class SQLiteStatement;
+    friend class SQLiteTransaction;
+
+    SQLiteDatabase(string name_ = string()) : Nan::ObjectWrap(), _handle(NULL), name(name_), timeout(500), retries(2), nreaders(0), txn(NULL), running(0), exclusive(false), seq(0), reading(0), draining(0),
+                                              group_commit(0), group_size(100), timer(NULL), group_commits(0), group_writes(0),
+                                              coalesce(false), batches(0), batched(0), pages(new SQLitePageStats()) {
+        _dbs[this] = 0;
+        _opened = true;
+        uv_mutex_init(&mutex);
+    }
+    virtual ~SQLiteDatabase() {
+        for (map<string,SQLiteShape*>::iterator it = shapes.begin(); it != shapes.end(); it++) delete it->second;
+        CloseReaders();
+        sqlite3_close_v2(_handle);
+        sqlitePageRelease(pages);
+        if (timer) uv_close((uv_handle_t*)timer, FreeTimer);
+        _dbs.erase(this);
+        uv_mutex_destroy(&mutex);
+    }
 
-    SQLiteDatabase() : Nan::ObjectWrap(), _handle(NULL), timeout(500), retries(2) {}
-    virtual ~SQLiteDatabase() { sqlite3_close_v2(_handle); }
+    int OpenReaders(int mode, string &message);
+    void CloseReaders();
+    SQLiteShape *GetShape(SQLiteColumns &cols);
+    SQLiteReader *AcquireReader();
+    void ReleaseReader(SQLiteReader *reader);
+    bool IsWriter(const string &sql);
+    void SetWriter(const string &sql);
+    bool IsReader(const string &sql);
+    void SetReader(const string &sql);
+    bool Locked();
+    bool Pending();
+
+    void Queue(uv_work_t *req, uv_work_cb work, uv_after_work_cb after, SQLiteTransaction *owner = NULL, SQLiteReader **reader = NULL, bool exclusive = false, bool drain = false);
+    void Start(SQLiteJob *job);
+    void Dispatch();
+    static void Work_Job(uv_work_t* req);
+    static void Work_AfterJob(uv_work_t* req, int status);
+    void FlushBatch();
+    static void BatchCheck(uv_check_t *handle);
+    static void BatchIdle(uv_idle_t *handle);
+    static void Work_Jobs(uv_work_t* req);
+    static void Work_AfterJobs(uv_work_t* req, int status);
 
     static NAN_METHOD(NewDB);
     static NAN_GETTER(OpenGetter);
@@ -138,24 +1022,177 @@ public:
 
     static NAN_METHOD(QuerySync);
     static NAN_METHOD(Query);
+    static NAN_METHOD(Iterate);
+    static NAN_METHOD(Transaction);
     static NAN_METHOD(RunSync);
     static NAN_METHOD(Run);
     static NAN_METHOD(Exec);
     static void Work_Exec(uv_work_t* req);
     static void Work_AfterExec(uv_work_t* req);
+    static NAN_METHOD(RunBatch);
+    static NAN_METHOD(InsertColumns);
+    static void Work_RunBatch(uv_work_t* req);
+    static void ExecBatch(BatchBaton *baton);
+    static void Work_AfterRunBatch(uv_work_t* req);
+    void Group(uv_work_t *req);
+    void FlushGroup();
+    int ExecCached(const string &sql);
+    static void GroupTimer(uv_timer_t *handle);
+    static void FreeTimer(uv_handle_t *handle);
+    static void Work_Group(uv_work_t* req);
+    static void RunGroup(GroupBaton *baton);
+    static void Work_AfterGroup(uv_work_t* req);
+    static NAN_METHOD(Pipeline);
+    static void Work_Pipeline(uv_work_t* req);
+    static void Work_AfterPipeline(uv_work_t* req);
+    static NAN_METHOD(Backup);
+    static void BackupFinish(BackupBaton *baton);
+    static void BackupTimer(uv_timer_t *handle);
+    static void Work_Backup(uv_work_t* req);
+    static void Work_AfterBackup(uv_work_t* req);
 
     static NAN_METHOD(CloseSync);
     static NAN_METHOD(Close);
     static void Work_Close(uv_work_t* req);
     static void Work_AfterClose(uv_work_t* req);
     static NAN_METHOD(Copy);
+    static NAN_METHOD(Serialize);
+    static NAN_METHOD(Deserialize);
 
     sqlite3* _handle;
+    string name;
     int timeout;
     int retries;
+    SQLiteCache cache;
+
+    // Readers pool in WAL mode, all read-only statements run on readers, the rest on the main handle
+    int nreaders;
+    vector<SQLiteReader*> readers;
+    vector<SQLiteReader*> idle;
+    set<string> writers;
+    set<string> readonly;
+    uv_mutex_t mutex;
+
+    // Row shapes by column list, used in the main thread only
+    map<string,SQLiteShape*> shapes;
+
+    // Settings for every connection from the open options
+    SQLiteTuning tuning;
+
+    // Scheduling of the main connection, used in the main thread only: the transaction that owns the connection,
+    // transactions waiting for it, jobs waiting for the transactions and the number of jobs started outside of them,
+    // an exclusive job like a batch runs alone as a transaction does, read jobs waiting for a free reader and the number
+    // of running ones, reads do not hold back transactions
+    SQLiteTransaction *txn;
+    deque<SQLiteTransaction*> txns;
+    deque<SQLiteJob*> waiting;
+    int running;
+    bool exclusive;
+    unsigned long seq;
+    deque<SQLiteJob*> reads;
+    int reading;
+    // Seq of the queued close, reads queued after it do not start on the readers that are about to be closed
+    unsigned long draining;
+
+    // Group commit: db.run statements collected for up to group_commit ms or group_size statements run in one transaction
+    int group_commit;
+    int group_size;
+    vector<uv_work_t*> group;
+    uv_timer_t *timer;
+    double group_commits;
+    double group_writes;
+
+    // Micro-batching: jobs started in the same loop iteration are coalesced into one worker call
+    bool coalesce;
+    vector<SQLiteJob*> batch;
+    double batches;
+    double batched;
+
+    // Page cache counters of all connections
+    SQLitePageStats *pages;
+};
+
+enum { TXN_BEGIN, TXN_COMMIT, TXN_ROLLBACK };
+
+static Nan::Persistent<ObjectTemplate> _txn;
+
+// Transaction handle, owns the main connection from BEGIN until COMMIT or ROLLBACK, all its statements run in order
+// one at a time, nested handles are savepoints in the same transaction
+class SQLiteTransaction: public Nan::ObjectWrap {
+public:
+    static NAN_MODULE_INIT(Init) {
+        Local<ObjectTemplate> t = Nan::New<ObjectTemplate>();
+        t->SetInternalFieldCount(1);
+        Nan::SetMethod(t, "run", Run);
+        Nan::SetMethod(t, "query", Query);
+        Nan::SetMethod(t, "transaction", Transaction);
+        Nan::SetMethod(t, "commit", Commit);
+        Nan::SetMethod(t, "rollback", Rollback);
+        _txn.Reset(t);
+    }
+
+    static Local<Object> Create(SQLiteDatabase *db, SQLiteTransaction *parent, string mode);
+
+    struct Baton {
+        uv_work_t request;
+        SQLiteTransaction* txn;
+        Nan::Persistent<Function> callback;
+        int op;
+        int status;
+        string message;
+        bool open;
+
+        Baton(SQLiteTransaction* txn_, Local<Function> cb_, int op_): txn(txn_), op(op_), status(SQLITE_OK), open(false) {
+            txn->Ref();
+            request.data = this;
+            if (!cb_.IsEmpty()) callback.Reset(cb_);
+        }
+        virtual ~Baton() {
+            txn->Unref();
+            callback.Reset();
+        }
+    };
+
+    friend class SQLiteDatabase;
+
+    SQLiteTransaction(SQLiteDatabase *db_, SQLiteTransaction *parent): Nan::ObjectWrap(), db(db_), root(parent ? parent->root : this), status(SQLITE_OK), savepoints(0), seq(0), busy(false), ended(false), finished(false) {
+        db->Ref();
+        if (root != this) root->Ref();
+    }
+    virtual ~SQLiteTransaction() {
+        if (root != this) root->Unref();
+        db->Unref();
+    }
+
+    static NAN_METHOD(Run);
+    static NAN_METHOD(Query);
+    static NAN_METHOD(Transaction);
+    static NAN_METHOD(Commit);
+    static NAN_METHOD(Rollback);
+    static void End(const Nan::FunctionCallbackInfo<v8::Value>& info, int op);
+    static void Work_Control(uv_work_t* req);
+    static void Work_AfterControl(uv_work_t* req);
+
+    SQLiteDatabase *db;
+    SQLiteTransaction *root;
+    // BEGIN mode for the root, savepoint name for nested handles
+    string mode;
+    string name;
+    // Result of BEGIN, statements fail with it if the transaction could not be started
+    int status;
+    string message;
+    int savepoints;
+    // Start order among the waiting transactions and jobs
+    unsigned long seq;
+    // Jobs of the root and its nested handles, one runs at a time
+    deque<SQLiteJob*> jobs;
+    bool busy;
+    bool ended;
+    bool finished;
 };
 
 static Nan::Persistent<ObjectTemplate> _tpl;
+static Nan::Persistent<ObjectTemplate> _cursor;
 
 class SQLiteStatement: public Nan::ObjectWrap {
 public:
@@ -169,6 +1206,7 @@ public:
         Nan::SetPrototypeMethod(tpl, "runSync", RunSync);
         Nan::SetPrototypeMethod(tpl, "query", Query);
         Nan::SetPrototypeMethod(tpl, "querySync", QuerySync);
+        Nan::SetPrototypeMethod(tpl, "each", Each);
         Nan::SetPrototypeMethod(tpl, "finalize", Finalize);
 
         constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
@@ -177,6 +1215,14 @@ public:
         Local<ObjectTemplate> t = Nan::New<ObjectTemplate>();
         t->SetInternalFieldCount(1);
         _tpl.Reset(t);
+
+        // Async iterator over query results
+        Local<ObjectTemplate> c = Nan::New<ObjectTemplate>();
+        c->SetInternalFieldCount(1);
+        Nan::SetMethod(c, "next", CursorNext);
+        Nan::SetMethod(c, "return", CursorReturn);
+        c->Set(Symbol::GetAsyncIterator(Isolate::GetCurrent()), Nan::New<FunctionTemplate>(CursorSelf));
+        _cursor.Reset(c);
     }
 
     static inline Nan::Persistent<Function> & constructor() {
@@ -185,11 +1231,13 @@ public:
     }
     static NAN_METHOD(NewStmt);
 
-    static Local<Object> Create(SQLiteDatabase *db, string sql = string()) {
+    // Cached statements are taken from the database statement cache and put back on finalize
+    static Local<Object> Create(SQLiteDatabase *db, string sql = string(), bool cached = false, bool cursor = false) {
         Nan::EscapableHandleScope scope;
-        Local<ObjectTemplate> t = Nan::New(_tpl);
+        Local<ObjectTemplate> t = Nan::New(cursor ? _cursor : _tpl);
         Local<Object> obj = Nan::NewInstance(t).ToLocalChecked();
         SQLiteStatement* stmt = new SQLiteStatement(db, sql);
+        stmt->cached = cached;
         obj->SetInternalField(0, Nan::New(stmt));
         stmt->Wrap(obj);
         return scope.Escape(obj);
@@ -199,49 +1247,157 @@ public:
         uv_work_t request;
         SQLiteStatement* stmt;
         Nan::Persistent<Function> callback;
-        Row params;
-        vector<Row> rows;
+        SQLiteParams params;
+        SQLiteRows rows;
+        vector<SQLiteColumnData*> columns;
+        SQLiteOptions opts;
         sqlite3_int64 inserted_id;
         int changes;
         string sql;
 
-        Baton(SQLiteStatement* stmt_, Local<Function> cb_): stmt(stmt_), inserted_id(0), changes(0), sql(stmt->sql)  {
+        // Incremental stepping state for each and cursors
+        Nan::Persistent<Function> done;
+        Nan::Persistent<Promise::Resolver> resolver;
+        Nan::Persistent<Array> buffer;
+        uint pos;
+        int batch;
+        int total;
+        uint64_t elapsed;
+        bool started;
+        bool running;
+        bool eof;
+        bool stop;
+
+        Baton(SQLiteStatement* stmt_, Local<Function> cb_): stmt(stmt_), inserted_id(0), changes(0), sql(stmt->sql), pos(0), batch(0), total(0), elapsed(0), started(false), running(false), eof(false), stop(false)  {
             stmt->Ref();
             request.data = this;
             if (!cb_.IsEmpty()) callback.Reset(cb_);
         }
         virtual ~Baton() {
-            stmt->Unref();
+            FreeColumns(columns);
+            if (stmt) stmt->Unref();
             callback.Reset();
+            done.Reset();
+            resolver.Reset();
+            buffer.Reset();
         }
     };
 
-    SQLiteStatement(SQLiteDatabase* db_, string sql_ = string()): Nan::ObjectWrap(), db(db_), _handle(NULL), sql(sql_), status(SQLITE_OK), each(NULL) {
+    SQLiteStatement(SQLiteDatabase* db_, string sql_ = string()): Nan::ObjectWrap(), db(db_), _handle(NULL), conn(db_->_handle), reader(NULL), sql(sql_), status(SQLITE_OK), cached(false), each(NULL), owner(NULL) {
         db->Ref();
         _stmts[this] = 0;
     }
 
     virtual ~SQLiteStatement() {
+        // Abandoned cursor, its baton does not hold a reference while idle
+        if (each) {
+            each->stmt = NULL;
+            delete each;
+        }
+        bool held = reader != NULL;
         Finalize();
+        if (held) db->Dispatch();
         db->Unref();
         _stmts.erase(this);
     }
 
+    // Values are bound in place for one execution only, nothing points to them once the statement is done
+    void Unbind() {
+        if (!_handle) return;
+        sqlite3_reset(_handle);
+        sqlite3_clear_bindings(_handle);
+    }
+
     void Finalize(void) {
-        if (_handle) sqlite3_finalize(_handle);
+        if (reader) {
+            reader->cache.Release(sql, _handle, status);
+            db->ReleaseReader(reader);
+            reader = NULL;
+        } else
+        if (cached) {
+            db->cache.Release(sql, _handle, status);
+        } else
+        if (_handle) {
+            sqlite3_finalize(_handle);
+        }
         _handle = NULL;
     }
 
+    // Can run on a reader without waiting for a transaction on the main connection, a transaction opened by exec
+    // on the main handle keeps all statements there
+    bool CanRead() {
+        if (reader) return true;
+        return cached && !owner && !_handle && db->readers.size() && (db->Locked() || sqlite3_get_autocommit(db->_handle)) && db->IsReader(sql);
+    }
+
+    // Reader slot for the scheduler if the statement can run on a reader
+    SQLiteReader **ReadSlot() {
+        return CanRead() ? &reader : NULL;
+    }
+
     bool Prepare() {
         _handle = NULL;
-        status = sqlitePrepare(db->_handle, &_handle, sql, db->retries, db->timeout);
-        if (status != SQLITE_OK) {
-            message = string(sqlite3_errmsg(db->_handle));
-            if (_handle) sqlite3_finalize(_handle);
-            _handle = NULL;
+        conn = db->_handle;
+        if (owner && owner->status != SQLITE_OK) {
+            status = owner->status;
+            message = owner->message;
             return false;
         }
-        return true;
+        // Read jobs come with a reader from the scheduler and never fall back to the main connection
+        if (reader) {
+            status = reader->cache.Prepare(reader->handle, &_handle, sql, db->retries, db->timeout);
+            if (status == SQLITE_OK && _handle && sqlite3_stmt_readonly(_handle)) {
+                conn = reader->handle;
+                cols.Init(_handle);
+                return true;
+            }
+            if (status == SQLITE_OK) {
+                db->SetWriter(sql);
+                status = SQLITE_READONLY;
+                message = "Statement is not read-only";
+            } else {
+                message = string(sqlite3_errmsg(reader->handle));
+            }
+            if (_handle) sqlite3_finalize(_handle);
+            _handle = NULL;
+            db->ReleaseReader(reader);
+            reader = NULL;
+            return false;
+        }
+        // A job on the main connection still tries a free reader unless the statement is known to be a write
+        // or belongs to a transaction, it never waits for one
+        if (cached && db->readers.size() && !owner && !db->IsWriter(sql) && sqlite3_get_autocommit(db->_handle)) {
+            reader = db->AcquireReader();
+        }
+        if (reader) {
+            status = reader->cache.Prepare(reader->handle, &_handle, sql, db->retries, db->timeout);
+            if (status == SQLITE_OK && _handle && sqlite3_stmt_readonly(_handle)) {
+                conn = reader->handle;
+                cols.Init(_handle);
+                db->SetReader(sql);
+                return true;
+            }
+            if (status == SQLITE_OK) db->SetWriter(sql);
+            if (_handle) sqlite3_finalize(_handle);
+            _handle = NULL;
+            db->ReleaseReader(reader);
+            reader = NULL;
+        }
+        if (cached) {
+            status = db->cache.Prepare(conn, &_handle, sql, db->retries, db->timeout);
+        } else {
+            status = sqlitePrepare(conn, &_handle, sql, db->retries, db->timeout);
+        }
+        if (status != SQLITE_OK) {
+            message = string(sqlite3_errmsg(conn));
+            if (_handle) sqlite3_finalize(_handle);
+            _handle = NULL;
+            return false;
+        }
+        // Known reads go to the readers next time
+        if (cached && !owner && db->readers.size() && sqlite3_stmt_readonly(_handle) && !db->IsWriter(sql)) db->SetReader(sql);
+        cols.Init(_handle);
+        return true;
     }
 
     static NAN_METHOD(Finalize);
@@ -258,35 +1414,159 @@ public:
 
     static NAN_METHOD(QuerySync);
     static NAN_METHOD(Query);
+    static Local<Value> GetResult(Baton *baton);
+    static Local<Value> GetResult(SQLiteDatabase *db, SQLiteRows &rows, vector<SQLiteColumnData*> &columns, SQLiteColumns &cols, SQLiteOptions &opts);
+    static void Work_Fetch(Baton *baton);
     static void Work_Query(uv_work_t* req);
     static void Work_QueryPrepare(uv_work_t* req);
     static void Work_AfterQuery(uv_work_t* req);
 
+    static NAN_METHOD(Each);
+    static NAN_METHOD(EachNext);
+    static void EachDone(Baton *baton);
+    static void Work_Each(uv_work_t* req);
+    static void Work_AfterEach(uv_work_t* req);
+
+    static NAN_METHOD(CursorNext);
+    static NAN_METHOD(CursorReturn);
+    static NAN_METHOD(CursorSelf);
+    static Local<Object> Cursor(SQLiteDatabase *db, string sql, const Nan::FunctionCallbackInfo<v8::Value>& info, int idx);
+    static Local<Object> CursorResult(Baton *baton);
+    static void CursorDone(Baton *baton);
+    static void Work_Cursor(uv_work_t* req);
+    static void Work_AfterCursor(uv_work_t* req);
+
     SQLiteDatabase* db;
     sqlite3_stmt* _handle;
+    sqlite3* conn;
+    SQLiteReader* reader;
+    SQLiteColumns cols;
     string sql;
     string op;
     int status;
     string message;
+    bool cached;
     Baton *each;
+    // Root transaction the statement belongs to
+    SQLiteTransaction *owner;
+    // Counters of all executions of this statement object
+    SQLiteStmtCounters counters;
 };
 
+// Returns the list of active statements, everything else is attached to the list as properties
 NAN_METHOD(stats)
 {
     Nan::HandleScope scope;
+    // Creating the objects may run the GC which deletes statements and databases, local handles keep them alive
+    // until the lists are built
+    vector<SQLiteStatement*> stmts;
+    vector<SQLiteDatabase*> list;
+    vector<Local<Object> > holds;
+    for (map<SQLiteStatement*,bool>::const_iterator it = _stmts.begin(); it != _stmts.end(); it++) {
+        holds.push_back(it->first->handle());
+        stmts.push_back(it->first);
+    }
+    for (map<SQLiteDatabase*,bool>::const_iterator it = _dbs.begin(); it != _dbs.end(); it++) {
+        holds.push_back(it->first->handle());
+        list.push_back(it->first);
+    }
+
     Local<Array> keys = Nan::New<Array>();
-    map<SQLiteStatement*,bool>::const_iterator it = _stmts.begin();
-    int i = 0;
-    while (it != _stmts.end()) {
+    for (uint i = 0; i < stmts.size(); i++) {
         Local<Object> obj = Nan::New<Object>();
-        Nan::Set(obj, Nan::New("op").ToLocalChecked(), Nan::New(it->first->op.c_str()).ToLocalChecked());
-        Nan::Set(obj, Nan::New("sql").ToLocalChecked(), Nan::New(it->first->sql.c_str()).ToLocalChecked());
-        Nan::Set(obj, Nan::New("prepared").ToLocalChecked(), Nan::New(it->first->_handle != NULL));
+        Nan::Set(obj, Nan::New("op").ToLocalChecked(), Nan::New(stmts[i]->op.c_str()).ToLocalChecked());
+        Nan::Set(obj, Nan::New("sql").ToLocalChecked(), Nan::New(stmts[i]->sql.c_str()).ToLocalChecked());
+        Nan::Set(obj, Nan::New("prepared").ToLocalChecked(), Nan::New(stmts[i]->_handle != NULL));
+        stmts[i]->counters.Get().Set(obj);
         Nan::Set(keys, Nan::New(i), obj);
-        it++;
-        i++;
     }
-    NAN_RETURN(keys);
+    Local<Array> result = keys;
+    Nan::Set(result, Nan::New("queries").ToLocalChecked(), sqliteStmtQueries());
+
+    Local<Array> dbs = Nan::New<Array>();
+    for (uint i = 0; i < list.size(); i++) {
+        SQLiteDatabase *db = list[i];
+        Local<Object> obj = Nan::New<Object>();
+        Nan::Set(obj, Nan::New("name").ToLocalChecked(), Nan::New(db->name.c_str()).ToLocalChecked());
+        Nan::Set(obj, Nan::New("open").ToLocalChecked(), Nan::New(db->_handle != NULL));
+        Nan::Set(obj, Nan::New("readers").ToLocalChecked(), Nan::New((int)db->readers.size()));
+        Nan::Set(obj, Nan::New("readers_idle").ToLocalChecked(), Nan::New((int)db->idle.size()));
+        Nan::Set(obj, Nan::New("transaction").ToLocalChecked(), Nan::New(db->txn != NULL));
+        Nan::Set(obj, Nan::New("transactions_waiting").ToLocalChecked(), Nan::New((int)db->txns.size()));
+        Nan::Set(obj, Nan::New("jobs_waiting").ToLocalChecked(), Nan::New((int)db->waiting.size()));
+        Nan::Set(obj, Nan::New("reads_waiting").ToLocalChecked(), Nan::New((int)db->reads.size()));
+        Nan::Set(obj, Nan::New("group_commits").ToLocalChecked(), Nan::New(db->group_commits));
+        Nan::Set(obj, Nan::New("group_writes").ToLocalChecked(), Nan::New(db->group_writes));
+        Nan::Set(obj, Nan::New("batches").ToLocalChecked(), Nan::New(db->batches));
+        Nan::Set(obj, Nan::New("batch_avg").ToLocalChecked(), Nan::New(db->batches ? db->batched / db->batches : 0));
+        int size = db->cache.size();
+        double hits = db->cache.hits, misses = db->cache.misses, evictions = db->cache.evictions;
+        for (uint r = 0; r < db->readers.size(); r++) {
+            size += db->readers[r]->cache.size();
+            hits += db->readers[r]->cache.hits;
+            misses += db->readers[r]->cache.misses;
+            evictions += db->readers[r]->cache.evictions;
+        }
+        Local<Object> cache = Nan::New<Object>();
+        Nan::Set(cache, Nan::New("max").ToLocalChecked(), Nan::New(db->cache.max));
+        Nan::Set(cache, Nan::New("size").ToLocalChecked(), Nan::New(size));
+        Nan::Set(cache, Nan::New("hits").ToLocalChecked(), Nan::New(hits));
+        Nan::Set(cache, Nan::New("misses").ToLocalChecked(), Nan::New(misses));
+        Nan::Set(cache, Nan::New("evictions").ToLocalChecked(), Nan::New(evictions));
+        Nan::Set(obj, Nan::New("cache").ToLocalChecked(), cache);
+        Local<Object> pages = Nan::New<Object>();
+        Nan::Set(pages, Nan::New("pages").ToLocalChecked(), Nan::New((double)__atomic_load_n(&db->pages->pages, __ATOMIC_RELAXED)));
+        Nan::Set(pages, Nan::New("bytes").ToLocalChecked(), Nan::New((double)__atomic_load_n(&db->pages->bytes, __ATOMIC_RELAXED)));
+        Nan::Set(pages, Nan::New("hits").ToLocalChecked(), Nan::New((double)__atomic_load_n(&db->pages->hits, __ATOMIC_RELAXED)));
+        Nan::Set(pages, Nan::New("misses").ToLocalChecked(), Nan::New((double)__atomic_load_n(&db->pages->misses, __ATOMIC_RELAXED)));
+        Nan::Set(pages, Nan::New("evictions").ToLocalChecked(), Nan::New((double)__atomic_load_n(&db->pages->evictions, __ATOMIC_RELAXED)));
+        Nan::Set(obj, Nan::New("page_cache").ToLocalChecked(), pages);
+        Nan::Set(dbs, Nan::New(i), obj);
+    }
+    Nan::Set(result, Nan::New("databases").ToLocalChecked(), dbs);
+
+    Local<Object> workers = Nan::New<Object>();
+    int queue = 0, busy = 0;
+    if (_workers.started) {
+        uv_mutex_lock(&_workers.mutex);
+        queue = _workers.jobs.size();
+        busy = _workers.busy;
+        uv_mutex_unlock(&_workers.mutex);
+    }
+    Nan::Set(workers, Nan::New("threads").ToLocalChecked(), Nan::New((int)_workers.threads.size()));
+    Nan::Set(workers, Nan::New("busy").ToLocalChecked(), Nan::New(busy));
+    Nan::Set(workers, Nan::New("queue").ToLocalChecked(), Nan::New(queue));
+    Nan::Set(workers, Nan::New("pending").ToLocalChecked(), Nan::New(_workers.pending));
+    Nan::Set(workers, Nan::New("completed").ToLocalChecked(), Nan::New((double)_workers.completed));
+    Nan::Set(result, Nan::New("workers").ToLocalChecked(), workers);
+    Nan::Set(result, Nan::New("page_cache").ToLocalChecked(), sqlitePCacheStats());
+    Nan::Set(result, Nan::New("memory").ToLocalChecked(), sqliteMemStats());
+#ifdef SQLITE_IO_URING
+    Nan::Set(result, Nan::New("io_uring").ToLocalChecked(), sqliteUringStats());
+#endif
+    NAN_RETURN(result);
+}
+
+// Module wide settings: { threads: N, cache_memory: bytes, cache_hugepages: bool, allocator: "arena"|"system" }
+NAN_METHOD(configure)
+{
+    Nan::HandleScope scope;
+    if (info.Length() < 1 || !info[0]->IsObject()) return Nan::ThrowError("Options object expected");
+    Local<Object> opts = Nan::To<Object>(info[0]).ToLocalChecked();
+
+    int threads = GetOptionInt(opts, "threads", -1);
+    if (threads >= 0) _workers.Resize(threads);
+
+    Local<Value> budget = GetOption(opts, "cache_memory");
+    Local<Value> hugepages = GetOption(opts, "cache_hugepages");
+    sqlitePCacheConfigure(budget->IsNumber() ? Nan::To<double>(budget).FromJust() : -1,
+                          hugepages->IsUndefined() ? -1 : Nan::To<bool>(hugepages).FromJust());
+
+    Local<Value> allocator = GetOption(opts, "allocator");
+    if (allocator->IsString()) {
+        string message;
+        if (!sqliteMemConfigure(!strcmp(*Nan::Utf8String(allocator), "arena"), message)) return Nan::ThrowError(message.c_str());
+    }
 }
 
 NAN_MODULE_INIT(SqliteInit)
@@ -294,12 +1574,19 @@ NAN_MODULE_INIT(SqliteInit)
     Nan::HandleScope scope;
 
     NAN_EXPORT(target, stats);
+    NAN_EXPORT(target, configure);
 
+    sqliteMemInit();
+    sqlitePCacheInit();
     sqlite3_initialize();
     sqlite3_enable_shared_cache(1);
+#ifdef SQLITE_IO_URING
+    sqliteUringInit();
+#endif
 
     SQLiteDatabase::Init(target);
     SQLiteStatement::Init(target);
+    SQLiteTransaction::Init(target);
 
     NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_OPEN_READONLY, OPEN_READONLY);
     NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_OPEN_READWRITE, OPEN_READWRITE);
@@ -309,6 +1596,8 @@ NAN_MODULE_INIT(SqliteInit)
     NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_OPEN_SHAREDCACHE, OPEN_SHAREDCACHE);
     NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_OPEN_PRIVATECACHE, OPEN_PRIVATECACHE);
     NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_OPEN_URI, OPEN_URI);
+    NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_DESERIALIZE_READONLY, DESERIALIZE_READONLY);
+    NAN_DEFINE_CONSTANT_INTEGER(target, SQLITE_DESERIALIZE_RESIZEABLE, DESERIALIZE_RESIZEABLE);
 
     NAN_DEFINE_CONSTANT_STRING(target, SQLITE_VERSION, SQLITE_VERSION);
     NAN_DEFINE_CONSTANT_STRING(target, SQLITE_SOURCE_ID, SQLITE_SOURCE_ID);
@@ -345,6 +1634,33 @@ NAN_MODULE_INIT(SqliteInit)
 
 NODE_MODULE(binding, SqliteInit);
 
+static Local<Value> GetOption(Local<Object> opts, const char *name)
+{
+    return Nan::Get(opts, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+}
+
+static int GetOptionInt(Local<Object> opts, const char *name, int dflt)
+{
+    Local<Value> val = GetOption(opts, name);
+    return val->IsNumber() ? Nan::To<int32_t>(val).FromJust() : dflt;
+}
+
+static int BindField(sqlite3_stmt *stmt, int index, SQLiteField &field)
+{
+    switch (field.type) {
+    case SQLITE_INTEGER:
+        return sqlite3_bind_int64(stmt, index, field.ivalue);
+    case SQLITE_FLOAT:
+        return sqlite3_bind_double(stmt, index, field.nvalue);
+    case SQLITE_TEXT:
+        return sqlite3_bind_text(stmt, index, field.svalue.c_str(), field.svalue.size(), SQLITE_STATIC);
+    case SQLITE_BLOB:
+        return sqlite3_bind_blob(stmt, index, field.blob ? field.blob : "", field.length, SQLITE_STATIC);
+    default:
+        return sqlite3_bind_null(stmt, index);
+    }
+}
+
 static bool BindParameters(Row &params, sqlite3_stmt *stmt)
 {
     sqlite3_reset(stmt);
@@ -352,170 +1668,292 @@ static bool BindParameters(Row &params, sqlite3_stmt *stmt)
 
     sqlite3_clear_bindings(stmt);
     for (uint i = 0; i < params.size(); i++) {
-        SQLiteField &field = params[i];
-        int status;
-        switch (field.type) {
-        case SQLITE_INTEGER:
-            status = sqlite3_bind_int(stmt, field.index, field.nvalue);
-            break;
-        case SQLITE_FLOAT:
-            status = sqlite3_bind_double(stmt, field.index, field.nvalue);
-            break;
-        case SQLITE_TEXT:
-            status = sqlite3_bind_text(stmt, field.index, field.svalue.c_str(), field.svalue.size(), SQLITE_TRANSIENT);
-            break;
-        case SQLITE_BLOB:
-            status = sqlite3_bind_blob(stmt, field.index, field.svalue.c_str(), field.svalue.size(), SQLITE_TRANSIENT);
-            break;
-        case SQLITE_NULL:
-            status = sqlite3_bind_null(stmt, field.index);
-            break;
-        }
-        if (status != SQLITE_OK) return false;
+        if (BindField(stmt, params[i].index, params[i]) != SQLITE_OK) return false;
     }
     return true;
 }
 
-static bool ParseParameters(Row &params, const Nan::FunctionCallbackInfo<v8::Value>& args, int idx)
+// Encode a string as UTF-8 directly into the field
+static void GetString(string &out, Local<Value> value)
 {
-    Nan::HandleScope scope;
-    if (idx >= args.Length() || !args[idx]->IsArray()) return false;
+    Isolate *isolate = Isolate::GetCurrent();
+    Local<String> str = Nan::To<String>(value).ToLocalChecked();
+    out.resize(str->Utf8Length(isolate));
+    if (out.size()) str->WriteUtf8(isolate, &out[0], out.size(), NULL, String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8);
+}
 
-    Local<Array> array = Local<Array>::Cast(args[idx]);
+// Returns false with a RangeError thrown if a BigInt does not fit into 64 bits
+static bool ParseParameters(SQLiteParams &params, Local<Array> array)
+{
+    Nan::HandleScope scope;
+    Local<Array> pinned;
     for (uint i = 0, pos = 1; i < array->Length(); i++, pos++) {
         Local<Value> source = Nan::Get(array, i).ToLocalChecked();
 
         if (source->IsString() || source->IsRegExp()) {
-            Nan::Utf8String val(Nan::To<String>(source).ToLocalChecked());
-            params.push_back(SQLiteField(pos, SQLITE_TEXT, 0, string(*val, val.length())));
+            params.push_back(SQLiteField(pos, SQLITE_TEXT));
+            GetString(params.back().svalue, source);
         } else
         if (source->IsInt32()) {
-            params.push_back(SQLiteField(pos, SQLITE_INTEGER, Nan::To<int32_t>(source).FromJust()));
+            params.push_back(IntegerField(pos, Nan::To<int32_t>(source).FromJust()));
+        } else
+        if (source->IsBigInt()) {
+            bool lossless;
+            params.push_back(IntegerField(pos, source.As<BigInt>()->Int64Value(&lossless)));
+            if (!lossless) {
+                Nan::ThrowRangeError(("BigInt parameter " + to_string(pos) + " is out of the 64-bit integer range").c_str());
+                return false;
+            }
         } else
         if (source->IsNumber()) {
             params.push_back(SQLiteField(pos, SQLITE_FLOAT, Nan::To<double>(source).FromJust()));
         } else
         if (source->IsBoolean()) {
-            params.push_back(SQLiteField(pos, SQLITE_INTEGER, Nan::To<bool>(source).FromJust() ? 1 : 0));
+            params.push_back(IntegerField(pos, Nan::To<bool>(source).FromJust() ? 1 : 0));
         } else
         if (source->IsNull()) {
             params.push_back(SQLiteField(pos));
         } else
         if (Buffer::HasInstance(source)) {
             Local < Object > buffer = Nan::To<Object>(source).ToLocalChecked();
-            params.push_back(SQLiteField(pos, SQLITE_BLOB, 0, string(Buffer::Data(buffer), Buffer::Length(buffer))));
+            params.push_back(SQLiteField(pos, SQLITE_BLOB));
+            params.back().blob = Buffer::Data(buffer);
+            params.back().length = Buffer::Length(buffer);
+            if (pinned.IsEmpty()) pinned = Nan::New<Array>();
+            Nan::Set(pinned, pinned->Length(), buffer);
         } else
         if (source->IsDate()) {
             params.push_back(SQLiteField(pos, SQLITE_FLOAT, Nan::To<double>(source).FromJust()));
-        } else
-        if (source->IsUndefined()) {
+        } else {
             params.push_back(SQLiteField(pos));
         }
     }
+    if (!pinned.IsEmpty()) params.pinned.Reset(pinned);
     return true;
 }
 
-static void GetRow(Row &row, sqlite3_stmt* stmt)
+static bool ParseParameters(SQLiteParams &params, const Nan::FunctionCallbackInfo<v8::Value>& args, int idx)
 {
-    row.clear();
-    int cols = sqlite3_column_count(stmt);
-    for (int i = 0; i < cols; i++) {
-        int type = sqlite3_column_type(stmt, i);
-        int length = sqlite3_column_bytes(stmt, i);
-        const char* name = sqlite3_column_name(stmt, i);
-        const char* dtype = sqlite3_column_decltype(stmt, i);
-        const char* text;
+    if (idx >= args.Length() || !args[idx]->IsArray()) return true;
+    return ParseParameters(params, Local<Array>::Cast(args[idx]));
+}
 
-        if (dtype && !strcasecmp(dtype, "json")) type = SQLITE_TEXT;
-        switch (type) {
-        case SQLITE_INTEGER:
-            row.push_back(SQLiteField(name, type, sqlite3_column_int64(stmt, i)));
-            break;
-        case SQLITE_FLOAT:
-            row.push_back(SQLiteField(name, type, sqlite3_column_double(stmt, i)));
-            break;
-        case SQLITE_TEXT:
-            text = (const char*) sqlite3_column_text(stmt, i);
-            row.push_back(SQLiteField(name, type, 0, string(text, length)));
-            break;
-        case SQLITE_BLOB:
-            text = (const char*)sqlite3_column_blob(stmt, i);
-            row.push_back(SQLiteField(name, type, 0, string(text, length)));
-            break;
-        case SQLITE_NULL:
-            row.push_back(SQLiteField(name));
-            break;
-        }
+// Integers that fit into 32 bits are SMIs unless BigInts are always required, the auto mode returns
+// BigInts only for values that cannot be represented by a double exactly
+static Local<Value> IntegerToJS(sqlite3_int64 value, int bigint)
+{
+    if (bigint == BIGINT_ALWAYS || (bigint == BIGINT_AUTO && (value > MAX_SAFE_INTEGER || value < -MAX_SAFE_INTEGER))) {
+        return BigInt::New(Isolate::GetCurrent(), value);
+    }
+    if (value >= INT32_MIN && value <= INT32_MAX) return Nan::New((int32_t)value);
+    return Nan::New((double)value);
+}
+
+static Local<Value> GetValue(sqlite3_stmt *stmt, int i, int type, int bigint)
+{
+    switch (type) {
+    case SQLITE_INTEGER:
+        return IntegerToJS(sqlite3_column_int64(stmt, i), bigint);
+    case SQLITE_FLOAT:
+        return Nan::New(sqlite3_column_double(stmt, i));
+    case SQLITE_TEXT:
+        return Nan::New((const char*)sqlite3_column_text(stmt, i), sqlite3_column_bytes(stmt, i)).ToLocalChecked();
+    case SQLITE_BLOB:
+        return Nan::CopyBuffer((const char*)sqlite3_column_blob(stmt, i), sqlite3_column_bytes(stmt, i)).ToLocalChecked();
+    default:
+        return Nan::Null();
     }
 }
 
-static Local<Object> GetRow(sqlite3_stmt *stmt)
+static Local<Object> GetRow(sqlite3_stmt *stmt, SQLiteColumns &cols, SQLiteRowBuilder &builder)
 {
     Nan::EscapableHandleScope scope;
 
-    Local<Object> obj = Nan::New<Object>();
-    int cols = sqlite3_column_count(stmt);
-    for (int i = 0; i < cols; i++) {
-        int type = sqlite3_column_type(stmt, i);
-        int length = sqlite3_column_bytes(stmt, i);
-        const char* name = sqlite3_column_name(stmt, i);
-        const char* dtype = sqlite3_column_decltype(stmt, i);
-        Local<Value> value;
+    Local<Object> obj = builder.New();
+    for (int i = 0; i < cols.size(); i++) {
+        builder.Set(obj, i, GetValue(stmt, i, cols.Type(stmt, i), builder.bigint));
+    }
+    return scope.Escape(obj);
+}
 
-        if (dtype && !strcasecmp(dtype, "json")) type = SQLITE_TEXT;
-        switch (type) {
-        case SQLITE_INTEGER:
-            value = Nan::New((double)sqlite3_column_int64(stmt, i));
-            break;
-        case SQLITE_FLOAT:
-            value = Nan::New(sqlite3_column_double(stmt, i));
-            break;
-        case SQLITE_TEXT:
-            value = Nan::New((const char*)sqlite3_column_text(stmt, i)).ToLocalChecked();
-            break;
-        case SQLITE_BLOB:
-            value = Nan::CopyBuffer((const char*)sqlite3_column_blob(stmt, i), length).ToLocalChecked();
-            break;
-        case SQLITE_NULL:
-            value = Nan::Null();
-            break;
+// Positional row for the raw format
+static Local<Array> GetRowArray(sqlite3_stmt *stmt, SQLiteColumns &cols, SQLiteRowBuilder &builder)
+{
+    Nan::EscapableHandleScope scope;
+
+    vector<Local<Value> > &values = builder.values;
+    values.resize(cols.size());
+    for (int i = 0; i < cols.size(); i++) {
+        values[i] = GetValue(stmt, i, cols.Type(stmt, i), builder.bigint);
+    }
+    return scope.Escape(Array::New(Isolate::GetCurrent(), values.data(), values.size()));
+}
+
+static void FreeData(void* data, size_t length, void* hint)
+{
+    free(data);
+}
+
+static void FreeBuffer(char* data, void* hint)
+{
+    free(data);
+}
+
+static void FreeSqliteBuffer(char* data, void* hint)
+{
+    sqlite3_free(data);
+}
+
+static Local<Value> FieldToJS(SQLiteField &field, int bigint)
+{
+    switch (field.type) {
+    case SQLITE_INTEGER:
+        return IntegerToJS(field.ivalue, bigint);
+    case SQLITE_FLOAT:
+        return Nan::New(field.nvalue);
+    case SQLITE_TEXT:
+        return Nan::New(field.svalue).ToLocalChecked();
+    case SQLITE_BLOB:
+        if (field.blob) {
+            char *blob = field.blob;
+            field.blob = NULL;
+            return Nan::NewBuffer(blob, field.length, FreeBuffer, NULL).ToLocalChecked();
         }
-        Nan::Set(obj, Nan::New(name).ToLocalChecked(), value);
+        return Nan::NewBuffer(0).ToLocalChecked();
+    default:
+        return Nan::Null();
     }
-    return scope.Escape(obj);
 }
 
-static Local<Object> RowToJS(Row &row)
+static Local<Value> CellToJS(SQLiteRows &rows, SQLiteCell &cell, int bigint)
+{
+    switch (cell.type) {
+    case SQLITE_INTEGER:
+        return IntegerToJS(cell.ivalue, bigint);
+    case SQLITE_FLOAT:
+        return Nan::New(cell.nvalue);
+    case SQLITE_TEXT:
+        return Nan::New(rows.bytes.data() + cell.offset, cell.length).ToLocalChecked();
+    case SQLITE_BLOB:
+        if (cell.blob) {
+            char *blob = cell.blob;
+            cell.blob = NULL;
+            return Nan::NewBuffer(blob, cell.length, FreeBuffer, NULL).ToLocalChecked();
+        }
+        return Nan::NewBuffer(0).ToLocalChecked();
+    default:
+        return Nan::Null();
+    }
+}
+
+static Local<Object> RowToJS(SQLiteRows &rows, size_t row, SQLiteRowBuilder &builder)
+{
+    Nan::EscapableHandleScope scope;
+
+    Local<Object> result = builder.New();
+    SQLiteCell *cells = &rows.cells[row * rows.ncols];
+    for (int i = 0; i < rows.ncols; i++) {
+        builder.Set(result, i, CellToJS(rows, cells[i], builder.bigint));
+    }
+    return scope.Escape(result);
+}
+
+static Local<Array> RowToArray(SQLiteRows &rows, size_t row, SQLiteRowBuilder &builder)
+{
+    Nan::EscapableHandleScope scope;
+
+    vector<Local<Value> > &values = builder.values;
+    values.resize(rows.ncols);
+    SQLiteCell *cells = &rows.cells[row * rows.ncols];
+    for (int i = 0; i < rows.ncols; i++) {
+        values[i] = CellToJS(rows, cells[i], builder.bigint);
+    }
+    return scope.Escape(Array::New(Isolate::GetCurrent(), values.data(), values.size()));
+}
+
+// Take ownership of a malloc'ed buffer as a backing store
+static Local<ArrayBuffer> NewArrayBuffer(void *data, size_t length)
+{
+    Isolate *isolate = Isolate::GetCurrent();
+    if (!data || !length) {
+        free(data);
+        return ArrayBuffer::New(isolate, 0);
+    }
+    std::shared_ptr<BackingStore> store = ArrayBuffer::NewBackingStore(data, length, FreeData, NULL);
+    return ArrayBuffer::New(isolate, store);
+}
+
+// Columnar result: { count: N, columns: { name: Float64Array|BigInt64Array|Array, ... }, nulls: { name: Uint8Array, ... } }
+static Local<Object> ColumnsToJS(vector<SQLiteColumnData*> &columns, SQLiteColumns &cols, int bigint)
 {
     Nan::EscapableHandleScope scope;
 
     Local<Object> result = Nan::New<Object>();
-    for (uint i = 0; i < row.size(); i++) {
-        SQLiteField &field = row[i];
-        Local<Value> value;
-        switch (field.type) {
-        case SQLITE_INTEGER:
-            value = Nan::New(field.nvalue);
-            break;
-        case SQLITE_FLOAT:
-            value = Nan::New(field.nvalue);
-            break;
-        case SQLITE_TEXT:
-            value = Nan::New(field.svalue).ToLocalChecked();
-            break;
-        case SQLITE_BLOB:
-            value = Nan::CopyBuffer((const char*)field.svalue.c_str(), field.svalue.size()).ToLocalChecked();
-            break;
-        case SQLITE_NULL:
-            value = Nan::Null();
-            break;
+    Local<Object> values = Nan::New<Object>();
+    Local<Object> nulls = Nan::New<Object>();
+    if (columns.empty()) {
+        for (int i = 0; i < cols.size(); i++) columns.push_back(new SQLiteColumnData(i));
+    }
+    int count = columns.size() ? columns[0]->count : 0;
+    for (uint i = 0; i < columns.size(); i++) {
+        SQLiteColumnData *col = columns[i];
+        Local<String> name = Nan::New(cols.names[i]).ToLocalChecked();
+        if (col->numeric) {
+            Local<ArrayBuffer> buffer;
+            if (col->integer && (bigint == BIGINT_ALWAYS || (bigint == BIGINT_AUTO && col->unsafe))) {
+                buffer = NewArrayBuffer(col->data, col->count * sizeof(sqlite3_int64));
+                Nan::Set(values, name, BigInt64Array::New(buffer, 0, col->count));
+            } else {
+                if (col->integer) col->Float();
+                buffer = NewArrayBuffer(col->data, col->count * sizeof(double));
+                Nan::Set(values, name, Float64Array::New(buffer, 0, col->count));
+            }
+            col->data = NULL;
+            if (col->hasnulls) {
+                Nan::Set(nulls, name, Uint8Array::New(NewArrayBuffer(col->nulls, (col->count + 7) / 8), 0, (col->count + 7) / 8));
+                col->nulls = NULL;
+            }
+        } else {
+            Local<Array> list = Nan::New<Array>(col->values.size());
+            for (uint j = 0; j < col->values.size(); j++) {
+                Nan::Set(list, j, FieldToJS(col->values[j], bigint));
+            }
+            Nan::Set(values, name, list);
         }
-        Nan::Set(result, Nan::New(field.name).ToLocalChecked(), value);
     }
-    row.clear();
+    Nan::Set(result, Nan::New("count").ToLocalChecked(), Nan::New(count));
+    Nan::Set(result, Nan::New("columns").ToLocalChecked(), values);
+    Nan::Set(result, Nan::New("nulls").ToLocalChecked(), nulls);
+    FreeColumns(columns);
     return scope.Escape(result);
 }
 
+static void ParseOptions(SQLiteOptions &opts, const Nan::FunctionCallbackInfo<v8::Value>& args, int idx)
+{
+    Nan::HandleScope scope;
+    for (; idx < args.Length(); idx++) {
+        if (!args[idx]->IsObject() || args[idx]->IsArray() || args[idx]->IsFunction()) continue;
+        Local<Object> obj = Nan::To<Object>(args[idx]).ToLocalChecked();
+        Local<Value> format = GetOption(obj, "format");
+        if (format->IsString()) {
+            Nan::Utf8String val(format);
+            if (!strcmp(*val, "columns")) opts.format = FORMAT_COLUMNS; else
+            if (!strcmp(*val, "raw")) opts.format = FORMAT_RAW;
+        }
+        Local<Value> bigint = GetOption(obj, "bigint");
+        if (bigint->IsString()) {
+            Nan::Utf8String val(bigint);
+            if (!strcmp(*val, "auto")) opts.bigint = BIGINT_AUTO; else
+            if (!strcmp(*val, "always")) opts.bigint = BIGINT_ALWAYS;
+        } else
+        if (bigint->IsTrue()) {
+            opts.bigint = BIGINT_ALWAYS;
+        }
+        opts.batch = GetOptionInt(obj, "batch", 0);
+        break;
+    }
+}
+
 static const char* sqlite_code_string(int code)
 {
     switch (code) {
@@ -591,7 +2029,7 @@ NAN_GETTER(SQLiteDatabase::OpenGetter)
 NAN_GETTER(SQLiteDatabase::InsertedOidGetter)
 {
     SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.This());
-    NAN_RETURN(Nan::New((double)sqlite3_last_insert_rowid(db->_handle)));
+    NAN_RETURN(IntegerToJS(sqlite3_last_insert_rowid(db->_handle), BIGINT_AUTO));
 }
 
 NAN_GETTER(SQLiteDatabase::AffectedRowsGetter)
@@ -607,8 +2045,39 @@ NAN_METHOD(SQLiteDatabase::NewDB)
     if (!info.IsConstructCall()) Nan::ThrowError("Use the new operator to create new Database objects");
 
     NAN_REQUIRE_ARGUMENT_STRING(0, filename);
-    int arg = 1, mode = 0;
-    if (info.Length() >= arg && info[arg]->IsInt32()) mode = Nan::To<int32_t>(info[arg++]).FromJust();
+    int arg = 1, mode = 0, stmt_cache = -1, readers = 0, group_commit = 0, group_size = 0;
+    bool coalesce = false;
+    SQLiteTuning tuning;
+    if (info.Length() > arg && info[arg]->IsInt32()) mode = Nan::To<int32_t>(info[arg++]).FromJust(); else
+    if (info.Length() > arg && info[arg]->IsObject() && !info[arg]->IsFunction()) {
+        Local<Object> opts = Nan::To<Object>(info[arg++]).ToLocalChecked();
+        mode = GetOptionInt(opts, "mode", 0);
+        stmt_cache = GetOptionInt(opts, "stmt_cache", -1);
+        readers = GetOptionInt(opts, "readers", 0);
+        group_commit = GetOptionInt(opts, "group_commit", 0);
+        group_size = GetOptionInt(opts, "group_size", 0);
+        coalesce = Nan::To<bool>(GetOption(opts, "coalesce")).FromJust();
+        tuning.busy_timeout = GetOptionInt(opts, "busy_timeout", -1);
+        // Writer only settings go first in the order given
+        static const char *pragmas[] = { "page_size", "journal_mode", "wal_autocheckpoint", NULL,
+                                         "mmap_size", "cache_size", "synchronous", "temp_store", "cache_spill", NULL };
+        string *sql = &tuning.writer;
+        for (int i = 0; i < 10; i++) {
+            if (!pragmas[i]) {
+                sql = &tuning.pragmas;
+                continue;
+            }
+            Local<Value> val = GetOption(opts, pragmas[i]);
+            string value;
+            if (val->IsBoolean()) value = val->IsTrue() ? "1" : "0"; else
+            if (val->IsNumber()) value = to_string(Nan::To<int64_t>(val).FromJust()); else
+            if (val->IsString()) value = *Nan::Utf8String(val); else continue;
+            for (uint c = 0; c < value.size(); c++) {
+                if (!isalnum(value[c]) && value[c] != '-') return Nan::ThrowError((string("Invalid value for ") + pragmas[i]).c_str());
+            }
+            *sql += string("PRAGMA ") + pragmas[i] + "=" + value + ";";
+        }
+    }
 
     Local < Function > callback;
     if (info.Length() >= arg && info[arg]->IsFunction()) callback = Local < Function > ::Cast(info[arg]);
@@ -617,25 +2086,40 @@ NAN_METHOD(SQLiteDatabase::NewDB)
     mode |= mode & SQLITE_OPEN_READONLY ? 0 : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
     // No global mutex in read only
     mode |= mode & SQLITE_OPEN_NOMUTEX ? 0 : SQLITE_OPEN_FULLMUTEX;
-    // Default is shared cache unless private is specified
+    // Default is shared cache unless private is specified, the readers pool works with private caches only
+    if (readers > 0) mode = (mode & ~SQLITE_OPEN_SHAREDCACHE) | SQLITE_OPEN_PRIVATECACHE;
     mode |= mode & SQLITE_OPEN_PRIVATECACHE ? 0 : SQLITE_OPEN_SHAREDCACHE;
 
-    SQLiteDatabase* db = new SQLiteDatabase();
+    SQLiteDatabase* db = new SQLiteDatabase(*filename);
+    if (stmt_cache >= 0) db->cache.max = stmt_cache;
+    if (readers > 0) db->nreaders = readers;
+    if (group_commit > 0) db->group_commit = group_commit;
+    if (group_size > 0) db->group_size = group_size;
+    db->coalesce = coalesce;
+    db->tuning = tuning;
     db->Wrap(info.This());
     Nan::Set(info.This(), Nan::New("name").ToLocalChecked(), Nan::New(*filename).ToLocalChecked());
     Nan::Set(info.This(), Nan::New("mode").ToLocalChecked(), Nan::New(mode));
 
     if (!callback.IsEmpty()) {
         Baton* baton = new Baton(db, callback, *filename, mode);
-        uv_queue_work(uv_default_loop(), &baton->request, Work_Open, (uv_after_work_cb)Work_AfterOpen);
+        sqliteQueueWork(&baton->request, Work_Open, (uv_after_work_cb)Work_AfterOpen);
     } else {
+        SQLitePCacheOwner owner(db->pages);
         int status = sqlite3_open_v2(*filename, &db->_handle, mode, NULL);
-        if (status != SQLITE_OK) {
+        string message;
+        if (status != SQLITE_OK || !sqliteInitDb(db->_handle, &db->tuning)) {
+            // A half initialized connection is not usable, the database stays closed
+            message = sqlite3_errmsg(db->_handle);
+            sqlite3_close(db->_handle);
+            db->_handle = NULL;
+            Nan::ThrowError(message.c_str());
+        } else
+        if (db->OpenReaders(mode, message) != SQLITE_OK) {
             sqlite3_close(db->_handle);
             db->_handle = NULL;
-            Nan::ThrowError(sqlite3_errmsg(db->_handle));
+            Nan::ThrowError(message.c_str());
         }
-        sqliteInitDb(db->_handle);
     }
     NAN_RETURN(info.This());
 }
@@ -644,89 +2128,441 @@ void SQLiteDatabase::Work_Open(uv_work_t* req)
 {
     Baton* baton = static_cast<Baton*>(req->data);
 
+    SQLitePCacheOwner owner(baton->db->pages);
     baton->status = sqlite3_open_v2(baton->sparam.c_str(), &baton->db->_handle, baton->iparam, NULL);
     if (baton->status != SQLITE_OK) {
         baton->message = string(sqlite3_errmsg(baton->db->_handle));
         sqlite3_close(baton->db->_handle);
         baton->db->_handle = NULL;
-    } else {
-        sqliteInitDb(baton->db->_handle);
+    } else
+    if (!sqliteInitDb(baton->db->_handle, &baton->db->tuning)) {
+        baton->status = sqlite3_errcode(baton->db->_handle);
+        baton->message = string(sqlite3_errmsg(baton->db->_handle));
+        sqlite3_close(baton->db->_handle);
+        baton->db->_handle = NULL;
+    } else
+    if ((baton->status = baton->db->OpenReaders(baton->iparam, baton->message)) != SQLITE_OK) {
+        sqlite3_close(baton->db->_handle);
+        baton->db->_handle = NULL;
     }
 }
 
-void SQLiteDatabase::Work_AfterOpen(uv_work_t* req)
+int SQLiteDatabase::OpenReaders(int mode, string &message)
 {
-    Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
-
-    if (!baton->callback.IsEmpty()) {
-        Local < Value > argv[1];
-        Local<Function> cb = Nan::New(baton->callback);
-        if (baton->status != SQLITE_OK) {
-            EXCEPTION(baton->message.c_str(), baton->status, exception);
-            argv[0] = exception;
-        } else {
-            argv[0] = Nan::Null();
+    int status = SQLITE_OK;
+    if (nreaders <= 0 || readers.size()) return status;
+    // In-memory and temporary databases are private to the connection, a reader would open a database of its own
+    const char *file = sqlite3_db_filename(_handle, "main");
+    if (!file || !*file) return status;
+
+    // Readers and the writer must see each other without shared cache locking
+    sqlite3_stmt *stmt = NULL;
+    status = sqlite3_prepare_v2(_handle, "PRAGMA journal_mode=WAL", -1, &stmt, NULL);
+    if (status == SQLITE_OK) {
+        status = sqlite3_step(stmt);
+        const char *journal = status == SQLITE_ROW ? (const char*)sqlite3_column_text(stmt, 0) : NULL;
+        if (journal && !strcasecmp(journal, "wal")) {
+            status = SQLITE_OK;
+        } else
+        if (status == SQLITE_ROW || status == SQLITE_DONE) {
+            status = SQLITE_ERROR;
+            message = string("Readers require the WAL journal mode, the database is in ") + (journal ? journal : "unknown") + " mode";
         }
-        NAN_TRY_CATCH_CALL(baton->db->handle(), cb, 1, argv);
-    } else
-    if (baton->status != SQLITE_OK) {
-        printf("%s", baton->message.c_str());
     }
-    delete baton;
+    sqlite3_finalize(stmt);
+    for (int i = 0; i < nreaders && status == SQLITE_OK; i++) {
+        SQLiteReader *reader = new SQLiteReader(cache.max);
+        status = sqlite3_open_v2(name.c_str(), &reader->handle, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_PRIVATECACHE | (mode & SQLITE_OPEN_URI), NULL);
+        if (status != SQLITE_OK) {
+            message = string(sqlite3_errmsg(reader->handle));
+            delete reader;
+            break;
+        }
+        readers.push_back(reader);
+        if (!sqliteInitDb(reader->handle, &tuning, true)) {
+            status = sqlite3_errcode(reader->handle);
+            message = string(sqlite3_errmsg(reader->handle));
+            break;
+        }
+        idle.push_back(reader);
+    }
+    if (status != SQLITE_OK) {
+        if (message.empty()) message = string(sqlite3_errmsg(_handle));
+        CloseReaders();
+    }
+    return status;
 }
 
-NAN_METHOD(SQLiteDatabase::CloseSync)
+void SQLiteDatabase::CloseReaders()
 {
-    Nan::HandleScope scope;
-    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
-    NAN_EXPECT_ARGUMENT_FUNCTION(0, callback);
+    uv_mutex_lock(&mutex);
+    for (uint i = 0; i < readers.size(); i++) delete readers[i];
+    readers.clear();
+    idle.clear();
+    writers.clear();
+    uv_mutex_unlock(&mutex);
+}
 
-    int status = sqlite3_close(db->_handle);
-    db->_handle = NULL;
-    if (status != SQLITE_OK) {
-        Nan::ThrowError(sqlite3_errmsg(db->_handle));
+// Returns a free reader or NULL, never waits, jobs that need one wait in the scheduler
+SQLiteReader *SQLiteDatabase::AcquireReader()
+{
+    SQLiteReader *reader = NULL;
+    uv_mutex_lock(&mutex);
+    if (!idle.empty()) {
+        reader = idle.back();
+        idle.pop_back();
     }
-    NAN_RETURN(info.Holder());
+    uv_mutex_unlock(&mutex);
+    return reader;
 }
 
-NAN_METHOD(SQLiteDatabase::Close)
+void SQLiteDatabase::ReleaseReader(SQLiteReader *reader)
 {
-    Nan::HandleScope scope;
-    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
-    NAN_EXPECT_ARGUMENT_FUNCTION(0, callback);
+    uv_mutex_lock(&mutex);
+    idle.push_back(reader);
+    uv_mutex_unlock(&mutex);
+}
 
-    Baton* baton = new Baton(db, callback);
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Close, (uv_after_work_cb)Work_AfterClose);
+// Statements that modify the database or the connection state always go to the main handle
+bool SQLiteDatabase::IsWriter(const string &sql)
+{
+    if (sqliteIsWriter(sql)) return true;
+    uv_mutex_lock(&mutex);
+    bool rc = writers.count(sql) > 0;
+    uv_mutex_unlock(&mutex);
+    return rc;
+}
 
-    NAN_RETURN(info.Holder());
+void SQLiteDatabase::SetWriter(const string &sql)
+{
+    uv_mutex_lock(&mutex);
+    if (writers.size() > 1000) writers.clear();
+    writers.insert(sql);
+    readonly.erase(sql);
+    uv_mutex_unlock(&mutex);
 }
 
-void SQLiteDatabase::Work_Close(uv_work_t* req)
+bool SQLiteDatabase::IsReader(const string &sql)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
+    uv_mutex_lock(&mutex);
+    bool rc = readonly.count(sql) > 0;
+    uv_mutex_unlock(&mutex);
+    return rc;
+}
 
-    baton->status = sqlite3_close(baton->db->_handle);
-    if (baton->status != SQLITE_OK) {
-        baton->message = string(sqlite3_errmsg(baton->db->_handle));
-    }
-    baton->db->_handle = NULL;
+void SQLiteDatabase::SetReader(const string &sql)
+{
+    uv_mutex_lock(&mutex);
+    if (readonly.size() > 1000) readonly.clear();
+    readonly.insert(sql);
+    uv_mutex_unlock(&mutex);
 }
 
-void SQLiteDatabase::Work_AfterClose(uv_work_t* req)
+// A transaction handle or an exclusive job owns the main connection
+bool SQLiteDatabase::Locked()
 {
-    Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
+    return txn != NULL || exclusive;
+}
 
-    if (!baton->callback.IsEmpty()) {
-        Local < Value > argv[1];
-        Local<Function> cb = Nan::New(baton->callback);
-        if (baton->status != SQLITE_OK) {
-            EXCEPTION(baton->message.c_str(), baton->status, exception);
-            argv[0] = exception;
-        } else {
-            argv[0] = Nan::Null();
-        }
+// Jobs running or waiting on any connection, cursors that keep a reader count as running
+bool SQLiteDatabase::Pending()
+{
+    if (running || reading || waiting.size() || txns.size() || reads.size() || group.size() || txn) return true;
+    uv_mutex_lock(&mutex);
+    bool held = idle.size() < readers.size();
+    uv_mutex_unlock(&mutex);
+    return held;
+}
+
+// Read jobs pass the slot where the statement keeps its reader, a job that holds a reader already starts right away.
+// An exclusive job starts once all jobs started before it are done and runs alone on the main connection, a draining
+// job also waits for the reads queued before it and for all readers to be released
+void SQLiteDatabase::Queue(uv_work_t *req, uv_work_cb work, uv_after_work_cb after, SQLiteTransaction *owner, SQLiteReader **reader, bool exclusive_, bool drain)
+{
+    SQLiteJob *job = new SQLiteJob;
+    job->request.data = job;
+    job->req = req;
+    job->work = work;
+    job->after = after;
+    job->db = this;
+    job->owner = owner;
+    job->reader = reader;
+    job->read = false;
+    job->exclusive = exclusive_ || drain;
+    job->drain = drain;
+    job->seq = ++seq;
+    if (drain) draining = job->seq;
+    Ref();
+
+    // Pending group writes go first
+    if (group.size() && !owner && !reader) FlushGroup();
+
+    if (owner) {
+        owner->jobs.push_back(job);
+    } else
+    if (reader && *reader) {
+        Start(job);
+    } else
+    if (reader) {
+        reads.push_back(job);
+    } else
+    if (!Locked() && txns.empty() && waiting.empty() && !job->exclusive) {
+        Start(job);
+    } else {
+        waiting.push_back(job);
+    }
+    Dispatch();
+}
+
+void SQLiteDatabase::Start(SQLiteJob *job)
+{
+    job->read = job->reader && *job->reader;
+    if (job->owner) {
+        job->owner->busy = true;
+    } else
+    if (job->read) {
+        reading++;
+    } else {
+        running++;
+    }
+    // Transaction jobs run one at a time anyway
+    if (coalesce && !job->owner) {
+        if (batch.empty()) {
+            if (!_check) {
+                _check = new uv_check_t;
+                uv_check_init(uv_default_loop(), _check);
+                _idle = new uv_idle_t;
+                uv_idle_init(uv_default_loop(), _idle);
+            }
+            // The idle handle keeps the loop from blocking in poll until the check handle runs
+            if (_batching.empty()) {
+                uv_check_start(_check, BatchCheck);
+                uv_idle_start(_idle, BatchIdle);
+            }
+            _batching.insert(this);
+        }
+        batch.push_back(job);
+        return;
+    }
+    sqliteQueueWork(&job->request, Work_Job, Work_AfterJob);
+}
+
+void SQLiteDatabase::BatchCheck(uv_check_t *handle)
+{
+    set<SQLiteDatabase*> dbs;
+    dbs.swap(_batching);
+    uv_check_stop(_check);
+    uv_idle_stop(_idle);
+    for (set<SQLiteDatabase*>::iterator it = dbs.begin(); it != dbs.end(); it++) (*it)->FlushBatch();
+}
+
+void SQLiteDatabase::BatchIdle(uv_idle_t *handle)
+{
+}
+
+void SQLiteDatabase::FlushBatch()
+{
+    batches++;
+    batched += batch.size();
+    if (batch.size() == 1) {
+        sqliteQueueWork(&batch[0]->request, Work_Job, Work_AfterJob);
+    } else {
+        SQLiteJobs *jobs = new SQLiteJobs;
+        jobs->request.data = jobs;
+        jobs->jobs.swap(batch);
+        sqliteQueueWork(&jobs->request, Work_Jobs, Work_AfterJobs);
+    }
+    batch.clear();
+}
+
+void SQLiteDatabase::Work_Jobs(uv_work_t* req)
+{
+    SQLiteJobs *jobs = static_cast<SQLiteJobs*>(req->data);
+    for (uint i = 0; i < jobs->jobs.size(); i++) Work_Job(&jobs->jobs[i]->request);
+}
+
+// Callbacks are called in the same order the jobs were started
+void SQLiteDatabase::Work_AfterJobs(uv_work_t* req, int status)
+{
+    SQLiteJobs *jobs = static_cast<SQLiteJobs*>(req->data);
+    for (uint i = 0; i < jobs->jobs.size(); i++) Work_AfterJob(&jobs->jobs[i]->request, status);
+    delete jobs;
+}
+
+// Start read jobs for free readers and the next job of the current transaction, a transaction starts once all jobs
+// started before it are done
+void SQLiteDatabase::Dispatch()
+{
+    // Without readers after close the job fails on the main connection instead of waiting forever
+    while (reads.size()) {
+        SQLiteJob *job = reads.front();
+        if (draining && job->seq > draining) break;
+        if (!(*job->reader = AcquireReader()) && readers.size()) break;
+        reads.pop_front();
+        Start(job);
+    }
+    while (true) {
+        if (txn) {
+            if (txn->busy) return;
+            if (txn->jobs.size()) {
+                SQLiteJob *job = txn->jobs.front();
+                txn->jobs.pop_front();
+                Start(job);
+                return;
+            }
+            if (!txn->ended || !txn->finished) return;
+            SQLiteTransaction *done = txn;
+            txn = NULL;
+            done->Unref();
+            continue;
+        }
+        if (exclusive) return;
+        // Transactions and waiting jobs start in the order they were queued
+        if (txns.size() && (waiting.empty() || txns.front()->seq < waiting.front()->seq)) {
+            if (running) return;
+            txn = txns.front();
+            txns.pop_front();
+            continue;
+        }
+        if (waiting.empty()) return;
+        SQLiteJob *job = waiting.front();
+        if (job->exclusive) {
+            if (running) return;
+            if (job->drain) {
+                if (reading || (reads.size() && reads.front()->seq < job->seq)) return;
+                uv_mutex_lock(&mutex);
+                bool held = idle.size() < readers.size();
+                uv_mutex_unlock(&mutex);
+                if (held) return;
+            }
+            exclusive = true;
+        }
+        waiting.pop_front();
+        Start(job);
+    }
+}
+
+void SQLiteDatabase::Work_Job(uv_work_t* req)
+{
+    SQLiteJob *job = static_cast<SQLiteJob*>(req->data);
+    SQLitePCacheOwner owner(job->db->pages);
+    job->work(job->req);
+}
+
+void SQLiteDatabase::Work_AfterJob(uv_work_t* req, int status)
+{
+    SQLiteJob *job = static_cast<SQLiteJob*>(req->data);
+    SQLiteDatabase *db = job->db;
+
+    if (job->owner) {
+        job->owner->busy = false;
+    } else
+    if (job->read) {
+        db->reading--;
+    } else {
+        db->running--;
+    }
+    if (job->exclusive) db->exclusive = false;
+    if (job->drain && db->draining == job->seq) db->draining = 0;
+    job->after(job->req, status);
+    delete job;
+    db->Dispatch();
+    db->Unref();
+}
+
+SQLiteShape *SQLiteDatabase::GetShape(SQLiteColumns &cols)
+{
+    map<string,SQLiteShape*>::iterator it = shapes.find(cols.key);
+    if (it != shapes.end()) return it->second;
+    if (shapes.size() >= 256) {
+        for (it = shapes.begin(); it != shapes.end(); it++) delete it->second;
+        shapes.clear();
+    }
+    SQLiteShape *shape = new SQLiteShape(cols);
+    shapes[cols.key] = shape;
+    return shape;
+}
+
+void SQLiteDatabase::Work_AfterOpen(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
+        NAN_TRY_CATCH_CALL(baton->db->handle(), cb, 1, argv);
+    } else
+    if (baton->status != SQLITE_OK) {
+        printf("%s", baton->message.c_str());
+    }
+    delete baton;
+}
+
+NAN_METHOD(SQLiteDatabase::CloseSync)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    NAN_EXPECT_ARGUMENT_FUNCTION(0, callback);
+    if (db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    // Workers and cursors would keep using the connections
+    if (db->Pending()) return Nan::ThrowError("Cannot close a database with pending jobs");
+
+    db->CloseReaders();
+    db->cache.Clear();
+    int status = sqlite3_close_v2(db->_handle);
+    if (status != SQLITE_OK) return Nan::ThrowError(sqlite3_errmsg(db->_handle));
+    db->_handle = NULL;
+    NAN_RETURN(info.Holder());
+}
+
+NAN_METHOD(SQLiteDatabase::Close)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    NAN_EXPECT_ARGUMENT_FUNCTION(0, callback);
+
+    Baton* baton = new Baton(db, callback);
+    // Runs once all jobs queued before it are done and the readers are released
+    db->Queue(&baton->request, Work_Close, (uv_after_work_cb)Work_AfterClose, NULL, NULL, true, true);
+
+    NAN_RETURN(info.Holder());
+}
+
+void SQLiteDatabase::Work_Close(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    baton->db->CloseReaders();
+    baton->db->cache.Clear();
+    baton->status = sqlite3_close_v2(baton->db->_handle);
+    if (baton->status != SQLITE_OK) {
+        baton->message = string(sqlite3_errmsg(baton->db->_handle));
+    } else {
+        baton->db->_handle = NULL;
+    }
+}
+
+void SQLiteDatabase::Work_AfterClose(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
         NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
     } else
     if (baton->status != SQLITE_OK) {
@@ -739,56 +2575,87 @@ NAN_METHOD(SQLiteDatabase::QuerySync)
 {
     Nan::EscapableHandleScope scope;
     SQLiteDatabase *db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    if (db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(db->pages);
 
     NAN_REQUIRE_ARGUMENT_STRING(0, text);
 
-    Row params;
-    sqlite3_stmt *stmt;
-    ParseParameters(params, info, 1);
-    int status = sqlite3_prepare_v2(db->_handle, *text, text.length(), &stmt, NULL);
+    SQLiteParams params;
+    SQLiteOptions opts;
+    sqlite3_stmt *stmt = NULL;
+    if (!ParseParameters(params, info, 1)) return;
+    ParseOptions(opts, info, 1);
+    int status = db->cache.Prepare(db->_handle, &stmt, *text, 1, 0);
     if (status != SQLITE_OK) {
-        Nan::ThrowError(sqlite3_errmsg(db->_handle));
+        if (stmt) sqlite3_finalize(stmt);
+        return Nan::ThrowError(sqlite3_errmsg(db->_handle));
     }
 
     int n = 0;
     string message;
+    SQLiteColumns cols;
+    cols.Init(stmt);
+    SQLiteRowBuilder builder(db->GetShape(cols), opts.bigint);
+    vector<SQLiteColumnData*> columns;
     Local<Array> result = Nan::New<Array>();
     if (BindParameters(params, stmt)) {
+        int rows = 0;
+        uint64_t start = uv_hrtime();
         while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
-            Local<Object> obj(GetRow(stmt));
-            Nan::Set(result, Nan::New(n++), obj);
+            if (!rows++ && cols.Check(stmt)) builder = SQLiteRowBuilder(db->GetShape(cols), opts.bigint);
+            if (opts.format == FORMAT_COLUMNS) {
+                GetColumns(columns, stmt, cols);
+                continue;
+            }
+            if (opts.format == FORMAT_RAW) {
+                Nan::Set(result, n++, GetRowArray(stmt, cols, builder));
+            } else {
+                Nan::Set(result, n++, GetRow(stmt, cols, builder));
+            }
         }
+        sqliteStmtCollect(stmt, start, rows);
         if (status != SQLITE_DONE) {
             message = string(sqlite3_errmsg(db->_handle));
         }
     } else {
         message = string(sqlite3_errmsg(db->_handle));
     }
-    sqlite3_finalize(stmt);
+    db->cache.Release(*text, stmt, status);
     if (status != SQLITE_DONE) {
-        Nan::ThrowError(message.c_str());
+        FreeColumns(columns);
+        return Nan::ThrowError(message.c_str());
+    }
+    if (opts.format == FORMAT_COLUMNS) {
+        NAN_RETURN(ColumnsToJS(columns, cols, opts.bigint));
+    } else {
+        if (opts.format == FORMAT_RAW) Nan::Set(result, Nan::New("columns").ToLocalChecked(), builder.Names());
+        NAN_RETURN(result);
     }
-    NAN_RETURN(result);
 }
 
 NAN_METHOD(SQLiteDatabase::RunSync)
 {
     Nan::HandleScope scope;
     SQLiteDatabase *db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    if (db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(db->pages);
 
     NAN_REQUIRE_ARGUMENT_STRING(0, text);
 
-    Row params;
+    SQLiteParams params;
     string message;
-    sqlite3_stmt *stmt;
-    ParseParameters(params, info, 1);
-    int status = sqlite3_prepare_v2(db->_handle, *text, text.length(), &stmt, NULL);
+    sqlite3_stmt *stmt = NULL;
+    if (!ParseParameters(params, info, 1)) return;
+    int status = db->cache.Prepare(db->_handle, &stmt, *text, 1, 0);
     if (status != SQLITE_OK) {
-        Nan::ThrowError(sqlite3_errmsg(db->_handle));
+        if (stmt) sqlite3_finalize(stmt);
+        return Nan::ThrowError(sqlite3_errmsg(db->_handle));
     }
 
     if (BindParameters(params, stmt)) {
+        uint64_t start = uv_hrtime();
         status = sqlite3_step(stmt);
+        sqliteStmtCollect(stmt, start, 0);
         if (!(status == SQLITE_ROW || status == SQLITE_DONE)) {
             message = string(sqlite3_errmsg(db->_handle));
         } else {
@@ -799,7 +2666,7 @@ NAN_METHOD(SQLiteDatabase::RunSync)
     } else {
         message = string(sqlite3_errmsg(db->_handle));
     }
-    sqlite3_finalize(stmt);
+    db->cache.Release(*text, stmt, status);
     if (status != SQLITE_OK) {
         Nan::ThrowError(message.c_str());
     }
@@ -814,11 +2681,19 @@ NAN_METHOD(SQLiteDatabase::Run)
     NAN_REQUIRE_ARGUMENT_STRING(0, sql);
     NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
 
-    Local<Object> obj = SQLiteStatement::Create(db, *sql);
+    Local<Object> obj = SQLiteStatement::Create(db, *sql, true);
     SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (obj);
     SQLiteStatement::Baton* baton = new SQLiteStatement::Baton(stmt, callback);
-    ParseParameters(baton->params, info, 1);
-    uv_queue_work(uv_default_loop(), &baton->request, SQLiteStatement::Work_RunPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterRun);
+    if (!ParseParameters(baton->params, info, 1)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 1);
+    if (db->group_commit > 0) {
+        db->Group(&baton->request);
+    } else {
+        db->Queue(&baton->request, SQLiteStatement::Work_RunPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterRun);
+    }
 
     NAN_RETURN(obj);
 }
@@ -831,15 +2706,47 @@ NAN_METHOD(SQLiteDatabase::Query)
     NAN_REQUIRE_ARGUMENT_STRING(0, sql);
     NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
 
-    Local<Object> obj = SQLiteStatement::Create(db, *sql);
+    Local<Object> obj = SQLiteStatement::Create(db, *sql, true);
     SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (obj);
     SQLiteStatement::Baton* baton = new SQLiteStatement::Baton(stmt, callback);
-    ParseParameters(baton->params, info, 1);
-    uv_queue_work(uv_default_loop(), &baton->request, SQLiteStatement::Work_QueryPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterQuery);
+    if (!ParseParameters(baton->params, info, 1)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 1);
+    db->Queue(&baton->request, SQLiteStatement::Work_QueryPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterQuery, NULL, stmt->ReadSlot());
 
     NAN_RETURN(obj);
 }
 
+// Returns an async iterator over the rows, the rows are fetched in batches only when the consumer asks for more
+NAN_METHOD(SQLiteDatabase::Iterate)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+
+    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
+
+    Local<Object> cursor = SQLiteStatement::Cursor(db, *sql, info, 1);
+    if (cursor.IsEmpty()) return;
+    NAN_RETURN(cursor);
+}
+
+// Returns a transaction handle, BEGIN runs once all jobs started before it are done
+NAN_METHOD(SQLiteDatabase::Transaction)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+
+    string mode = "IMMEDIATE";
+    if (info.Length() > 0 && info[0]->IsString()) {
+        mode = *Nan::Utf8String(info[0]);
+        for (uint i = 0; i < mode.size(); i++) mode[i] = toupper(mode[i]);
+        if (mode != "DEFERRED" && mode != "IMMEDIATE" && mode != "EXCLUSIVE") return Nan::ThrowError("Invalid transaction mode");
+    }
+    NAN_RETURN(SQLiteTransaction::Create(db, NULL, mode));
+}
+
 NAN_METHOD(SQLiteDatabase::Exec)
 {
     Nan::HandleScope scope;
@@ -849,7 +2756,7 @@ NAN_METHOD(SQLiteDatabase::Exec)
     NAN_EXPECT_ARGUMENT_FUNCTION(1, callback);
 
     Baton* baton = new Baton(db, callback, *sql);
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Exec, (uv_after_work_cb)Work_AfterExec);
+    db->Queue(&baton->request, Work_Exec, (uv_after_work_cb)Work_AfterExec);
 
     NAN_RETURN(info.Holder());
 }
@@ -894,464 +2801,3167 @@ void SQLiteDatabase::Work_AfterExec(uv_work_t* req)
     delete baton;
 }
 
-NAN_METHOD(SQLiteDatabase::Copy)
+// Collect db.run statements for one transaction, it is started by the timer or once the group is full
+void SQLiteDatabase::Group(uv_work_t *req)
 {
-    Nan::HandleScope scope;
-    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
-    string errmsg;
-    sqlite3 *handle2 = 0;
-    int rc = SQLITE_OK;
-
-    if (info.Length() && info[0]->IsObject()) {
-        SQLiteDatabase* sdb = Nan::ObjectWrap::Unwrap < SQLiteDatabase > (Nan::To<Object>(info[0]).ToLocalChecked());
-        handle2 = sdb->_handle;
-    } else
-    if (info.Length() && info[0]->IsString()) {
-        Nan::Utf8String filename(info[0]);
-        rc = sqlite3_open_v2(*filename, &handle2, SQLITE_OPEN_READONLY, NULL);
-        if (rc != SQLITE_OK) {
-            errmsg = sqlite3_errmsg(handle2);
-            sqlite3_close(handle2);
-            Nan::ThrowError(errmsg.c_str());
-        }
-    } else {
-        Nan::ThrowError("Database object or database file name expected");
+    group.push_back(req);
+    if ((int)group.size() >= group_size) return FlushGroup();
+    if (group.size() > 1) return;
+    if (!timer) {
+        timer = new uv_timer_t;
+        uv_timer_init(uv_default_loop(), timer);
+        timer->data = this;
     }
+    uv_timer_start(timer, GroupTimer, group_commit, 0);
+}
 
-    sqlite3_backup *backup;
-    backup = sqlite3_backup_init(db->_handle, "main", handle2, "main");
-    if (backup) {
-        sqlite3_backup_step(backup, -1);
-        sqlite3_backup_finish(backup);
-        rc = sqlite3_errcode(db->_handle);
-        errmsg = sqlite3_errmsg(db->_handle);
-    }
+void SQLiteDatabase::GroupTimer(uv_timer_t *handle)
+{
+    SQLiteDatabase *db = static_cast<SQLiteDatabase*>(handle->data);
+    if (db->group.size()) db->FlushGroup();
+}
 
-    if (info[0]->IsString()) {
-        sqlite3_close(handle2);
-    }
+void SQLiteDatabase::FreeTimer(uv_handle_t *handle)
+{
+    delete (uv_timer_t*)handle;
+}
 
-    if (rc != SQLITE_OK) {
-        Nan::ThrowError(errmsg.c_str());
+void SQLiteDatabase::FlushGroup()
+{
+    if (timer) uv_timer_stop(timer);
+    GroupBaton *baton = new GroupBaton(this);
+    baton->reqs.swap(group);
+    group_commits++;
+    group_writes += baton->reqs.size();
+    Queue(&baton->request, Work_Group, (uv_after_work_cb)Work_AfterGroup, NULL, NULL, true);
+}
+
+// Run a control statement on the main connection using the statement cache
+int SQLiteDatabase::ExecCached(const string &sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    int status = cache.Prepare(_handle, &stmt, sql, retries, timeout);
+    if (status == SQLITE_OK) {
+        status = sqliteStep(stmt, retries, timeout);
+        if (status == SQLITE_DONE) status = SQLITE_OK;
     }
-    NAN_RETURN(info.Holder());
+    cache.Release(sql, stmt, status);
+    return status;
 }
 
-// { Database db, String sql, Function callback }
-NAN_METHOD(SQLiteStatement::NewStmt)
+// Every statement runs in its own savepoint so a failed one does not affect the rest, a failed COMMIT fails all of them
+void SQLiteDatabase::Work_Group(uv_work_t* req)
 {
-    Nan::HandleScope scope;
+    GroupBaton* baton = static_cast<GroupBaton*>(req->data);
 
-    if (!info.IsConstructCall()) Nan::ThrowError("Use the new operator to create new Statement objects");
+    // Runs alone on the main connection, no other statement can get into the group transaction
+    RunGroup(baton);
+}
 
-    if (info.Length() < 1 || !info[0]->IsObject()) return Nan::ThrowError("Database object expected");
-    NAN_REQUIRE_ARGUMENT_STRING(1, sql);
-    NAN_EXPECT_ARGUMENT_FUNCTION(2, callback);
+void SQLiteDatabase::RunGroup(GroupBaton *baton)
+{
+    SQLiteDatabase *db = baton->db;
 
-    SQLiteDatabase* db = Nan::ObjectWrap::Unwrap < SQLiteDatabase > (Nan::To<Object>(info[0]).ToLocalChecked());
-    SQLiteStatement* stmt = new SQLiteStatement(db, *sql);
-    stmt->Wrap(info.This());
-    Nan::Set(info.This(), Nan::New("sql").ToLocalChecked(), Nan::New(*sql).ToLocalChecked());
-    stmt->op = "new";
-    Baton* baton = new Baton(stmt, callback);
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Prepare, (uv_after_work_cb)Work_AfterPrepare);
+    bool nested = !sqlite3_get_autocommit(db->_handle);
+    if (!nested) {
+        baton->status = db->ExecCached("BEGIN IMMEDIATE");
+    }
+    if (baton->status == SQLITE_OK) {
+        for (uint i = 0; i < baton->reqs.size(); i++) {
+            SQLiteStatement::Baton *b = static_cast<SQLiteStatement::Baton*>(baton->reqs[i]->data);
+            int status = db->ExecCached("SAVEPOINT group_commit");
+            if (status != SQLITE_OK) {
+                b->stmt->status = status;
+                b->stmt->message = sqlite3_errmsg(db->_handle);
+                continue;
+            }
+            SQLiteStatement::Work_RunPrepare(baton->reqs[i]);
+            // Some errors roll back the whole transaction
+            if (!nested && sqlite3_get_autocommit(db->_handle)) {
+                baton->status = b->stmt->status != SQLITE_OK ? b->stmt->status : SQLITE_ABORT;
+                baton->message = b->stmt->message;
+                break;
+            }
+            if (b->stmt->status != SQLITE_OK) {
+                db->ExecCached("ROLLBACK TO group_commit");
+            }
+            db->ExecCached("RELEASE group_commit");
+        }
+        if (nested) return;
+        if (baton->status == SQLITE_OK) {
+            baton->status = db->ExecCached("COMMIT");
+            if (baton->status == SQLITE_OK) return;
+        }
+    }
+    if (baton->message.empty()) baton->message = sqlite3_errmsg(db->_handle);
+    if (!sqlite3_get_autocommit(db->_handle)) sqlite3_exec(db->_handle, "ROLLBACK", NULL, NULL, NULL);
+
+    for (uint i = 0; i < baton->reqs.size(); i++) {
+        SQLiteStatement::Baton *b = static_cast<SQLiteStatement::Baton*>(baton->reqs[i]->data);
+        b->changes = 0;
+        b->stmt->status = baton->status;
+        b->stmt->message = baton->message;
+    }
+}
 
-    NAN_RETURN(info.Holder());
+// Every caller gets its own result
+void SQLiteDatabase::Work_AfterGroup(uv_work_t* req)
+{
+    GroupBaton* baton = static_cast<GroupBaton*>(req->data);
+
+    for (uint i = 0; i < baton->reqs.size(); i++) {
+        SQLiteStatement::Work_AfterRun(baton->reqs[i]);
+    }
+    delete baton;
 }
 
-NAN_METHOD(SQLiteStatement::Prepare)
+// [ sql | { sql, params }, ...], [options], [callback], runs on a reader if all statements are known to be read-only
+NAN_METHOD(SQLiteDatabase::Pipeline)
 {
     Nan::HandleScope scope;
-    SQLiteStatement* stmt = Nan::ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
 
-    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
     NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+    if (info.Length() < 1 || !info[0]->IsArray()) return Nan::ThrowError("Argument 0 must be an array");
+
+    Local<Array> list = Local<Array>::Cast(info[0]);
+    for (uint i = 0; i < list->Length(); i++) {
+        Local<Value> item = Nan::Get(list, i).ToLocalChecked();
+        if (item->IsString()) continue;
+        if (!item->IsObject() || !GetOption(Nan::To<Object>(item).ToLocalChecked(), "sql")->IsString()) {
+            return Nan::ThrowError("Every item must be a string or an object with sql");
+        }
+    }
 
-    stmt->op = "prepare";
-    stmt->sql = *sql;
-    Baton* baton = new Baton(stmt, callback);
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Prepare, (uv_after_work_cb)Work_AfterPrepare);
+    PipelineBaton* baton = new PipelineBaton(db, callback);
+    ParseOptions(baton->opts, info, 1);
+    if (info.Length() > 1 && info[1]->IsObject() && !info[1]->IsFunction()) {
+        baton->snapshot = Nan::To<bool>(GetOption(Nan::To<Object>(info[1]).ToLocalChecked(), "snapshot")).FromJust();
+    }
+    baton->read = db->readers.size() > 0 && (db->Locked() || sqlite3_get_autocommit(db->_handle));
+    for (uint i = 0; i < list->Length(); i++) {
+        Local<Value> item = Nan::Get(list, i).ToLocalChecked();
+        baton->items.emplace_back();
+        if (item->IsString()) {
+            baton->items.back().sql = *Nan::Utf8String(item);
+        } else {
+            Local<Object> obj = Nan::To<Object>(item).ToLocalChecked();
+            baton->items.back().sql = *Nan::Utf8String(GetOption(obj, "sql"));
+            Local<Value> params = GetOption(obj, "params");
+            if (params->IsArray() && !ParseParameters(baton->items.back().params, Local<Array>::Cast(params))) {
+                delete baton;
+                return;
+            }
+        }
+        baton->read = baton->read && db->IsReader(baton->items.back().sql);
+    }
+    // A snapshot on the main connection must not see other writes in the middle
+    db->Queue(&baton->request, Work_Pipeline, (uv_after_work_cb)Work_AfterPipeline, NULL, baton->read ? &baton->reader : NULL, baton->snapshot && !baton->read);
 
     NAN_RETURN(info.Holder());
 }
 
-void SQLiteStatement::Work_Prepare(uv_work_t* req)
+void SQLiteDatabase::Work_Pipeline(uv_work_t* req)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
-    baton->stmt->Prepare();
+    PipelineBaton* baton = static_cast<PipelineBaton*>(req->data);
+    SQLiteDatabase *db = baton->db;
+    SQLiteReader *reader = baton->reader;
+    sqlite3 *conn = reader ? reader->handle : db->_handle;
+    SQLiteCache *cache = reader ? &reader->cache : &db->cache;
+
+    // One read transaction keeps the same snapshot for all statements
+    bool snapshot = baton->snapshot && sqlite3_get_autocommit(conn);
+    if (snapshot) {
+        baton->status = sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL);
+        if (baton->status != SQLITE_OK) {
+            baton->message = sqlite3_errmsg(conn);
+            if (reader) db->ReleaseReader(reader);
+            baton->reader = NULL;
+            return;
+        }
+    }
+    for (uint i = 0; i < baton->items.size(); i++) {
+        PipelineItem &item = baton->items[i];
+        sqlite3_stmt *stmt = NULL;
+        item.status = cache->Prepare(conn, &stmt, item.sql, db->retries, db->timeout);
+        if (item.status == SQLITE_OK && stmt) {
+            item.cols.Init(stmt);
+            if (reader && !sqlite3_stmt_readonly(stmt)) {
+                item.status = SQLITE_READONLY;
+                item.message = "Statement is not read-only";
+            } else
+            if (BindParameters(item.params, stmt)) {
+                int rows = 0;
+                uint64_t start = uv_hrtime();
+                while ((item.status = sqliteStep(stmt, db->retries, db->timeout)) == SQLITE_ROW) {
+                    if (!rows++) item.cols.Check(stmt);
+                    if (baton->opts.format == FORMAT_COLUMNS) {
+                        GetColumns(item.columns, stmt, item.cols);
+                        continue;
+                    }
+                    item.rows.Add(stmt, item.cols);
+                }
+                sqliteStmtCollect(stmt, start, rows);
+                if (item.status == SQLITE_DONE) item.status = SQLITE_OK;
+            } else {
+                item.status = sqlite3_errcode(conn);
+            }
+            if (!reader && db->readers.size()) {
+                if (sqlite3_stmt_readonly(stmt)) db->SetReader(item.sql); else db->SetWriter(item.sql);
+            }
+        }
+        if (item.status != SQLITE_OK && item.message.empty()) item.message = sqlite3_errmsg(conn);
+        cache->Release(item.sql, stmt, item.status);
+    }
+    if (snapshot) {
+        baton->status = sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+        if (baton->status != SQLITE_OK) {
+            baton->message = sqlite3_errmsg(conn);
+            sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+        }
+    }
+    if (reader) db->ReleaseReader(reader);
+    baton->reader = NULL;
 }
 
-void SQLiteStatement::Work_AfterPrepare(uv_work_t* req)
+// The result is an array with the rows of every statement or an Error with the index for failed ones
+void SQLiteDatabase::Work_AfterPipeline(uv_work_t* req)
 {
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
+    PipelineBaton* baton = static_cast<PipelineBaton*>(req->data);
 
     if (!baton->callback.IsEmpty()) {
-        Local < Value > argv[1];
+        Local < Value > argv[2];
         Local<Function> cb = Nan::New(baton->callback);
-        if (baton->stmt->status != SQLITE_OK) {
-            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
             argv[0] = exception;
         } else {
             argv[0] = Nan::Null();
         }
-        NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 1, argv);
+        Local<Array> results = Nan::New<Array>(baton->items.size());
+        for (uint i = 0; i < baton->items.size(); i++) {
+            PipelineItem &item = baton->items[i];
+            if (item.status != SQLITE_OK) {
+                EXCEPTION(item.message.c_str(), item.status, error);
+                Nan::Set(error_obj, Nan::New("index").ToLocalChecked(), Nan::New(i));
+                Nan::Set(results, i, error);
+            } else {
+                Nan::Set(results, i, SQLiteStatement::GetResult(baton->db, item.rows, item.columns, item.cols, baton->opts));
+            }
+        }
+        argv[1] = results;
+        NAN_TRY_CATCH_CALL(baton->db->handle(), cb, 2, argv);
     } else
-    if (baton->stmt->status != SQLITE_OK) {
-        printf("%s", baton->stmt->message.c_str());
+    if (baton->status != SQLITE_OK) {
+        printf("%s", baton->message.c_str());
     }
     delete baton;
 }
 
-NAN_METHOD(SQLiteStatement::Finalize)
+// Prepare once and execute for every row of parameters in one transaction, inside an open transaction
+// the batch runs in a savepoint
+NAN_METHOD(SQLiteDatabase::RunBatch)
 {
     Nan::HandleScope scope;
-    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
-
-    stmt->Finalize();
-    NAN_RETURN(info.Holder());
-}
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
 
-NAN_METHOD(SQLiteStatement::RunSync)
-{
-    Nan::HandleScope scope;
-    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
-    Row params;
+    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+    if (info.Length() < 2 || !info[1]->IsArray()) return Nan::ThrowError("Argument 1 must be an array");
 
-    stmt->op = "runSync";
-    ParseParameters(params, info, 0);
-    if (BindParameters(params, stmt->_handle)) {
-        stmt->status = sqlite3_step(stmt->_handle);
+    Local<Array> rows = Local<Array>::Cast(info[1]);
+    for (uint i = 0; i < rows->Length(); i++) {
+        if (!Nan::Get(rows, i).ToLocalChecked()->IsArray()) return Nan::ThrowError("Every row must be an array of values");
+    }
 
-        if (!(stmt->status == SQLITE_ROW || stmt->status == SQLITE_DONE)) {
-            stmt->message = string(sqlite3_errmsg(stmt->db->_handle));
-        } else {
-            Nan::Set(stmt->handle(), Nan::New("lastID").ToLocalChecked(), Nan::New((double)sqlite3_last_insert_rowid(stmt->db->_handle)));
-            Nan::Set(stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New((int)sqlite3_changes(stmt->db->_handle)));
-            stmt->status = SQLITE_OK;
+    BatchBaton* baton = new BatchBaton(db, callback, *sql);
+    for (uint i = 0; i < rows->Length(); i++) {
+        baton->rows.emplace_back();
+        if (!ParseParameters(baton->rows.back(), Local<Array>::Cast(Nan::Get(rows, i).ToLocalChecked()))) {
+            delete baton;
+            return;
         }
-    } else {
-        stmt->message = string(sqlite3_errmsg(stmt->db->_handle));
     }
-
-    if (stmt->status != SQLITE_OK) {
-        Nan::ThrowError(stmt->message.c_str());
+    if (info.Length() > 2 && info[2]->IsObject() && !info[2]->IsFunction()) {
+        baton->stop = Nan::To<bool>(GetOption(Nan::To<Object>(info[2]).ToLocalChecked(), "stop_on_error")).FromJust();
     }
+    db->Queue(&baton->request, Work_RunBatch, (uv_after_work_cb)Work_AfterRunBatch, NULL, NULL, true);
+
     NAN_RETURN(info.Holder());
 }
 
-NAN_METHOD(SQLiteStatement::Run)
+static string sqliteQuote(const string &name)
 {
-    Nan::HandleScope scope;
-    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
-
-    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
-
-    stmt->op = "run";
-    Baton* baton = new Baton(stmt, callback);
-    ParseParameters(baton->params, info, 0);
-
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Run, (uv_after_work_cb)Work_AfterRun);
-    NAN_RETURN(info.Holder());
+    string quoted = "\"";
+    for (uint i = 0; i < name.size(); i++) {
+        if (name[i] == '"') quoted += '"';
+        quoted += name[i];
+    }
+    return quoted + "\"";
 }
 
-void SQLiteStatement::Work_Run(uv_work_t* req)
+// Insert rows given by columns: { name: TypedArray|Array, ... }, typed arrays are read in place in the worker
+// and must not be modified until the callback is called
+NAN_METHOD(SQLiteDatabase::InsertColumns)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
 
-    if (BindParameters(baton->params, baton->stmt->_handle)) {
-        baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout);
+    NAN_REQUIRE_ARGUMENT_STRING(0, table);
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+    if (info.Length() < 2 || !info[1]->IsObject() || info[1]->IsArray() || info[1]->IsFunction()) {
+        return Nan::ThrowError("Argument 1 must be an object with columns");
+    }
 
-        if (!(baton->stmt->status == SQLITE_ROW || baton->stmt->status == SQLITE_DONE)) {
-            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+    Local<Object> obj = Nan::To<Object>(info[1]).ToLocalChecked();
+    Local<Array> names = Nan::GetOwnPropertyNames(obj).ToLocalChecked();
+    if (!names->Length()) return Nan::ThrowError("No columns to insert");
+
+    ColumnsBaton* baton = new ColumnsBaton(db, callback);
+    Local<Array> pinned = Nan::New<Array>();
+    string sql = "INSERT INTO " + sqliteQuote(*table) + " (", values;
+    for (uint i = 0; i < names->Length(); i++) {
+        Local<Value> name = Nan::Get(names, i).ToLocalChecked();
+        Local<Value> value = Nan::Get(obj, name).ToLocalChecked();
+        BatchColumn column = { COLUMN_VALUES, NULL, 0 };
+        uint count = 0;
+        if (value->IsTypedArray()) {
+            Local<TypedArray> array = value.As<TypedArray>();
+            column.type = value->IsFloat64Array() ? COLUMN_FLOAT64 :
+                          value->IsFloat32Array() ? COLUMN_FLOAT32 :
+                          value->IsInt32Array() ? COLUMN_INT32 :
+                          value->IsUint32Array() ? COLUMN_UINT32 :
+                          value->IsInt16Array() ? COLUMN_INT16 :
+                          value->IsUint16Array() ? COLUMN_UINT16 :
+                          value->IsInt8Array() ? COLUMN_INT8 :
+                          value->IsBigInt64Array() ? COLUMN_BIGINT64 :
+                          value->IsBigUint64Array() ? COLUMN_BIGUINT64 : COLUMN_UINT8;
+            Nan::TypedArrayContents<char> contents(array);
+            column.data = *contents;
+            count = array->Length();
+            Nan::Set(pinned, pinned->Length(), array);
+        } else
+        if (value->IsArray()) {
+            column.values = baton->rows.size();
+            baton->rows.emplace_back();
+            if (!ParseParameters(baton->rows.back(), Local<Array>::Cast(value))) {
+                delete baton;
+                return;
+            }
+            count = baton->rows.back().size();
         } else {
-            baton->inserted_id = sqlite3_last_insert_rowid(baton->stmt->db->_handle);
-            baton->changes = sqlite3_changes(baton->stmt->db->_handle);
-            baton->stmt->status = SQLITE_OK;
+            delete baton;
+            return Nan::ThrowError("Every column must be an array or a typed array");
         }
-    } else {
-        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+        if (i > 0 && count != baton->count) {
+            delete baton;
+            return Nan::ThrowError("All columns must have the same number of values");
+        }
+        baton->count = count;
+        baton->columns.push_back(column);
+        sql += (i ? ", " : "") + sqliteQuote(*Nan::Utf8String(name));
+        values += i ? ", ?" : "?";
     }
+    if (info.Length() > 2 && info[2]->IsObject() && !info[2]->IsFunction()) {
+        baton->stop = Nan::To<bool>(GetOption(Nan::To<Object>(info[2]).ToLocalChecked(), "stop_on_error")).FromJust();
+    }
+    baton->sparam = sql + ") VALUES (" + values + ")";
+    baton->pinned.Reset(pinned);
+    db->Queue(&baton->request, Work_RunBatch, (uv_after_work_cb)Work_AfterRunBatch, NULL, NULL, true);
+
+    NAN_RETURN(info.Holder());
 }
 
-void SQLiteStatement::Work_RunPrepare(uv_work_t* req)
+void SQLiteDatabase::Work_RunBatch(uv_work_t* req)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
+    BatchBaton* baton = static_cast<BatchBaton*>(req->data);
 
-    if (!baton->stmt->Prepare()) return;
+    // Runs alone on the main connection, no other statement can get into the batch transaction
+    ExecBatch(baton);
+}
 
-    if (BindParameters(baton->params, baton->stmt->_handle)) {
-        baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout);
+void SQLiteDatabase::ExecBatch(BatchBaton *baton)
+{
+    SQLiteDatabase *db = baton->db;
+    sqlite3_stmt *stmt = NULL;
 
-        if (!(baton->stmt->status == SQLITE_ROW || baton->stmt->status == SQLITE_DONE)) {
-            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
-        } else {
-            baton->inserted_id = sqlite3_last_insert_rowid(baton->stmt->db->_handle);
-            baton->changes = sqlite3_changes(baton->stmt->db->_handle);
-            baton->stmt->status = SQLITE_OK;
+    bool nested = !sqlite3_get_autocommit(db->_handle);
+    baton->status = sqlite3_exec(db->_handle, nested ? "SAVEPOINT runBatch" : "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    if (baton->status != SQLITE_OK) {
+        baton->message = sqlite3_errmsg(db->_handle);
+        return;
+    }
+    baton->status = db->cache.Prepare(db->_handle, &stmt, baton->sparam, db->retries, db->timeout);
+    if (baton->status == SQLITE_OK) {
+        uint64_t start = uv_hrtime();
+        for (uint i = 0; i < baton->Size(); i++) {
+            string message;
+            int status = baton->Bind(stmt, i, message);
+            if (status == SQLITE_OK) {
+                status = sqliteStep(stmt, db->retries, db->timeout);
+            }
+            if (status == SQLITE_DONE || status == SQLITE_ROW) {
+                baton->changes += sqlite3_changes(db->_handle);
+                continue;
+            }
+            BatchError error = { i, sqlite3_errcode(db->_handle), sqlite3_errmsg(db->_handle) };
+            if (!message.empty()) {
+                error.status = status;
+                error.message = message;
+            }
+            baton->errors.push_back(error);
+            // Some errors roll back the whole transaction, the rest of the rows must not run in autocommit
+            if (baton->stop || sqlite3_get_autocommit(db->_handle)) {
+                baton->status = error.status;
+                baton->message = error.message;
+                break;
+            }
         }
+        // Every row is an execution, the batch is counted as a whole
+        sqliteStmtCollect(stmt, start, 0, NULL, baton->Size());
+        db->cache.Release(baton->sparam, stmt, baton->status);
     } else {
-        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+        baton->message = sqlite3_errmsg(db->_handle);
+        if (stmt) sqlite3_finalize(stmt);
+    }
+
+    if (baton->status == SQLITE_OK) {
+        baton->status = sqlite3_exec(db->_handle, nested ? "RELEASE runBatch" : "COMMIT", NULL, NULL, NULL);
+        if (baton->status == SQLITE_OK) return;
+        baton->message = sqlite3_errmsg(db->_handle);
+    }
+    baton->changes = 0;
+    if (!sqlite3_get_autocommit(db->_handle)) {
+        sqlite3_exec(db->_handle, nested ? "ROLLBACK TO runBatch; RELEASE runBatch" : "ROLLBACK", NULL, NULL, NULL);
     }
-    baton->stmt->Finalize();
 }
 
-void SQLiteStatement::Work_AfterRun(uv_work_t* req)
+void SQLiteDatabase::Work_AfterRunBatch(uv_work_t* req)
 {
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
-
-    Nan::Set(baton->stmt->handle(), Nan::New("lastID").ToLocalChecked(), Nan::New((double)baton->inserted_id));
-    Nan::Set(baton->stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New(baton->changes));
+    BatchBaton* baton = static_cast<BatchBaton*>(req->data);
 
     if (!baton->callback.IsEmpty()) {
-        Local < Value > argv[1];
+        Local < Value > argv[2];
         Local<Function> cb = Nan::New(baton->callback);
-        if (baton->stmt->status != SQLITE_OK) {
-            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
             argv[0] = exception;
         } else {
             argv[0] = Nan::Null();
         }
-        NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 1, argv);
+        Local<Object> result = Nan::New<Object>();
+        Local<Array> errors = Nan::New<Array>(baton->errors.size());
+        for (uint i = 0; i < baton->errors.size(); i++) {
+            EXCEPTION(baton->errors[i].message.c_str(), baton->errors[i].status, error);
+            Nan::Set(error_obj, Nan::New("index").ToLocalChecked(), Nan::New(baton->errors[i].index));
+            Nan::Set(errors, i, error);
+        }
+        Nan::Set(result, Nan::New("changes").ToLocalChecked(), Nan::New(baton->changes));
+        Nan::Set(result, Nan::New("errors").ToLocalChecked(), errors);
+        argv[1] = result;
+        NAN_TRY_CATCH_CALL(baton->db->handle(), cb, 2, argv);
     } else
-    if (baton->stmt->status != SQLITE_OK) {
-        printf("%s", baton->stmt->message.c_str());
+    if (baton->status != SQLITE_OK) {
+        printf("%s", baton->message.c_str());
     }
     delete baton;
 }
 
-NAN_METHOD(SQLiteStatement::QuerySync)
+NAN_METHOD(SQLiteDatabase::Copy)
 {
     Nan::HandleScope scope;
-    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    string errmsg;
+    sqlite3 *handle2 = 0;
+    int rc = SQLITE_OK;
+    SQLitePCacheOwner owner(db->pages);
 
-    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+    if (info.Length() && info[0]->IsObject()) {
+        SQLiteDatabase* sdb = Nan::ObjectWrap::Unwrap < SQLiteDatabase > (Nan::To<Object>(info[0]).ToLocalChecked());
+        handle2 = sdb->_handle;
+    } else
+    if (info.Length() && info[0]->IsString()) {
+        Nan::Utf8String filename(info[0]);
+        rc = sqlite3_open_v2(*filename, &handle2, SQLITE_OPEN_READONLY, NULL);
+        if (rc != SQLITE_OK) {
+            errmsg = sqlite3_errmsg(handle2);
+            sqlite3_close(handle2);
+            Nan::ThrowError(errmsg.c_str());
+        }
+    } else {
+        Nan::ThrowError("Database object or database file name expected");
+    }
 
-    int n = 0;
-    Row params;
-    ParseParameters(params, info, 0);
-    Local<Array> result = Nan::New<Array>();
-    stmt->op = "querySync";
+    sqlite3_backup *backup;
+    backup = sqlite3_backup_init(db->_handle, "main", handle2, "main");
+    if (backup) {
+        sqlite3_backup_step(backup, -1);
+        sqlite3_backup_finish(backup);
+        rc = sqlite3_errcode(db->_handle);
+        errmsg = sqlite3_errmsg(db->_handle);
+    }
 
-    if (BindParameters(params, stmt->_handle)) {
-        while ((stmt->status = sqlite3_step(stmt->_handle)) == SQLITE_ROW) {
-            Local<Object> obj(GetRow(stmt->_handle));
-            Nan::Set(result, Nan::New(n++), obj);
-        }
-        if (stmt->status != SQLITE_DONE) {
-            stmt->message = string(sqlite3_errmsg(stmt->db->_handle));
-        }
+    if (info[0]->IsString()) {
+        sqlite3_close(handle2);
+    }
+
+    if (rc != SQLITE_OK) {
+        Nan::ThrowError(errmsg.c_str());
+    }
+    NAN_RETURN(info.Holder());
+}
+
+// { [schema] }, returns the database image as a Buffer owning the memory from sqlite3_serialize
+NAN_METHOD(SQLiteDatabase::Serialize)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    if (!db->_handle) return Nan::ThrowError("Database is not open");
+    if (db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(db->pages);
+
+    string schema = "main";
+    if (info.Length() > 0 && info[0]->IsString()) schema = *Nan::Utf8String(info[0]);
+
+    sqlite3_int64 size = 0;
+    unsigned char *data = sqlite3_serialize(db->_handle, schema.c_str(), &size, 0);
+    Local<Object> buffer;
+    if (data) {
+        buffer = Nan::NewBuffer((char*)data, size, FreeSqliteBuffer, NULL).ToLocalChecked();
     } else {
-        stmt->message = string(sqlite3_errmsg(stmt->db->_handle));
+        // An empty database has no pages
+        if (size || sqlite3_errcode(db->_handle) != SQLITE_OK) return Nan::ThrowError(sqlite3_errmsg(db->_handle));
+        buffer = Nan::NewBuffer(0).ToLocalChecked();
     }
-    if (stmt->status != SQLITE_DONE) {
-        Nan::ThrowError(stmt->message.c_str());
+    NAN_RETURN(buffer);
+}
+
+// { buffer, [schema], [flags] }, replaces the database with a copy of the image, it becomes an in-memory database
+NAN_METHOD(SQLiteDatabase::Deserialize)
+{
+    Nan::HandleScope scope;
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
+    if (!db->_handle) return Nan::ThrowError("Database is not open");
+    if (db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(db->pages);
+    // Readers would keep reading the database file
+    if (db->readers.size()) return Nan::ThrowError("Cannot deserialize a database with readers");
+    // Running and queued jobs use the connection and the cached statements that are about to go away
+    if (db->running || db->reading || db->waiting.size() || db->txns.size() || db->reads.size() || db->group.size()) {
+        return Nan::ThrowError("Cannot deserialize a database with pending jobs");
     }
-    NAN_RETURN(result);
+    if (info.Length() < 1 || !node::Buffer::HasInstance(info[0])) return Nan::ThrowError("Argument 0 must be a Buffer");
+
+    string schema = "main";
+    int flags = SQLITE_DESERIALIZE_RESIZEABLE;
+    for (int i = 1; i < info.Length(); i++) {
+        if (info[i]->IsString()) schema = *Nan::Utf8String(info[i]); else
+        if (info[i]->IsInt32()) flags = Nan::To<int32_t>(info[i]).FromJust();
+    }
+
+    size_t size = node::Buffer::Length(info[0]);
+    unsigned char *data = (unsigned char*)sqlite3_malloc64(size ? size : 1);
+    if (!data) return Nan::ThrowError("Out of memory");
+    memcpy(data, node::Buffer::Data(info[0]), size);
+    // Images of WAL databases are marked as WAL in the header, the memory database can only use the rollback journal
+    if (size >= 20 && data[18] == 2 && data[19] == 2) data[18] = data[19] = 1;
+
+    // Cached statements are prepared against the old database
+    db->cache.Clear();
+    int status = sqlite3_deserialize(db->_handle, schema.c_str(), data, size, size, flags | SQLITE_DESERIALIZE_FREEONCLOSE);
+    if (status != SQLITE_OK) return Nan::ThrowError(sqlite3_errmsg(db->_handle));
+
+    NAN_RETURN(info.Holder());
 }
 
-NAN_METHOD(SQLiteStatement::Query)
+// { dest, [options], [callback] }, dest is a Database object or a file name
+NAN_METHOD(SQLiteDatabase::Backup)
 {
     Nan::HandleScope scope;
-    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    SQLiteDatabase* db = ObjectWrap::Unwrap < SQLiteDatabase > (info.Holder());
 
     NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
-    Baton* baton = new Baton(stmt, callback);
-    ParseParameters(baton->params, info, 0);
-    stmt->op = "query";
-    uv_queue_work(uv_default_loop(), &baton->request, Work_Query, (uv_after_work_cb)Work_AfterQuery);
+    if (info.Length() < 1 || !(info[0]->IsString() || (info[0]->IsObject() && !info[0]->IsFunction()))) {
+        return Nan::ThrowError("Database object or database file name expected");
+    }
+    BackupBaton *baton = new BackupBaton(db, callback, info[0]->IsString() ? *Nan::Utf8String(info[0]) : "");
+    if (info[0]->IsObject()) {
+        baton->dest = Nan::ObjectWrap::Unwrap < SQLiteDatabase > (Nan::To<Object>(info[0]).ToLocalChecked());
+        baton->dest->Ref();
+    }
+    if (info.Length() > 1 && info[1]->IsObject() && !info[1]->IsFunction()) {
+        Local<Object> opts = Nan::To<Object>(info[1]).ToLocalChecked();
+        baton->pages = GetOptionInt(opts, "pagesPerStep", 100);
+        baton->sleep = GetOptionInt(opts, "sleepMs", 0);
+        baton->busy_timeout = GetOptionInt(opts, "busyTimeoutMs", 5000);
+        Local<Value> progress = GetOption(opts, "onProgress");
+        if (progress->IsFunction()) baton->progress.Reset(Local<Function>::Cast(progress));
+    }
+    if (baton->pages == 0) baton->pages = 100;
+    db->Queue(&baton->request, Work_Backup, (uv_after_work_cb)Work_AfterBackup);
+
     NAN_RETURN(info.Holder());
 }
 
-void SQLiteStatement::Work_Query(uv_work_t* req)
+void SQLiteDatabase::BackupFinish(BackupBaton *baton)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
-
-    if (BindParameters(baton->params, baton->stmt->_handle)) {
-        while ((baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout)) == SQLITE_ROW) {
-            Row row;
-            GetRow(row, baton->stmt->_handle);
-            baton->rows.push_back(row);
+    sqlite3 *handle2 = baton->dest ? baton->dest->_handle : baton->handle2;
+    if (baton->backup) {
+        int status = sqlite3_backup_finish(baton->backup);
+        if (baton->status == SQLITE_OK && status != SQLITE_OK) {
+            baton->status = status;
+            baton->message = sqlite3_errmsg(handle2);
         }
-        if (baton->stmt->status != SQLITE_DONE) {
-            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
-        }
-    } else {
-        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+        baton->backup = NULL;
+    }
+    if (baton->handle2) {
+        sqlite3_close(baton->handle2);
+        baton->handle2 = NULL;
     }
+    baton->done = true;
 }
 
-void SQLiteStatement::Work_QueryPrepare(uv_work_t* req)
+void SQLiteDatabase::BackupTimer(uv_timer_t *handle)
 {
-    Baton* baton = static_cast<Baton*>(req->data);
-
-    if (!baton->stmt->Prepare()) return;
+    BackupBaton *baton = static_cast<BackupBaton*>(handle->data);
+    baton->db->Queue(&baton->request, Work_Backup, (uv_after_work_cb)Work_AfterBackup);
+}
 
-    if (BindParameters(baton->params, baton->stmt->_handle)) {
-        while ((baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout)) == SQLITE_ROW) {
-            Row row;
-            GetRow(row, baton->stmt->_handle);
-            baton->rows.push_back(row);
+// The main connection is the source so changes made through it are applied to the copy without restarting the backup
+void SQLiteDatabase::Work_Backup(uv_work_t* req)
+{
+    BackupBaton* baton = static_cast<BackupBaton*>(req->data);
+
+    if (!baton->backup) {
+        if (!baton->dest) {
+            baton->status = sqlite3_open_v2(baton->sparam.c_str(), &baton->handle2, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+            if (baton->status != SQLITE_OK) {
+                baton->message = sqlite3_errmsg(baton->handle2);
+                return BackupFinish(baton);
+            }
         }
-        if (baton->stmt->status != SQLITE_DONE) {
-            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+        sqlite3 *handle2 = baton->dest ? baton->dest->_handle : baton->handle2;
+        baton->backup = sqlite3_backup_init(handle2, "main", baton->db->_handle, "main");
+        if (!baton->backup) {
+            baton->status = sqlite3_errcode(handle2);
+            baton->message = sqlite3_errmsg(handle2);
+            return BackupFinish(baton);
         }
+    }
+    int status = sqlite3_backup_step(baton->backup, baton->pages);
+    baton->remaining = sqlite3_backup_remaining(baton->backup);
+    baton->pagecount = sqlite3_backup_pagecount(baton->backup);
+    // Busy or locked databases are retried on the next step until the busy timeout
+    if (status == SQLITE_BUSY || status == SQLITE_LOCKED) {
+        uint64_t now = uv_hrtime();
+        if (!baton->busy) baton->busy = now;
+        if (now - baton->busy < (uint64_t)baton->busy_timeout * 1000000) return;
     } else {
-        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->db->_handle));
+        baton->busy = 0;
     }
-    baton->stmt->Finalize();
+    if (status == SQLITE_OK) return;
+    if (status != SQLITE_DONE) {
+        baton->status = status;
+        baton->message = sqlite3_errstr(status);
+    }
+    BackupFinish(baton);
 }
 
-void SQLiteStatement::Work_AfterQuery(uv_work_t* req)
+void SQLiteDatabase::Work_AfterBackup(uv_work_t* req)
 {
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
+    BackupBaton* baton = static_cast<BackupBaton*>(req->data);
 
-    Nan::Set(baton->stmt->handle(), Nan::New("lastID").ToLocalChecked(), Nan::New((double)baton->inserted_id));
-    Nan::Set(baton->stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New(baton->changes));
+    // Returning false from the progress callback cancels the backup
+    if (!baton->progress.IsEmpty() && baton->status == SQLITE_OK) {
+        Local<Object> obj = Nan::New<Object>();
+        Nan::Set(obj, Nan::New("remaining").ToLocalChecked(), Nan::New(baton->remaining));
+        Nan::Set(obj, Nan::New("pagecount").ToLocalChecked(), Nan::New(baton->pagecount));
+        Local<Value> argv[] = { obj };
+        Nan::TryCatch try_catch;
+        Nan::MaybeLocal<Value> rc = Nan::Call(Nan::New(baton->progress), baton->db->handle(), 1, argv);
+        if (try_catch.HasCaught()) FatalException(try_catch);
+        if (!baton->done && !rc.IsEmpty() && rc.ToLocalChecked()->IsFalse()) {
+            BackupFinish(baton);
+            baton->status = SQLITE_INTERRUPT;
+            baton->message = "Backup cancelled";
+        }
+    }
+    if (!baton->done) {
+        // Do not spin on a locked database
+        int sleep = baton->busy ? max(baton->sleep, 10) : baton->sleep;
+        if (sleep <= 0) {
+            return baton->db->Queue(&baton->request, Work_Backup, (uv_after_work_cb)Work_AfterBackup);
+        }
+        if (!baton->timer) {
+            baton->timer = new uv_timer_t;
+            uv_timer_init(uv_default_loop(), baton->timer);
+            baton->timer->data = baton;
+        }
+        uv_timer_start(baton->timer, BackupTimer, sleep, 0);
+        return;
+    }
 
     if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
         Local<Function> cb = Nan::New(baton->callback);
-        if (baton->stmt->status != SQLITE_DONE) {
-            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
-            Local<Value> argv[] = { exception, Nan::New<Array>() };
-            NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 2, argv);
-        } else
-        if (baton->rows.size()) {
-            Local<Array> result = Nan::New<Array>(baton->rows.size());
-            for (uint i = 0; i < baton->rows.size(); i++) {
-                Nan::Set(result, i, RowToJS(baton->rows[i]));
-            }
-            Local<Value> argv[] = { Nan::Null(), result };
-            NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 2, argv);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
+            argv[0] = exception;
         } else {
-            Local<Value> argv[] = { Nan::Null(), Nan::New<Array>() };
-            NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 2, argv);
+            argv[0] = Nan::Null();
         }
+        NAN_TRY_CATCH_CALL(baton->db->handle(), cb, 1, argv);
     } else
-    if (baton->stmt->status != SQLITE_DONE) {
-        printf("%s", baton->stmt->message.c_str());
+    if (baton->status != SQLITE_OK) {
+        printf("%s", baton->message.c_str());
     }
     delete baton;
 }
 
-#ifdef _MSC_VER
-static void usleep(int waitTime)
+// { Database db, String sql, Function callback }
+NAN_METHOD(SQLiteStatement::NewStmt)
 {
-    __int64 time1 = 0, time2 = 0, freq = 0;
+    Nan::HandleScope scope;
 
-    QueryPerformanceCounter((LARGE_INTEGER *) &time1);
-    QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
-    do { QueryPerformanceCounter((LARGE_INTEGER *) &time2); } while((time2-time1) < waitTime);
-}
-#endif
+    if (!info.IsConstructCall()) Nan::ThrowError("Use the new operator to create new Statement objects");
 
-static int busy(void *ptr, int code)
-{
-    return 1;
+    if (info.Length() < 1 || !info[0]->IsObject()) return Nan::ThrowError("Database object expected");
+    NAN_REQUIRE_ARGUMENT_STRING(1, sql);
+    NAN_EXPECT_ARGUMENT_FUNCTION(2, callback);
+
+    SQLiteDatabase* db = Nan::ObjectWrap::Unwrap < SQLiteDatabase > (Nan::To<Object>(info[0]).ToLocalChecked());
+    SQLiteStatement* stmt = new SQLiteStatement(db, *sql);
+    stmt->Wrap(info.This());
+    Nan::Set(info.This(), Nan::New("sql").ToLocalChecked(), Nan::New(*sql).ToLocalChecked());
+    stmt->op = "new";
+    Baton* baton = new Baton(stmt, callback);
+    stmt->db->Queue(&baton->request, Work_Prepare, (uv_after_work_cb)Work_AfterPrepare);
+
+    NAN_RETURN(info.Holder());
 }
 
-static void setTimeout(sqlite3 *handle, int timeout)
+NAN_METHOD(SQLiteStatement::Prepare)
 {
-    if (timeout >= 0) {
-        sqlite3_busy_timeout(handle, timeout);
-    } else {
-        sqlite3_busy_handler(handle, busy, NULL);
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = Nan::ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+
+    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    stmt->op = "prepare";
+    stmt->sql = *sql;
+    Baton* baton = new Baton(stmt, callback);
+    stmt->db->Queue(&baton->request, Work_Prepare, (uv_after_work_cb)Work_AfterPrepare);
+
+    NAN_RETURN(info.Holder());
+}
+
+void SQLiteStatement::Work_Prepare(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+    baton->stmt->Prepare();
+}
+
+void SQLiteStatement::Work_AfterPrepare(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->stmt->status != SQLITE_OK) {
+            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
+        NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 1, argv);
+    } else
+    if (baton->stmt->status != SQLITE_OK) {
+        printf("%s", baton->stmt->message.c_str());
     }
+    delete baton;
 }
 
-// Set or reset busy timeout or handler, -1 set indefinite busy handler otherwise timeout is set
-static void sqliteTimeout(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+NAN_METHOD(SQLiteStatement::Finalize)
 {
-    setTimeout(sqlite3_context_db_handle(ctx), argc > 0 ? sqlite3_value_int(argv[0]) : -1);
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+
+    if (stmt->each) {
+        if (stmt->each->running) return Nan::ThrowError("Statement is busy");
+        EachDone(stmt->each);
+    }
+    stmt->Finalize();
+    stmt->db->Dispatch();
+    NAN_RETURN(info.Holder());
 }
 
-// Implementation of string concatenation function
-struct ConcatCtx {
-    int len;
-    int count;
-    char *data;
-    char *close;
-};
+NAN_METHOD(SQLiteStatement::RunSync)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    if (stmt->each) return Nan::ThrowError("Statement is busy");
+    if (stmt->db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(stmt->db->pages);
+    SQLiteParams params;
+    SQLiteOptions opts;
 
-static void sqliteConcat(ConcatCtx *p, const char *data, int len)
+    stmt->op = "runSync";
+    if (!ParseParameters(params, info, 0)) return;
+    ParseOptions(opts, info, 0);
+    if (BindParameters(params, stmt->_handle)) {
+        stmt->status = sqlite3_step(stmt->_handle);
+
+        if (!(stmt->status == SQLITE_ROW || stmt->status == SQLITE_DONE)) {
+            stmt->message = string(sqlite3_errmsg(stmt->conn));
+        } else {
+            Nan::Set(stmt->handle(), Nan::New("lastID").ToLocalChecked(), IntegerToJS(sqlite3_last_insert_rowid(stmt->conn), opts.bigint));
+            Nan::Set(stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New((int)sqlite3_changes(stmt->conn)));
+            stmt->status = SQLITE_OK;
+        }
+    } else {
+        stmt->message = string(sqlite3_errmsg(stmt->conn));
+    }
+    if (params.size()) stmt->Unbind();
+
+    if (stmt->status != SQLITE_OK) {
+        Nan::ThrowError(stmt->message.c_str());
+    }
+    NAN_RETURN(info.Holder());
+}
+
+NAN_METHOD(SQLiteStatement::Run)
 {
-    if (data) {
-        p->data = (char*)realloc(p->data, p->len + len + 1);
-        p->data[p->len] = 0;
-        strncat(p->data, data, len);
-        p->len += len;
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    if (stmt->each) return Nan::ThrowError("Statement is busy");
+
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    stmt->op = "run";
+    Baton* baton = new Baton(stmt, callback);
+    if (!ParseParameters(baton->params, info, 0)) {
+        delete baton;
+        return;
     }
+    ParseOptions(baton->opts, info, 0);
 
+    stmt->db->Queue(&baton->request, Work_Run, (uv_after_work_cb)Work_AfterRun, stmt->owner);
+    NAN_RETURN(info.Holder());
 }
-static void sqliteConcatStep(sqlite3_context* ctx, int argc, sqlite3_value**argv)
+
+void SQLiteStatement::Work_Run(uv_work_t* req)
 {
-    ConcatCtx *p = (ConcatCtx *) sqlite3_aggregate_context(ctx, sizeof(*p));
-    const char *txt = (const char*)sqlite3_value_text(argv[0]);
-    const char *sep = (const char*)sqlite3_value_text(argv[1]);
-    if (!txt) return;
-    if (argc > 3) {
-        const char *open = (const char*)sqlite3_value_text(argv[2]);
-        const char *close = (const char*)sqlite3_value_text(argv[3]);
-        if (!p->close && close) p->close = strdup(close);
-        if (!p->data && open) sqliteConcat(p, open, strlen(open));
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (BindParameters(baton->params, baton->stmt->_handle)) {
+        uint64_t start = uv_hrtime();
+        baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout);
+        sqliteStmtCollect(baton->stmt->_handle, start, 0, &baton->stmt->counters);
+
+        if (!(baton->stmt->status == SQLITE_ROW || baton->stmt->status == SQLITE_DONE)) {
+            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->conn));
+        } else {
+            baton->inserted_id = sqlite3_last_insert_rowid(baton->stmt->conn);
+            baton->changes = sqlite3_changes(baton->stmt->conn);
+            baton->stmt->status = SQLITE_OK;
+        }
+    } else {
+        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->conn));
     }
-    if (p->count && sep) sqliteConcat(p, sep, strlen(sep));
-    sqliteConcat(p, txt, strlen(txt));
-    p->count++;
+    if (baton->params.size()) baton->stmt->Unbind();
 }
 
-static void sqliteConcatFinal(sqlite3_context* ctx)
+void SQLiteStatement::Work_RunPrepare(uv_work_t* req)
 {
-    ConcatCtx *p = (ConcatCtx *) sqlite3_aggregate_context(ctx, 0);
-    if (p && p->data) {
-        if (p->close) {
-            sqliteConcat(p, p->close, strlen(p->close));
-            free(p->close);
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (!baton->stmt->Prepare()) return;
+
+    if (BindParameters(baton->params, baton->stmt->_handle)) {
+        uint64_t start = uv_hrtime();
+        baton->stmt->status = sqliteStep(baton->stmt->_handle, baton->stmt->db->retries, baton->stmt->db->timeout);
+        sqliteStmtCollect(baton->stmt->_handle, start, 0, &baton->stmt->counters);
+
+        if (!(baton->stmt->status == SQLITE_ROW || baton->stmt->status == SQLITE_DONE)) {
+            baton->stmt->message = string(sqlite3_errmsg(baton->stmt->conn));
+        } else {
+            baton->inserted_id = sqlite3_last_insert_rowid(baton->stmt->conn);
+            baton->changes = sqlite3_changes(baton->stmt->conn);
+            baton->stmt->status = SQLITE_OK;
         }
-        sqlite3_result_text(ctx, p->data, p->len, free);
     } else {
-        sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
+        baton->stmt->message = string(sqlite3_errmsg(baton->stmt->conn));
     }
+    baton->stmt->Finalize();
 }
 
-static bool sqliteInitDb(sqlite3 *handle)
+void SQLiteStatement::Work_AfterRun(uv_work_t* req)
 {
-    if (!handle) return false;
-    sqlite3_create_function(handle, "concat", -1, SQLITE_UTF8, 0, NULL, sqliteConcatStep, sqliteConcatFinal);
-    sqlite3_create_function(handle, "busy_timeout", 1, SQLITE_UTF8, 0, sqliteTimeout, 0, 0);
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
 
-    return true;
+    Nan::Set(baton->stmt->handle(), Nan::New("lastID").ToLocalChecked(), IntegerToJS(baton->inserted_id, baton->opts.bigint));
+    Nan::Set(baton->stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New(baton->changes));
+
+    if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->stmt->status != SQLITE_OK) {
+            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
+        NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 1, argv);
+    } else
+    if (baton->stmt->status != SQLITE_OK) {
+        printf("%s", baton->stmt->message.c_str());
+    }
+    delete baton;
 }
 
-static int sqlitePrepare(sqlite3 *db, sqlite3_stmt **stmt, string sql, int count, int timeout)
+NAN_METHOD(SQLiteStatement::QuerySync)
 {
-    int n = 0, rc;
-    do {
-        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, stmt, 0);
-        if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
-            n++;
-            usleep(timeout);
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    if (stmt->each) return Nan::ThrowError("Statement is busy");
+    if (stmt->db->Locked()) return Nan::ThrowError("Database is locked by a transaction");
+    SQLitePCacheOwner owner(stmt->db->pages);
+
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    int n = 0;
+    SQLiteParams params;
+    SQLiteOptions opts;
+    if (!ParseParameters(params, info, 0)) return;
+    ParseOptions(opts, info, 0);
+    Local<Array> result = Nan::New<Array>();
+    vector<SQLiteColumnData*> columns;
+    stmt->op = "querySync";
+    SQLiteRowBuilder builder(stmt->db->GetShape(stmt->cols), opts.bigint);
+
+    if (BindParameters(params, stmt->_handle)) {
+        bool first = true;
+        while ((stmt->status = sqlite3_step(stmt->_handle)) == SQLITE_ROW) {
+            if (first && stmt->cols.Check(stmt->_handle)) builder = SQLiteRowBuilder(stmt->db->GetShape(stmt->cols), opts.bigint);
+            first = false;
+            if (opts.format == FORMAT_COLUMNS) {
+                GetColumns(columns, stmt->_handle, stmt->cols);
+                continue;
+            }
+            if (opts.format == FORMAT_RAW) {
+                Nan::Set(result, n++, GetRowArray(stmt->_handle, stmt->cols, builder));
+            } else {
+                Nan::Set(result, n++, GetRow(stmt->_handle, stmt->cols, builder));
+            }
         }
-    } while (n < count && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
-    return rc;
+        if (stmt->status != SQLITE_DONE) {
+            stmt->message = string(sqlite3_errmsg(stmt->conn));
+        }
+    } else {
+        stmt->message = string(sqlite3_errmsg(stmt->conn));
+    }
+    if (params.size()) stmt->Unbind();
+    if (stmt->status != SQLITE_DONE) {
+        FreeColumns(columns);
+        return Nan::ThrowError(stmt->message.c_str());
+    }
+    if (opts.format == FORMAT_COLUMNS) {
+        NAN_RETURN(ColumnsToJS(columns, stmt->cols, opts.bigint));
+    } else {
+        if (opts.format == FORMAT_RAW) Nan::Set(result, Nan::New("columns").ToLocalChecked(), builder.Names());
+        NAN_RETURN(result);
+    }
 }
 
-static int sqliteStep(sqlite3_stmt *stmt, int count, int timeout)
+NAN_METHOD(SQLiteStatement::Query)
 {
-    int n = 0, rc;
-    do {
-        rc = sqlite3_step(stmt);
-        if (rc == SQLITE_LOCKED) {
-            rc = sqlite3_reset(stmt);
-            n++;
-            usleep(timeout);
-        } else
-        if (rc == SQLITE_BUSY) {
-            usleep(timeout);
-            n++;
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    if (stmt->each) return Nan::ThrowError("Statement is busy");
+
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+    Baton* baton = new Baton(stmt, callback);
+    if (!ParseParameters(baton->params, info, 0)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 0);
+    stmt->op = "query";
+    stmt->db->Queue(&baton->request, Work_Query, (uv_after_work_cb)Work_AfterQuery, stmt->owner, stmt->ReadSlot());
+    NAN_RETURN(info.Holder());
+}
+
+void SQLiteStatement::Work_Fetch(Baton *baton)
+{
+    SQLiteStatement *stmt = baton->stmt;
+
+    if (BindParameters(baton->params, stmt->_handle)) {
+        int rows = 0;
+        uint64_t start = uv_hrtime();
+        while ((stmt->status = sqliteStep(stmt->_handle, stmt->db->retries, stmt->db->timeout)) == SQLITE_ROW) {
+            if (!rows++) stmt->cols.Check(stmt->_handle);
+            if (baton->opts.format == FORMAT_COLUMNS) {
+                GetColumns(baton->columns, stmt->_handle, stmt->cols);
+                continue;
+            }
+            baton->rows.Add(stmt->_handle, stmt->cols);
         }
-    } while(n < count && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
-    return rc;
+        sqliteStmtCollect(stmt->_handle, start, rows, &stmt->counters);
+        if (stmt->status != SQLITE_DONE) {
+            stmt->message = string(sqlite3_errmsg(stmt->conn));
+        }
+    } else {
+        stmt->message = string(sqlite3_errmsg(stmt->conn));
+    }
+    if (baton->params.size()) stmt->Unbind();
+}
+
+void SQLiteStatement::Work_Query(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    Work_Fetch(baton);
+}
+
+void SQLiteStatement::Work_QueryPrepare(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    if (!baton->stmt->Prepare()) return;
+
+    Work_Fetch(baton);
+    baton->stmt->Finalize();
 }
+
+Local<Value> SQLiteStatement::GetResult(Baton *baton)
+{
+    return GetResult(baton->stmt->db, baton->rows, baton->columns, baton->stmt->cols, baton->opts);
+}
+
+Local<Value> SQLiteStatement::GetResult(SQLiteDatabase *db, SQLiteRows &rows, vector<SQLiteColumnData*> &columns, SQLiteColumns &cols, SQLiteOptions &opts)
+{
+    Nan::EscapableHandleScope scope;
+
+    if (opts.format == FORMAT_COLUMNS) {
+        return scope.Escape(ColumnsToJS(columns, cols, opts.bigint));
+    }
+    if (!rows.size() && opts.format != FORMAT_RAW) {
+        return scope.Escape(Nan::New<Array>());
+    }
+    SQLiteRowBuilder builder(db->GetShape(cols), opts.bigint);
+    Local<Array> result = Nan::New<Array>(rows.size());
+    for (uint i = 0; i < rows.size(); i++) {
+        if (opts.format == FORMAT_RAW) {
+            Nan::Set(result, i, RowToArray(rows, i, builder));
+        } else {
+            Nan::Set(result, i, RowToJS(rows, i, builder));
+        }
+    }
+    rows.Clear();
+    if (opts.format == FORMAT_RAW) Nan::Set(result, Nan::New("columns").ToLocalChecked(), builder.Names());
+    return scope.Escape(result);
+}
+
+void SQLiteStatement::Work_AfterQuery(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+
+    Nan::Set(baton->stmt->handle(), Nan::New("lastID").ToLocalChecked(), IntegerToJS(baton->inserted_id, baton->opts.bigint));
+    Nan::Set(baton->stmt->handle(), Nan::New("changes").ToLocalChecked(), Nan::New(baton->changes));
+
+    if (!baton->callback.IsEmpty()) {
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->stmt->status != SQLITE_DONE) {
+            EXCEPTION(baton->stmt->message.c_str(), baton->stmt->status, exception);
+            Local<Value> argv[] = { exception, Nan::New<Array>() };
+            NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 2, argv);
+        } else {
+            Local<Value> argv[] = { Nan::Null(), GetResult(baton) };
+            NAN_TRY_CATCH_CALL(baton->stmt->handle(), cb, 2, argv);
+        }
+    } else
+    if (baton->stmt->status != SQLITE_DONE) {
+        printf("%s", baton->stmt->message.c_str());
+    }
+    delete baton;
+}
+
+// { [values], [batch], [options], onBatch(rows, next), [onDone(err, total)] }
+NAN_METHOD(SQLiteStatement::Each)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+
+    if (stmt->each) return Nan::ThrowError("Statement is busy");
+    if (!stmt->_handle) return Nan::ThrowError("Statement is not prepared");
+
+    int batch = 100;
+    Local<Function> callback, done;
+    for (int i = 0; i < info.Length(); i++) {
+        if (info[i]->IsNumber()) batch = Nan::To<int32_t>(info[i]).FromJust(); else
+        if (info[i]->IsFunction() && callback.IsEmpty()) callback = Local<Function>::Cast(info[i]); else
+        if (info[i]->IsFunction() && done.IsEmpty()) done = Local<Function>::Cast(info[i]);
+    }
+    if (callback.IsEmpty()) return Nan::ThrowError("Batch callback is required");
+
+    Baton* baton = new Baton(stmt, callback);
+    if (!ParseParameters(baton->params, info, 0)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 0);
+    if (!done.IsEmpty()) baton->done.Reset(done);
+    baton->batch = batch > 0 ? batch : 100;
+    baton->running = true;
+    stmt->op = "each";
+    stmt->each = baton;
+    stmt->db->Queue(&baton->request, Work_Each, (uv_after_work_cb)Work_AfterEach, stmt->owner, stmt->ReadSlot());
+    NAN_RETURN(info.Holder());
+}
+
+// Continue with the next batch or stop if called with true
+NAN_METHOD(SQLiteStatement::EachNext)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (Nan::To<Object>(info.Data()).ToLocalChecked());
+    Baton *baton = stmt->each;
+
+    if (!baton || baton->running || baton->eof) return;
+    if (info.Length() > 0 && Nan::To<bool>(info[0]).FromJust()) return EachDone(baton);
+
+    baton->running = true;
+    stmt->db->Queue(&baton->request, Work_Each, (uv_after_work_cb)Work_AfterEach, stmt->owner, stmt->ReadSlot());
+}
+
+void SQLiteStatement::EachDone(Baton *baton)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement *stmt = baton->stmt;
+
+    stmt->each = NULL;
+    stmt->Unbind();
+    if (!baton->done.IsEmpty()) {
+        Local<Function> cb = Nan::New(baton->done);
+        Local<Value> argv[2];
+        if (stmt->status != SQLITE_DONE && stmt->status != SQLITE_ROW) {
+            EXCEPTION(stmt->message.c_str(), stmt->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
+        argv[1] = Nan::New(baton->total);
+        NAN_TRY_CATCH_CALL(stmt->handle(), cb, 2, argv);
+    } else
+    if (stmt->status != SQLITE_DONE && stmt->status != SQLITE_ROW) {
+        printf("%s", stmt->message.c_str());
+    }
+    delete baton;
+}
+
+// Step up to the batch size and keep the statement positioned for the next call
+void SQLiteStatement::Work_Each(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteStatement *stmt = baton->stmt;
+
+    if (!baton->started) {
+        baton->started = true;
+        if (!BindParameters(baton->params, stmt->_handle)) {
+            stmt->status = sqlite3_errcode(stmt->conn);
+            if (stmt->status == SQLITE_OK) stmt->status = SQLITE_ERROR;
+            stmt->message = string(sqlite3_errmsg(stmt->conn));
+            baton->eof = true;
+            if (baton->params.size()) stmt->Unbind();
+            return;
+        }
+    }
+
+    int n = 0;
+    uint64_t start = uv_hrtime();
+    while (n < baton->batch && (stmt->status = sqliteStep(stmt->_handle, stmt->db->retries, stmt->db->timeout)) == SQLITE_ROW) {
+        if (!baton->total && !n) stmt->cols.Check(stmt->_handle);
+        if (baton->opts.format == FORMAT_COLUMNS) {
+            GetColumns(baton->columns, stmt->_handle, stmt->cols);
+        } else {
+            baton->rows.Add(stmt->_handle, stmt->cols);
+        }
+        n++;
+    }
+    // A cursor is one execution, the time of all its batches is counted when it ends
+    baton->elapsed += uv_hrtime() - start;
+    if (stmt->status != SQLITE_ROW) {
+        sqliteStmtCollect(stmt->_handle, uv_hrtime() - baton->elapsed, baton->total + n, &stmt->counters);
+        baton->eof = true;
+        if (stmt->status != SQLITE_DONE) {
+            stmt->message = string(sqlite3_errmsg(stmt->conn));
+        }
+        if (baton->params.size()) stmt->Unbind();
+    }
+    baton->total += n;
+}
+
+void SQLiteStatement::Work_AfterEach(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteStatement *stmt = baton->stmt;
+    Local<Object> handle = stmt->handle();
+
+    baton->running = false;
+    if (stmt->status != SQLITE_DONE && stmt->status != SQLITE_ROW) {
+        return EachDone(baton);
+    }
+    if (baton->rows.size() || baton->columns.size()) {
+        Local<Function> cb = Nan::New(baton->callback);
+        Local<Value> argv[] = { GetResult(baton), Nan::New<Function>(EachNext, handle) };
+        NAN_TRY_CATCH_CALL(handle, cb, 2, argv);
+    }
+    // The callback may have stopped the cursor already or queued the next batch which owns the baton now
+    if (stmt->each == baton && !baton->running && baton->eof) EachDone(baton);
+}
+
+Local<Object> SQLiteStatement::Cursor(SQLiteDatabase *db, string sql, const Nan::FunctionCallbackInfo<v8::Value>& info, int idx)
+{
+    Nan::EscapableHandleScope scope;
+
+    Local<Object> obj = Create(db, sql, true, true);
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (obj);
+    Baton* baton = new Baton(stmt, Local<Function>());
+    if (!ParseParameters(baton->params, info, idx)) {
+        delete baton;
+        return Local<Object>();
+    }
+    ParseOptions(baton->opts, info, idx);
+    if (baton->opts.format == FORMAT_COLUMNS) baton->opts.format = FORMAT_OBJECTS;
+    baton->batch = baton->opts.batch > 0 ? baton->opts.batch : 100;
+    stmt->op = "iterate";
+    stmt->each = baton;
+    // Referenced only while fetching so an abandoned cursor can be collected
+    stmt->Unref();
+    return scope.Escape(obj);
+}
+
+NAN_METHOD(SQLiteStatement::CursorSelf)
+{
+    NAN_RETURN(info.This());
+}
+
+// { value: row, done: false } from the current batch or { done: true } at the end
+Local<Object> SQLiteStatement::CursorResult(Baton *baton)
+{
+    Nan::EscapableHandleScope scope;
+
+    Local<Object> result = Nan::New<Object>();
+    Local<Array> buffer = baton && !baton->buffer.IsEmpty() ? Nan::New(baton->buffer) : Nan::New<Array>();
+    if (baton && baton->pos < buffer->Length()) {
+        Nan::Set(result, Nan::New("value").ToLocalChecked(), Nan::Get(buffer, baton->pos++).ToLocalChecked());
+        Nan::Set(result, Nan::New("done").ToLocalChecked(), Nan::False());
+    } else {
+        Nan::Set(result, Nan::New("value").ToLocalChecked(), Nan::Undefined());
+        Nan::Set(result, Nan::New("done").ToLocalChecked(), Nan::True());
+    }
+    return scope.Escape(result);
+}
+
+// Release the statement and the connection it holds
+void SQLiteStatement::CursorDone(Baton *baton)
+{
+    SQLiteStatement *stmt = baton->stmt;
+    stmt->each = NULL;
+    stmt->Finalize();
+    baton->stmt = NULL;
+    delete baton;
+    // Reads waiting for the reader can start now
+    stmt->db->Dispatch();
+}
+
+NAN_METHOD(SQLiteStatement::CursorNext)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    Baton *baton = stmt->each;
+    Local<Context> context = Nan::GetCurrentContext();
+    Local<Promise::Resolver> resolver = Promise::Resolver::New(context).ToLocalChecked();
+
+    if (baton && baton->running) {
+        resolver->Reject(context, Exception::Error(Nan::New("Cursor is busy").ToLocalChecked())).FromJust();
+    } else
+    if (!baton || (baton->eof && (baton->buffer.IsEmpty() || baton->pos >= Nan::New(baton->buffer)->Length()))) {
+        if (baton) CursorDone(baton);
+        resolver->Resolve(context, CursorResult(NULL)).FromJust();
+    } else
+    if (!baton->buffer.IsEmpty() && baton->pos < Nan::New(baton->buffer)->Length()) {
+        resolver->Resolve(context, CursorResult(baton)).FromJust();
+    } else {
+        baton->buffer.Reset();
+        baton->resolver.Reset(resolver);
+        baton->running = true;
+        stmt->Ref();
+        stmt->db->Queue(&baton->request, Work_Cursor, (uv_after_work_cb)Work_AfterCursor, stmt->owner, stmt->ReadSlot());
+    }
+    NAN_RETURN(resolver->GetPromise());
+}
+
+// Early exit from for await or stream destroy
+NAN_METHOD(SQLiteStatement::CursorReturn)
+{
+    Nan::HandleScope scope;
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (info.Holder());
+    Baton *baton = stmt->each;
+    Local<Context> context = Nan::GetCurrentContext();
+    Local<Promise::Resolver> resolver = Promise::Resolver::New(context).ToLocalChecked();
+
+    if (baton && baton->running) {
+        baton->stop = true;
+    } else
+    if (baton) {
+        CursorDone(baton);
+    }
+    resolver->Resolve(context, CursorResult(NULL)).FromJust();
+    NAN_RETURN(resolver->GetPromise());
+}
+
+void SQLiteStatement::Work_Cursor(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteStatement *stmt = baton->stmt;
+
+    if (!baton->started && !stmt->_handle && !stmt->Prepare()) {
+        baton->started = baton->eof = true;
+        return;
+    }
+    Work_Each(req);
+    // Release the connection as soon as all rows are read
+    if (baton->eof) stmt->Finalize();
+}
+
+void SQLiteStatement::Work_AfterCursor(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteStatement *stmt = baton->stmt;
+    Local<Context> context = Nan::GetCurrentContext();
+    Local<Promise::Resolver> resolver = Nan::New(baton->resolver);
+    node::CallbackScope callback_scope(Isolate::GetCurrent(), stmt->handle(), node::async_context { 0, 0 });
+
+    baton->running = false;
+    baton->resolver.Reset();
+    stmt->Unref();
+    if (stmt->status != SQLITE_DONE && stmt->status != SQLITE_ROW) {
+        EXCEPTION(stmt->message.c_str(), stmt->status, exception);
+        CursorDone(baton);
+        resolver->Reject(context, exception).FromJust();
+        return;
+    }
+    if (baton->stop || !baton->rows.size()) {
+        CursorDone(baton);
+        resolver->Resolve(context, CursorResult(NULL)).FromJust();
+        return;
+    }
+    baton->buffer.Reset(GetResult(baton).As<Array>());
+    baton->pos = 0;
+    resolver->Resolve(context, CursorResult(baton)).FromJust();
+}
+
+Local<Object> SQLiteTransaction::Create(SQLiteDatabase *db, SQLiteTransaction *parent, string mode)
+{
+    Nan::EscapableHandleScope scope;
+    Local<Object> obj = Nan::NewInstance(Nan::New(_txn)).ToLocalChecked();
+    SQLiteTransaction *txn = new SQLiteTransaction(db, parent);
+    txn->Wrap(obj);
+    txn->mode = mode;
+    Baton *baton = new Baton(txn, Local<Function>(), TXN_BEGIN);
+    if (parent) {
+        txn->name = "txn" + to_string(++txn->root->savepoints);
+        db->Queue(&baton->request, Work_Control, (uv_after_work_cb)Work_AfterControl, txn->root);
+    } else {
+        // Keeps the connection until the end
+        txn->Ref();
+        if (db->group.size()) db->FlushGroup();
+        txn->seq = ++db->seq;
+        db->txns.push_back(txn);
+        db->Queue(&baton->request, Work_Control, (uv_after_work_cb)Work_AfterControl, txn);
+    }
+    return scope.Escape(obj);
+}
+
+NAN_METHOD(SQLiteTransaction::Run)
+{
+    Nan::HandleScope scope;
+    SQLiteTransaction* txn = ObjectWrap::Unwrap < SQLiteTransaction > (info.Holder());
+    if (txn->finished || txn->root->finished) return Nan::ThrowError("Transaction is finished");
+
+    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    Local<Object> obj = SQLiteStatement::Create(txn->db, *sql, true);
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (obj);
+    stmt->owner = txn->root;
+    SQLiteStatement::Baton* baton = new SQLiteStatement::Baton(stmt, callback);
+    if (!ParseParameters(baton->params, info, 1)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 1);
+    txn->db->Queue(&baton->request, SQLiteStatement::Work_RunPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterRun, txn->root);
+
+    NAN_RETURN(info.Holder());
+}
+
+NAN_METHOD(SQLiteTransaction::Query)
+{
+    Nan::HandleScope scope;
+    SQLiteTransaction* txn = ObjectWrap::Unwrap < SQLiteTransaction > (info.Holder());
+    if (txn->finished || txn->root->finished) return Nan::ThrowError("Transaction is finished");
+
+    NAN_REQUIRE_ARGUMENT_STRING(0, sql);
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    Local<Object> obj = SQLiteStatement::Create(txn->db, *sql, true);
+    SQLiteStatement* stmt = ObjectWrap::Unwrap < SQLiteStatement > (obj);
+    stmt->owner = txn->root;
+    SQLiteStatement::Baton* baton = new SQLiteStatement::Baton(stmt, callback);
+    if (!ParseParameters(baton->params, info, 1)) {
+        delete baton;
+        return;
+    }
+    ParseOptions(baton->opts, info, 1);
+    txn->db->Queue(&baton->request, SQLiteStatement::Work_QueryPrepare, (uv_after_work_cb)SQLiteStatement::Work_AfterQuery, txn->root);
+
+    NAN_RETURN(info.Holder());
+}
+
+// Nested transaction as a savepoint
+NAN_METHOD(SQLiteTransaction::Transaction)
+{
+    Nan::HandleScope scope;
+    SQLiteTransaction* txn = ObjectWrap::Unwrap < SQLiteTransaction > (info.Holder());
+    if (txn->finished || txn->root->finished) return Nan::ThrowError("Transaction is finished");
+
+    NAN_RETURN(Create(txn->db, txn, string()));
+}
+
+NAN_METHOD(SQLiteTransaction::Commit)
+{
+    End(info, TXN_COMMIT);
+}
+
+NAN_METHOD(SQLiteTransaction::Rollback)
+{
+    End(info, TXN_ROLLBACK);
+}
+
+void SQLiteTransaction::End(const Nan::FunctionCallbackInfo<v8::Value>& info, int op)
+{
+    Nan::HandleScope scope;
+    SQLiteTransaction* txn = ObjectWrap::Unwrap < SQLiteTransaction > (info.Holder());
+    if (txn->finished || txn->root->finished) return Nan::ThrowError("Transaction is finished");
+
+    NAN_OPTIONAL_ARGUMENT_FUNCTION(-1, callback);
+
+    txn->finished = true;
+    Baton *baton = new Baton(txn, callback, op);
+    txn->db->Queue(&baton->request, Work_Control, (uv_after_work_cb)Work_AfterControl, txn->root);
+    NAN_RETURN(info.Holder());
+}
+
+void SQLiteTransaction::Work_Control(uv_work_t* req)
+{
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteTransaction *txn = baton->txn;
+    sqlite3 *handle = txn->db->_handle;
+
+    // Nothing to end if BEGIN failed
+    if (txn->root->status != SQLITE_OK || txn->status != SQLITE_OK) {
+        if (baton->op == TXN_COMMIT) {
+            baton->status = txn->status != SQLITE_OK ? txn->status : txn->root->status;
+            baton->message = txn->status != SQLITE_OK ? txn->message : txn->root->message;
+        }
+        return;
+    }
+
+    string sql;
+    switch (baton->op) {
+    case TXN_BEGIN:
+        sql = txn->name.size() ? "SAVEPOINT " + txn->name : "BEGIN " + txn->mode;
+        break;
+    case TXN_COMMIT:
+        sql = txn->name.size() ? "RELEASE " + txn->name : "COMMIT";
+        break;
+    case TXN_ROLLBACK:
+        sql = txn->name.size() ? "ROLLBACK TO " + txn->name + "; RELEASE " + txn->name : "ROLLBACK";
+        break;
+    }
+    char* message = NULL;
+    baton->status = sqlite3_exec(handle, sql.c_str(), NULL, NULL, &message);
+    if (baton->status != SQLITE_OK) {
+        baton->message = message ? message : sqlite3_errmsg(handle);
+        sqlite3_free(message);
+    }
+    baton->open = !sqlite3_get_autocommit(handle);
+}
+
+void SQLiteTransaction::Work_AfterControl(uv_work_t* req)
+{
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    SQLiteTransaction *txn = baton->txn;
+
+    switch (baton->op) {
+    case TXN_BEGIN:
+        if (baton->status != SQLITE_OK) {
+            txn->status = baton->status;
+            txn->message = baton->message;
+        }
+        break;
+
+    case TXN_COMMIT:
+        // A busy COMMIT keeps the transaction open, it can be retried or rolled back
+        if (baton->status == SQLITE_OK || !baton->open || txn != txn->root) {
+            txn->ended = true;
+        } else {
+            txn->finished = false;
+        }
+        break;
+
+    case TXN_ROLLBACK:
+        txn->ended = true;
+        break;
+    }
+
+    if (!baton->callback.IsEmpty()) {
+        Local < Value > argv[1];
+        Local<Function> cb = Nan::New(baton->callback);
+        if (baton->status != SQLITE_OK) {
+            EXCEPTION(baton->message.c_str(), baton->status, exception);
+            argv[0] = exception;
+        } else {
+            argv[0] = Nan::Null();
+        }
+        NAN_TRY_CATCH_CALL(txn->handle(), cb, 1, argv);
+    } else
+    if (baton->status != SQLITE_OK && baton->op != TXN_BEGIN) {
+        printf("%s", baton->message.c_str());
+    }
+    delete baton;
+}
+
+#ifdef _MSC_VER
+static void usleep(int waitTime)
+{
+    __int64 time1 = 0, time2 = 0, freq = 0;
+
+    QueryPerformanceCounter((LARGE_INTEGER *) &time1);
+    QueryPerformanceFrequency((LARGE_INTEGER *)&freq);
+    do { QueryPerformanceCounter((LARGE_INTEGER *) &time2); } while((time2-time1) < waitTime);
+}
+#endif
+
+static int busy(void *ptr, int code)
+{
+    return 1;
+}
+
+static void setTimeout(sqlite3 *handle, int timeout)
+{
+    if (timeout >= 0) {
+        sqlite3_busy_timeout(handle, timeout);
+    } else {
+        sqlite3_busy_handler(handle, busy, NULL);
+    }
+}
+
+// Set or reset busy timeout or handler, -1 set indefinite busy handler otherwise timeout is set
+static void sqliteTimeout(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    setTimeout(sqlite3_context_db_handle(ctx), argc > 0 ? sqlite3_value_int(argv[0]) : -1);
+}
+
+// Implementation of string concatenation function
+struct ConcatCtx {
+    int len;
+    int count;
+    char *data;
+    char *close;
+};
+
+static void sqliteConcat(ConcatCtx *p, const char *data, int len)
+{
+    if (data) {
+        p->data = (char*)realloc(p->data, p->len + len + 1);
+        p->data[p->len] = 0;
+        strncat(p->data, data, len);
+        p->len += len;
+    }
+
+}
+static void sqliteConcatStep(sqlite3_context* ctx, int argc, sqlite3_value**argv)
+{
+    ConcatCtx *p = (ConcatCtx *) sqlite3_aggregate_context(ctx, sizeof(*p));
+    const char *txt = (const char*)sqlite3_value_text(argv[0]);
+    const char *sep = (const char*)sqlite3_value_text(argv[1]);
+    if (!txt) return;
+    if (argc > 3) {
+        const char *open = (const char*)sqlite3_value_text(argv[2]);
+        const char *close = (const char*)sqlite3_value_text(argv[3]);
+        if (!p->close && close) p->close = strdup(close);
+        if (!p->data && open) sqliteConcat(p, open, strlen(open));
+    }
+    if (p->count && sep) sqliteConcat(p, sep, strlen(sep));
+    sqliteConcat(p, txt, strlen(txt));
+    p->count++;
+}
+
+static void sqliteConcatFinal(sqlite3_context* ctx)
+{
+    ConcatCtx *p = (ConcatCtx *) sqlite3_aggregate_context(ctx, 0);
+    if (p && p->data) {
+        if (p->close) {
+            sqliteConcat(p, p->close, strlen(p->close));
+            free(p->close);
+        }
+        sqlite3_result_text(ctx, p->data, p->len, free);
+    } else {
+        sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
+    }
+}
+
+static bool sqliteInitDb(sqlite3 *handle, SQLiteTuning *tuning, bool reader)
+{
+    if (!handle) return false;
+    sqlite3_create_function(handle, "concat", -1, SQLITE_UTF8, 0, NULL, sqliteConcatStep, sqliteConcatFinal);
+    sqlite3_create_function(handle, "busy_timeout", 1, SQLITE_UTF8, 0, sqliteTimeout, 0, 0);
+
+    if (!tuning) return true;
+    if (tuning->busy_timeout >= 0) sqlite3_busy_timeout(handle, tuning->busy_timeout);
+    // The page size must be set before WAL mode
+    if (!reader && tuning->writer.size() && sqlite3_exec(handle, tuning->writer.c_str(), NULL, NULL, NULL) != SQLITE_OK) return false;
+    if (tuning->pragmas.size() && sqlite3_exec(handle, tuning->pragmas.c_str(), NULL, NULL, NULL) != SQLITE_OK) return false;
+    return true;
+}
+
+static int sqlitePrepare(sqlite3 *db, sqlite3_stmt **stmt, string sql, int count, int timeout, int flags)
+{
+    int n = 0, rc;
+    do {
+        rc = sqlite3_prepare_v3(db, sql.c_str(), -1, flags, stmt, 0);
+        if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+            n++;
+            usleep(timeout);
+        }
+    } while (n < count && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
+    return rc;
+}
+
+static int sqliteStep(sqlite3_stmt *stmt, int count, int timeout)
+{
+    int n = 0, rc;
+    do {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_LOCKED) {
+            rc = sqlite3_reset(stmt);
+            n++;
+            usleep(timeout);
+        } else
+        if (rc == SQLITE_BUSY) {
+            usleep(timeout);
+            n++;
+        }
+    } while(n < count && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
+    return rc;
+}
+
+// Transaction control and connection state statements, they must run on the main connection
+static bool sqliteIsWriter(const string &sql)
+{
+    static const char *keywords[] = { "BEGIN", "COMMIT", "END", "ROLLBACK", "SAVEPOINT", "RELEASE", "PRAGMA", "ATTACH", "DETACH", NULL };
+    const char *p = sql.c_str();
+    while (*p && isspace(*p)) p++;
+    for (int i = 0; keywords[i]; i++) {
+        int len = strlen(keywords[i]);
+        if (!strncasecmp(p, keywords[i], len) && !isalnum(p[len])) return true;
+    }
+    return false;
+}
+
+// Counters by the normalized SQL so executions with different literals add up, they are kept after the statements are finalized.
+// Without SQLITE_ENABLE_NORMALIZE the original SQL text is used. Each thread collects into its own map under its own lock,
+// so executions on different threads do not wait for each other, stats() moves them into the shared map
+#define STMT_QUERIES_MAX 5000
+
+struct SQLiteQueriesCache {
+    SQLiteQueriesCache(): prev(NULL), next(NULL), registered(false), dead(false) { uv_mutex_init(&mutex); }
+    ~SQLiteQueriesCache();
+
+    uv_mutex_t mutex;
+    map<string,SQLiteStmtStats> items;
+    SQLiteQueriesCache *prev;
+    SQLiteQueriesCache *next;
+    bool registered;
+    bool dead;
+};
+
+static struct SQLiteQueries {
+    SQLiteQueries(): caches(NULL) { uv_mutex_init(&mutex); }
+    // Thread caches and everything moved from them
+    uv_mutex_t mutex;
+    SQLiteQueriesCache *caches;
+    map<string,SQLiteStmtStats> items;
+} _queries;
+
+static thread_local SQLiteQueriesCache _queries_cache;
+
+// Too many distinct statements, the rest are counted together under an empty SQL
+static void sqliteQueriesAdd(map<string,SQLiteStmtStats> &items, const string &key, const SQLiteStmtStats &stats)
+{
+    map<string,SQLiteStmtStats>::iterator it = items.find(key);
+    if (it == items.end()) it = items.insert(pair<string,SQLiteStmtStats>(items.size() >= STMT_QUERIES_MAX ? "" : key, SQLiteStmtStats())).first;
+    it->second.Add(stats);
+}
+
+// Called with the shared lock held
+static void sqliteQueriesMerge(SQLiteQueriesCache *cache)
+{
+    map<string,SQLiteStmtStats> items;
+    uv_mutex_lock(&cache->mutex);
+    items.swap(cache->items);
+    uv_mutex_unlock(&cache->mutex);
+    for (map<string,SQLiteStmtStats>::iterator it = items.begin(); it != items.end(); it++) sqliteQueriesAdd(_queries.items, it->first, it->second);
+}
+
+// Keep the counters of the thread
+SQLiteQueriesCache::~SQLiteQueriesCache()
+{
+    dead = true;
+    if (!registered) return;
+    uv_mutex_lock(&_queries.mutex);
+    if (prev) prev->next = next; else _queries.caches = next;
+    if (next) next->prev = prev;
+    sqliteQueriesMerge(this);
+    uv_mutex_unlock(&_queries.mutex);
+}
+
+static SQLiteQueriesCache *sqliteQueriesCache()
+{
+    SQLiteQueriesCache *cache = &_queries_cache;
+    if (cache->dead) return NULL;
+    if (!cache->registered) {
+        uv_mutex_lock(&_queries.mutex);
+        cache->next = _queries.caches;
+        if (cache->next) cache->next->prev = cache;
+        _queries.caches = cache;
+        cache->registered = true;
+        uv_mutex_unlock(&_queries.mutex);
+    }
+    return cache;
+}
+
+// Take the counters of one execution from the statement and reset them for the next one, for batches of several
+// executions the max time is the average of the batch
+static void sqliteStmtCollect(sqlite3_stmt *stmt, uint64_t start, int rows, SQLiteStmtCounters *own, int count)
+{
+    if (!stmt) return;
+    SQLiteStmtStats stats;
+    stats.count = count;
+    stats.time = (uv_hrtime() - start) / 1e6;
+    stats.max_time = stats.time / count;
+    stats.rows = rows;
+    stats.fullscan = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    stats.sort = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+    stats.autoindex = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    stats.vmstep = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    stats.reprepare = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 1);
+    stats.run = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_RUN, 1);
+    stats.memused = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+    if (own) own->Add(stats);
+
+#ifdef SQLITE_ENABLE_NORMALIZE
+    const char *sql = sqlite3_normalized_sql(stmt);
+#else
+    const char *sql = sqlite3_sql(stmt);
+#endif
+    string key = sql ? sql : "";
+    SQLiteQueriesCache *cache = sqliteQueriesCache();
+    if (cache) {
+        uv_mutex_lock(&cache->mutex);
+        sqliteQueriesAdd(cache->items, key, stats);
+        uv_mutex_unlock(&cache->mutex);
+    } else {
+        uv_mutex_lock(&_queries.mutex);
+        sqliteQueriesAdd(_queries.items, key, stats);
+        uv_mutex_unlock(&_queries.mutex);
+    }
+}
+
+// Sorted by the total time, the most expensive first
+static bool sqliteStmtCompare(const pair<string,SQLiteStmtStats> &a, const pair<string,SQLiteStmtStats> &b)
+{
+    return a.second.time > b.second.time;
+}
+
+static Local<Array> sqliteStmtQueries()
+{
+    Nan::EscapableHandleScope scope;
+    uv_mutex_lock(&_queries.mutex);
+    for (SQLiteQueriesCache *cache = _queries.caches; cache; cache = cache->next) sqliteQueriesMerge(cache);
+    vector<pair<string,SQLiteStmtStats> > items(_queries.items.begin(), _queries.items.end());
+    uv_mutex_unlock(&_queries.mutex);
+    sort(items.begin(), items.end(), sqliteStmtCompare);
+
+    Local<Array> list = Nan::New<Array>();
+    for (uint i = 0; i < items.size(); i++) {
+        Local<Object> obj = Nan::New<Object>();
+        Nan::Set(obj, Nan::New("sql").ToLocalChecked(), Nan::New(items[i].first).ToLocalChecked());
+        items[i].second.Set(obj);
+        Nan::Set(list, i, obj);
+    }
+    return scope.Escape(list);
+}
+
+// Arena allocator for SQLite: small blocks come from size classes, each thread keeps its own free lists and exchanges
+// blocks with the shared lists in batches, so most calls take no lock. Blocks carved from arena chunks are kept for
+// reuse and never returned to the system, large blocks go directly to malloc. Each thread counts its own bytes and calls,
+// stats() sums them up, the peak is tracked by flushing the thread deltas in 64KB steps.
+
+#define MEM_CLASSES 72
+#define MEM_SMALL 32768
+#define MEM_LARGE 0xFFFF
+#define MEM_CHUNK (64 * 1024)
+#define MEM_FLUSH (64 * 1024)
+
+// Block header, the class index and the usable size
+struct SQLiteMemHeader {
+    unsigned cls;
+    unsigned size;
+};
+
+struct SQLiteMemClass {
+    unsigned size;
+    unsigned limit;
+    uv_mutex_t mutex;
+    void *free;
+    unsigned count;
+};
+
+struct SQLiteMemCache {
+    SQLiteMemCache(): allocated(0), freed(0), allocs(0), delta(0), prev(NULL), next(NULL), registered(false), dead(false) {
+        memset(free, 0, sizeof(free));
+        memset(count, 0, sizeof(count));
+    }
+    ~SQLiteMemCache();
+
+    void *free[MEM_CLASSES];
+    unsigned count[MEM_CLASSES];
+    // Written by the owner thread only
+    sqlite3_int64 allocated;
+    sqlite3_int64 freed;
+    sqlite3_int64 allocs;
+    sqlite3_int64 delta;
+    SQLiteMemCache *prev;
+    SQLiteMemCache *next;
+    bool registered;
+    bool dead;
+};
+
+static struct {
+    bool arena;
+    bool ready;
+    sqlite3_mem_methods system;
+    SQLiteMemClass classes[MEM_CLASSES];
+    unsigned char index[MEM_SMALL / 16 + 1];
+    // Thread caches and the counters of the threads that exited
+    uv_mutex_t mutex;
+    SQLiteMemCache *caches;
+    sqlite3_int64 allocated;
+    sqlite3_int64 freed;
+    sqlite3_int64 allocs;
+    sqlite3_int64 current;
+    sqlite3_int64 peak;
+    sqlite3_int64 chunks;
+    // Rate between stats() calls, used in the main thread only
+    sqlite3_int64 last_allocs;
+    uint64_t last_time;
+} _mem;
+
+static thread_local SQLiteMemCache _mem_cache;
+
+static void sqliteMemPush(SQLiteMemClass *cls, void *head, void *tail, unsigned count)
+{
+    uv_mutex_lock(&cls->mutex);
+    *(void**)tail = cls->free;
+    cls->free = head;
+    cls->count += count;
+    uv_mutex_unlock(&cls->mutex);
+}
+
+// Return blocks to the shared lists and keep the counters of the thread
+SQLiteMemCache::~SQLiteMemCache()
+{
+    dead = true;
+    for (int i = 0; i < MEM_CLASSES; i++) {
+        if (!free[i]) continue;
+        void *tail = free[i];
+        while (*(void**)tail) tail = *(void**)tail;
+        sqliteMemPush(&_mem.classes[i], free[i], tail, count[i]);
+        free[i] = NULL;
+        count[i] = 0;
+    }
+    if (!registered) return;
+    uv_mutex_lock(&_mem.mutex);
+    if (prev) prev->next = next; else _mem.caches = next;
+    if (next) next->prev = prev;
+    __atomic_add_fetch(&_mem.allocated, allocated, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_mem.freed, freed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_mem.allocs, allocs, __ATOMIC_RELAXED);
+    uv_mutex_unlock(&_mem.mutex);
+}
+
+static void sqliteMemFlush(SQLiteMemCache *cache)
+{
+    sqlite3_int64 current = __atomic_add_fetch(&_mem.current, cache->delta, __ATOMIC_RELAXED);
+    cache->delta = 0;
+    sqlite3_int64 peak = __atomic_load_n(&_mem.peak, __ATOMIC_RELAXED);
+    while (current > peak && !__atomic_compare_exchange_n(&_mem.peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static SQLiteMemCache *sqliteMemCache()
+{
+    SQLiteMemCache *cache = &_mem_cache;
+    if (cache->dead) return NULL;
+    if (!cache->registered) {
+        uv_mutex_lock(&_mem.mutex);
+        cache->next = _mem.caches;
+        if (cache->next) cache->next->prev = cache;
+        _mem.caches = cache;
+        cache->registered = true;
+        uv_mutex_unlock(&_mem.mutex);
+    }
+    return cache;
+}
+
+static void sqliteMemCount(SQLiteMemCache *cache, sqlite3_int64 size)
+{
+    if (!cache) {
+        __atomic_add_fetch(size > 0 ? &_mem.allocated : &_mem.freed, size > 0 ? size : -size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_mem.current, size, __ATOMIC_RELAXED);
+        return;
+    }
+    if (size > 0) {
+        __atomic_store_n(&cache->allocated, cache->allocated + size, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&cache->freed, cache->freed - size, __ATOMIC_RELAXED);
+    }
+    cache->delta += size;
+    if (cache->delta > MEM_FLUSH || cache->delta < -MEM_FLUSH) sqliteMemFlush(cache);
+}
+
+// Carve a new chunk into the shared list, called with the class mutex locked
+static void sqliteMemCarve(int c)
+{
+    SQLiteMemClass *cls = &_mem.classes[c];
+    unsigned block = sizeof(SQLiteMemHeader) + cls->size;
+    unsigned size = max((unsigned)MEM_CHUNK, block * 8);
+    char *chunk = (char*)_mem.system.xMalloc(size);
+    if (!chunk) return;
+    for (unsigned off = 0; off + block <= size; off += block) {
+        SQLiteMemHeader *hdr = (SQLiteMemHeader*)(chunk + off);
+        hdr->cls = c;
+        hdr->size = cls->size;
+        *(void**)&hdr[1] = cls->free;
+        cls->free = &hdr[1];
+        cls->count++;
+    }
+    __atomic_add_fetch(&_mem.chunks, size, __ATOMIC_RELAXED);
+}
+
+// Take a batch from the shared list
+static void sqliteMemRefill(SQLiteMemCache *cache, int c)
+{
+    SQLiteMemClass *cls = &_mem.classes[c];
+    uv_mutex_lock(&cls->mutex);
+    if (!cls->free) sqliteMemCarve(c);
+    for (unsigned n = 0; cls->free && n < cls->limit / 2 + 1; n++) {
+        void *ptr = cls->free;
+        cls->free = *(void**)ptr;
+        cls->count--;
+        *(void**)ptr = cache->free[c];
+        cache->free[c] = ptr;
+        cache->count[c]++;
+    }
+    uv_mutex_unlock(&cls->mutex);
+}
+
+static void *sqliteMemMalloc(int size)
+{
+    if (size <= 0) return NULL;
+    if (size > MEM_SMALL) {
+        SQLiteMemHeader *hdr = (SQLiteMemHeader*)_mem.system.xMalloc(sizeof(SQLiteMemHeader) + size);
+        if (!hdr) return NULL;
+        hdr->cls = MEM_LARGE;
+        hdr->size = size;
+        sqliteMemCount(sqliteMemCache(), size);
+        return &hdr[1];
+    }
+    int c = _mem.index[(size + 15) >> 4];
+    SQLiteMemCache *cache = sqliteMemCache();
+    void *ptr = NULL;
+    if (cache) {
+        if (!cache->free[c]) sqliteMemRefill(cache, c);
+        ptr = cache->free[c];
+        if (ptr) {
+            cache->free[c] = *(void**)ptr;
+            cache->count[c]--;
+        }
+    } else {
+        SQLiteMemClass *cls = &_mem.classes[c];
+        uv_mutex_lock(&cls->mutex);
+        if (!cls->free) sqliteMemCarve(c);
+        ptr = cls->free;
+        if (ptr) {
+            cls->free = *(void**)ptr;
+            cls->count--;
+        }
+        uv_mutex_unlock(&cls->mutex);
+    }
+    if (ptr) sqliteMemCount(cache, _mem.classes[c].size);
+    return ptr;
+}
+
+static void sqliteMemFree(void *ptr)
+{
+    if (!ptr) return;
+    SQLiteMemHeader *hdr = (SQLiteMemHeader*)ptr - 1;
+    SQLiteMemCache *cache = sqliteMemCache();
+    sqliteMemCount(cache, -(sqlite3_int64)hdr->size);
+    if (hdr->cls == MEM_LARGE) return _mem.system.xFree(hdr);
+
+    SQLiteMemClass *cls = &_mem.classes[hdr->cls];
+    if (!cache) {
+        *(void**)ptr = NULL;
+        return sqliteMemPush(cls, ptr, ptr, 1);
+    }
+    int c = hdr->cls;
+    *(void**)ptr = cache->free[c];
+    cache->free[c] = ptr;
+    // Too many free blocks in the thread, give a batch back
+    if (++cache->count[c] > cls->limit) {
+        void *head = cache->free[c], *tail = head;
+        unsigned n = cls->limit / 2;
+        for (unsigned i = 1; i < n; i++) tail = *(void**)tail;
+        cache->free[c] = *(void**)tail;
+        cache->count[c] -= n;
+        sqliteMemPush(cls, head, tail, n);
+    }
+}
+
+static int sqliteMemSize(void *ptr)
+{
+    return ptr ? ((SQLiteMemHeader*)ptr - 1)->size : 0;
+}
+
+// Large blocks are resized by malloc, small blocks stay in place within the same size class
+static void *sqliteMemRealloc(void *ptr, int size)
+{
+    SQLiteMemHeader *hdr = (SQLiteMemHeader*)ptr - 1;
+    if (hdr->cls == MEM_LARGE && size > MEM_SMALL) {
+        unsigned old = hdr->size;
+        hdr = (SQLiteMemHeader*)_mem.system.xRealloc(hdr, sizeof(SQLiteMemHeader) + size);
+        if (!hdr) return NULL;
+        hdr->size = size;
+        sqliteMemCount(sqliteMemCache(), (sqlite3_int64)size - old);
+        return &hdr[1];
+    }
+    if (hdr->cls != MEM_LARGE && size <= MEM_SMALL && _mem.index[(size + 15) >> 4] == hdr->cls) return ptr;
+    void *ptr2 = sqliteMemMalloc(size);
+    if (!ptr2) return NULL;
+    memcpy(ptr2, ptr, min((int)hdr->size, size));
+    sqliteMemFree(ptr);
+    return ptr2;
+}
+
+static int sqliteMemRoundup(int size)
+{
+    return size > 0 && size <= MEM_SMALL ? _mem.classes[_mem.index[(size + 15) >> 4]].size : (size + 7) & ~7;
+}
+
+static int sqliteMemInitMethod(void *arg)
+{
+    return SQLITE_OK;
+}
+
+static void sqliteMemShutdown(void *arg)
+{
+}
+
+static sqlite3_mem_methods _mem_methods = {
+    sqliteMemMalloc,
+    sqliteMemFree,
+    sqliteMemRealloc,
+    sqliteMemSize,
+    sqliteMemRoundup,
+    sqliteMemInitMethod,
+    sqliteMemShutdown,
+    NULL
+};
+
+// Size classes by 16 bytes up to 128 then 8 steps per power of two, the index maps size/16 to the class
+static void sqliteMemInit()
+{
+    if (_mem.ready) return;
+    sqlite3_config(SQLITE_CONFIG_GETMALLOC, &_mem.system);
+    uv_mutex_init(&_mem.mutex);
+    int n = 0;
+    for (unsigned size = 16; size <= 128; size += 16) _mem.classes[n++].size = size;
+    for (unsigned base = 128; base < MEM_SMALL; base *= 2) {
+        for (unsigned i = 1; i <= 8; i++) _mem.classes[n++].size = base + base * i / 8;
+    }
+    for (int i = 0, c = 0; i <= MEM_SMALL / 16; i++) {
+        while (_mem.classes[c].size < (unsigned)i * 16) c++;
+        _mem.index[i] = c;
+    }
+    for (int i = 0; i < MEM_CLASSES; i++) {
+        _mem.classes[i].limit = max(16, 64 * 1024 / (int)_mem.classes[i].size);
+        uv_mutex_init(&_mem.classes[i].mutex);
+    }
+    _mem.ready = true;
+}
+
+// SQLite must be shut down to change the allocator, all memory from the old one must be already freed
+static bool sqliteMemConfigure(bool arena, string &message)
+{
+    if (arena == _mem.arena) return true;
+    if (_opened) {
+        message = "The allocator can only be changed before any database is opened";
+        return false;
+    }
+    sqlite3_shutdown();
+    int rc = sqlite3_config(SQLITE_CONFIG_MALLOC, arena ? &_mem_methods : &_mem.system);
+    if (rc == SQLITE_OK) _mem.arena = arena;
+    sqlite3_initialize();
+    if (rc != SQLITE_OK) message = sqlite3_errstr(rc);
+    return rc == SQLITE_OK;
+}
+
+static Local<Object> sqliteMemStats()
+{
+    Nan::EscapableHandleScope scope;
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New("allocator").ToLocalChecked(), Nan::New(_mem.arena ? "arena" : "system").ToLocalChecked());
+    if (_mem.arena) {
+        int threads = 0;
+        uv_mutex_lock(&_mem.mutex);
+        sqlite3_int64 allocated = __atomic_load_n(&_mem.allocated, __ATOMIC_RELAXED);
+        sqlite3_int64 freed = __atomic_load_n(&_mem.freed, __ATOMIC_RELAXED);
+        sqlite3_int64 allocs = __atomic_load_n(&_mem.allocs, __ATOMIC_RELAXED);
+        for (SQLiteMemCache *cache = _mem.caches; cache; cache = cache->next) {
+            allocated += __atomic_load_n(&cache->allocated, __ATOMIC_RELAXED);
+            freed += __atomic_load_n(&cache->freed, __ATOMIC_RELAXED);
+            allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+            threads++;
+        }
+        uv_mutex_unlock(&_mem.mutex);
+        double free = 0;
+        for (int i = 0; i < MEM_CLASSES; i++) {
+            uv_mutex_lock(&_mem.classes[i].mutex);
+            free += (double)_mem.classes[i].count * _mem.classes[i].size;
+            uv_mutex_unlock(&_mem.classes[i].mutex);
+        }
+        uint64_t now = uv_hrtime();
+        double rate = _mem.last_time ? (allocs - _mem.last_allocs) * 1e9 / (now - _mem.last_time) : 0;
+        _mem.last_allocs = allocs;
+        _mem.last_time = now;
+        // The exact sum may be above the flushed peak, keep it so the peak never goes below a reported current
+        sqlite3_int64 current = allocated - freed;
+        sqlite3_int64 peak = __atomic_load_n(&_mem.peak, __ATOMIC_RELAXED);
+        while (current > peak && !__atomic_compare_exchange_n(&_mem.peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        Nan::Set(obj, Nan::New("current").ToLocalChecked(), Nan::New((double)current));
+        Nan::Set(obj, Nan::New("peak").ToLocalChecked(), Nan::New((double)max(current, peak)));
+        Nan::Set(obj, Nan::New("allocs").ToLocalChecked(), Nan::New((double)allocs));
+        Nan::Set(obj, Nan::New("allocs_per_sec").ToLocalChecked(), Nan::New(round(rate)));
+        Nan::Set(obj, Nan::New("arena").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_mem.chunks, __ATOMIC_RELAXED)));
+        Nan::Set(obj, Nan::New("free").ToLocalChecked(), Nan::New(free));
+        Nan::Set(obj, Nan::New("threads").ToLocalChecked(), Nan::New(threads));
+    }
+    return scope.Escape(obj);
+}
+
+// Page cache for all connections: without a memory budget every cache keeps to its own cache_size like the default cache,
+// with the budget set by configure({ cache_memory }) cache_size is ignored and all caches grow until the total reaches
+// the budget, then a new page is taken from the database with the most pages in memory so every database keeps at least
+// its fair share. Within a cache the victim is picked by the clock algorithm. Caches lock only themselves, pages of other
+// caches are taken under the global mutex with trylock so two threads never wait on each other.
+
+struct SQLitePCache;
+
+struct SQLitePage {
+    sqlite3_pcache_page base;
+    unsigned key;
+    unsigned size;
+    bool pinned;
+    bool ref;
+    bool huge;
+    SQLitePage *hnext;
+    SQLitePage *prev;
+    SQLitePage *next;
+};
+
+struct SQLitePCache {
+    unsigned size;
+    int szPage;
+    int szExtra;
+    bool purgeable;
+    unsigned max;
+    unsigned count;
+    unsigned pinned;
+    unsigned nhash;
+    SQLitePage **hash;
+    // All pages in a ring, the clock hand points to the next candidate
+    SQLitePage *hand;
+    SQLitePageStats *stats;
+    uv_mutex_t mutex;
+    SQLitePCache *prev;
+    SQLitePCache *next;
+};
+
+// Free slots in huge page chunks by slot size
+struct SQLitePageSlab {
+    unsigned size;
+    void *free;
+};
+
+#define PCACHE_CHUNK (2 * 1024 * 1024)
+
+static struct {
+    bool installed;
+    uv_mutex_t mutex;
+    SQLitePCache *caches;
+    int count;
+    sqlite3_int64 budget;
+    sqlite3_int64 used;
+    bool hugepages;
+    vector<SQLitePageSlab> slabs;
+    sqlite3_int64 chunks;
+} _pcache;
+
+// Caches created by threads that are not running anything for a database
+static SQLitePageStats _pcache_other;
+
+static void sqlitePageRelease(SQLitePageStats *stats)
+{
+    if (stats && stats != &_pcache_other && __atomic_sub_fetch(&stats->refs, 1, __ATOMIC_ACQ_REL) == 0) delete stats;
+}
+
+// Huge page chunks are never returned, freed slots are kept for the next pages of the same size
+static void *sqlitePageAlloc(unsigned size, bool &huge)
+{
+    huge = false;
+#ifdef MAP_ANONYMOUS
+    if (_pcache.hugepages) {
+        uv_mutex_lock(&_pcache.mutex);
+        uint i = 0;
+        while (i < _pcache.slabs.size() && _pcache.slabs[i].size != size) i++;
+        if (i == _pcache.slabs.size()) {
+            SQLitePageSlab slab = { size, NULL };
+            _pcache.slabs.push_back(slab);
+        }
+        SQLitePageSlab &slab = _pcache.slabs[i];
+        if (!slab.free) {
+            void *chunk = mmap(NULL, PCACHE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (chunk == MAP_FAILED) {
+                chunk = mmap(NULL, PCACHE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+                if (chunk != MAP_FAILED) madvise(chunk, PCACHE_CHUNK, MADV_HUGEPAGE);
+#endif
+            }
+            if (chunk != MAP_FAILED) {
+                for (unsigned off = 0; off + size <= PCACHE_CHUNK; off += size) {
+                    *(void**)((char*)chunk + off) = slab.free;
+                    slab.free = (char*)chunk + off;
+                }
+                _pcache.chunks++;
+            }
+        }
+        void *ptr = slab.free;
+        if (ptr) slab.free = *(void**)ptr;
+        uv_mutex_unlock(&_pcache.mutex);
+        if (ptr) {
+            huge = true;
+            return ptr;
+        }
+    }
+#endif
+    return sqlite3_malloc64(size);
+}
+
+static void sqlitePageFree(SQLitePage *page)
+{
+    __atomic_sub_fetch(&_pcache.used, page->size, __ATOMIC_RELAXED);
+    if (!page->huge) return sqlite3_free(page);
+    uv_mutex_lock(&_pcache.mutex);
+    for (uint i = 0; i < _pcache.slabs.size(); i++) {
+        if (_pcache.slabs[i].size != page->size) continue;
+        *(void**)page = _pcache.slabs[i].free;
+        _pcache.slabs[i].free = page;
+        break;
+    }
+    uv_mutex_unlock(&_pcache.mutex);
+}
+
+static void sqlitePCacheLink(SQLitePCache *cache, SQLitePage *page)
+{
+    unsigned h = page->key % cache->nhash;
+    page->hnext = cache->hash[h];
+    cache->hash[h] = page;
+    if (cache->hand) {
+        page->next = cache->hand;
+        page->prev = cache->hand->prev;
+        page->prev->next = page;
+        cache->hand->prev = page;
+    } else {
+        cache->hand = page->next = page->prev = page;
+    }
+    // Other threads read the counters without the cache lock when looking for a victim
+    __atomic_add_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+    if (page->pinned) __atomic_add_fetch(&cache->pinned, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache->stats->pages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache->stats->bytes, page->size, __ATOMIC_RELAXED);
+}
+
+static void sqlitePCacheUnlink(SQLitePCache *cache, SQLitePage *page)
+{
+    SQLitePage **pp = &cache->hash[page->key % cache->nhash];
+    while (*pp != page) pp = &(*pp)->hnext;
+    *pp = page->hnext;
+    if (page->next == page) {
+        cache->hand = NULL;
+    } else {
+        if (cache->hand == page) cache->hand = page->next;
+        page->prev->next = page->next;
+        page->next->prev = page->prev;
+    }
+    __atomic_sub_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+    if (page->pinned) __atomic_sub_fetch(&cache->pinned, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&cache->stats->pages, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&cache->stats->bytes, page->size, __ATOMIC_RELAXED);
+}
+
+static SQLitePage *sqlitePCacheFind(SQLitePCache *cache, unsigned key)
+{
+    SQLitePage *page = cache->hash[key % cache->nhash];
+    while (page && page->key != key) page = page->hnext;
+    return page;
+}
+
+static void sqlitePCacheRehash(SQLitePCache *cache)
+{
+    unsigned nhash = cache->nhash * 2;
+    SQLitePage **hash = (SQLitePage**)sqlite3_malloc64(nhash * sizeof(SQLitePage*));
+    if (!hash) return;
+    memset(hash, 0, nhash * sizeof(SQLitePage*));
+    for (unsigned i = 0; i < cache->nhash; i++) {
+        SQLitePage *page = cache->hash[i];
+        while (page) {
+            SQLitePage *next = page->hnext;
+            page->hnext = hash[page->key % nhash];
+            hash[page->key % nhash] = page;
+            page = next;
+        }
+    }
+    sqlite3_free(cache->hash);
+    cache->hash = hash;
+    cache->nhash = nhash;
+}
+
+// Next unpinned page not used since the last pass of the hand, taken out of the cache
+static SQLitePage *sqlitePCacheClock(SQLitePCache *cache)
+{
+    if (!cache->purgeable || cache->count == cache->pinned) return NULL;
+    for (unsigned i = 0; i < cache->count * 2; i++) {
+        SQLitePage *page = cache->hand;
+        cache->hand = page->next;
+        if (page->pinned) continue;
+        if (page->ref) {
+            page->ref = false;
+            continue;
+        }
+        sqlitePCacheUnlink(cache, page);
+        __atomic_add_fetch(&cache->stats->evictions, 1, __ATOMIC_RELAXED);
+        return page;
+    }
+    return NULL;
+}
+
+// Bytes of the database the cache belongs to, caches without a database are weighed on their own
+static sqlite3_int64 sqlitePCacheBytes(SQLitePCache *cache, unsigned count)
+{
+    if (cache->stats == &_pcache_other) return (sqlite3_int64)count * cache->size;
+    return __atomic_load_n(&cache->stats->bytes, __ATOMIC_RELAXED);
+}
+
+// Take a page from the database with the most pages in memory, the cache itself is already locked by the caller,
+// other caches are only looked at without their lock until one is picked
+static SQLitePage *sqlitePCacheSteal(SQLitePCache *self)
+{
+    SQLitePage *page = NULL;
+    vector<SQLitePCache*> tried;
+    uv_mutex_lock(&_pcache.mutex);
+    while (!page) {
+        SQLitePCache *victim = NULL;
+        sqlite3_int64 vbytes = 0;
+        unsigned vcount = 0;
+        for (SQLitePCache *cache = _pcache.caches; cache; cache = cache->next) {
+            unsigned count = __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+            if (!cache->purgeable || count == __atomic_load_n(&cache->pinned, __ATOMIC_RELAXED)) continue;
+            if (find(tried.begin(), tried.end(), cache) != tried.end()) continue;
+            sqlite3_int64 bytes = sqlitePCacheBytes(cache, count);
+            if (!victim || bytes > vbytes || (bytes == vbytes && (cache == self || count > vcount))) {
+                victim = cache;
+                vbytes = bytes;
+                vcount = count;
+            }
+        }
+        if (!victim) break;
+        tried.push_back(victim);
+        if (victim == self) {
+            page = sqlitePCacheClock(self);
+        } else
+        if (uv_mutex_trylock(&victim->mutex) == 0) {
+            page = sqlitePCacheClock(victim);
+            uv_mutex_unlock(&victim->mutex);
+        }
+    }
+    uv_mutex_unlock(&_pcache.mutex);
+    return page;
+}
+
+static int sqlitePCacheInitMethod(void *arg)
+{
+    return SQLITE_OK;
+}
+
+static void sqlitePCacheShutdown(void *arg)
+{
+}
+
+static sqlite3_pcache *sqlitePCacheCreate(int szPage, int szExtra, int purgeable)
+{
+    SQLitePCache *cache = (SQLitePCache*)sqlite3_malloc64(sizeof(SQLitePCache));
+    if (!cache) return NULL;
+    memset(cache, 0, sizeof(SQLitePCache));
+    cache->nhash = 64;
+    cache->hash = (SQLitePage**)sqlite3_malloc64(cache->nhash * sizeof(SQLitePage*));
+    if (!cache->hash) {
+        sqlite3_free(cache);
+        return NULL;
+    }
+    memset(cache->hash, 0, cache->nhash * sizeof(SQLitePage*));
+    cache->szPage = szPage;
+    cache->szExtra = szExtra;
+    cache->size = (sizeof(SQLitePage) + szPage + szExtra + 7) & ~7;
+    cache->purgeable = purgeable;
+    cache->max = 100;
+    cache->stats = _pcache_owner ? _pcache_owner : &_pcache_other;
+    if (cache->stats != &_pcache_other) __atomic_add_fetch(&cache->stats->refs, 1, __ATOMIC_RELAXED);
+    uv_mutex_init(&cache->mutex);
+
+    uv_mutex_lock(&_pcache.mutex);
+    cache->next = _pcache.caches;
+    if (cache->next) cache->next->prev = cache;
+    _pcache.caches = cache;
+    _pcache.count++;
+    uv_mutex_unlock(&_pcache.mutex);
+    return (sqlite3_pcache*)cache;
+}
+
+static void sqlitePCacheCachesize(sqlite3_pcache *pcache, int max)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&cache->mutex);
+    cache->max = max;
+    while (!__atomic_load_n(&_pcache.budget, __ATOMIC_RELAXED) && cache->count > cache->max) {
+        SQLitePage *page = sqlitePCacheClock(cache);
+        if (!page) break;
+        sqlitePageFree(page);
+    }
+    uv_mutex_unlock(&cache->mutex);
+}
+
+static int sqlitePCachePagecount(sqlite3_pcache *pcache)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&cache->mutex);
+    int count = cache->count;
+    uv_mutex_unlock(&cache->mutex);
+    return count;
+}
+
+// Create flag 1 allows a new page only if it is cheap, SQLite spills dirty pages and asks again with 2
+static sqlite3_pcache_page *sqlitePCacheFetch(sqlite3_pcache *pcache, unsigned key, int create)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&cache->mutex);
+    SQLitePage *page = sqlitePCacheFind(cache, key);
+    if (page) {
+        if (!page->pinned) {
+            page->pinned = true;
+            __atomic_add_fetch(&cache->pinned, 1, __ATOMIC_RELAXED);
+        }
+        page->ref = true;
+        __atomic_add_fetch(&cache->stats->hits, 1, __ATOMIC_RELAXED);
+        uv_mutex_unlock(&cache->mutex);
+        return &page->base;
+    }
+    if (!create) {
+        uv_mutex_unlock(&cache->mutex);
+        return NULL;
+    }
+
+    sqlite3_int64 budget = __atomic_load_n(&_pcache.budget, __ATOMIC_RELAXED);
+    if (cache->purgeable) {
+        if (!budget) {
+            if (create == 1 && cache->pinned >= cache->max * 9 / 10) {
+                uv_mutex_unlock(&cache->mutex);
+                return NULL;
+            }
+            if (cache->count >= cache->max) page = sqlitePCacheClock(cache);
+        } else {
+            while (__atomic_load_n(&_pcache.used, __ATOMIC_RELAXED) + cache->size > budget) {
+                SQLitePage *victim = sqlitePCacheSteal(cache);
+                if (!victim) break;
+                if (victim->size == cache->size && __atomic_load_n(&_pcache.used, __ATOMIC_RELAXED) <= budget) {
+                    page = victim;
+                    break;
+                }
+                sqlitePageFree(victim);
+            }
+            if (!page && create == 1 && __atomic_load_n(&_pcache.used, __ATOMIC_RELAXED) + cache->size > budget) {
+                uv_mutex_unlock(&cache->mutex);
+                return NULL;
+            }
+        }
+    }
+    if (!page) {
+        bool huge;
+        page = (SQLitePage*)sqlitePageAlloc(cache->size, huge);
+        if (!page) {
+            uv_mutex_unlock(&cache->mutex);
+            return NULL;
+        }
+        page->size = cache->size;
+        page->huge = huge;
+        __atomic_add_fetch(&_pcache.used, cache->size, __ATOMIC_RELAXED);
+    }
+    page->base.pBuf = &page[1];
+    page->base.pExtra = (char*)&page[1] + cache->szPage;
+    memset(page->base.pExtra, 0, cache->szExtra);
+    page->key = key;
+    page->pinned = true;
+    page->ref = true;
+    if (cache->count >= cache->nhash) sqlitePCacheRehash(cache);
+    sqlitePCacheLink(cache, page);
+    __atomic_add_fetch(&cache->stats->misses, 1, __ATOMIC_RELAXED);
+    uv_mutex_unlock(&cache->mutex);
+    return &page->base;
+}
+
+static void sqlitePCacheUnpin(sqlite3_pcache *pcache, sqlite3_pcache_page *ppage, int discard)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    SQLitePage *page = (SQLitePage*)ppage;
+    uv_mutex_lock(&cache->mutex);
+    if (discard || (!__atomic_load_n(&_pcache.budget, __ATOMIC_RELAXED) && cache->count > cache->max)) {
+        sqlitePCacheUnlink(cache, page);
+        sqlitePageFree(page);
+    } else
+    if (page->pinned) {
+        page->pinned = false;
+        __atomic_sub_fetch(&cache->pinned, 1, __ATOMIC_RELAXED);
+    }
+    uv_mutex_unlock(&cache->mutex);
+}
+
+static void sqlitePCacheRekey(sqlite3_pcache *pcache, sqlite3_pcache_page *ppage, unsigned oldKey, unsigned newKey)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    SQLitePage *page = (SQLitePage*)ppage;
+    uv_mutex_lock(&cache->mutex);
+    SQLitePage *old = sqlitePCacheFind(cache, newKey);
+    if (old) {
+        sqlitePCacheUnlink(cache, old);
+        sqlitePageFree(old);
+    }
+    SQLitePage **pp = &cache->hash[oldKey % cache->nhash];
+    while (*pp != page) pp = &(*pp)->hnext;
+    *pp = page->hnext;
+    page->key = newKey;
+    page->hnext = cache->hash[newKey % cache->nhash];
+    cache->hash[newKey % cache->nhash] = page;
+    uv_mutex_unlock(&cache->mutex);
+}
+
+static void sqlitePCacheTruncate(sqlite3_pcache *pcache, unsigned limit)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&cache->mutex);
+    for (unsigned i = 0; i < cache->nhash; i++) {
+        SQLitePage *page = cache->hash[i];
+        while (page) {
+            SQLitePage *next = page->hnext;
+            if (page->key >= limit) {
+                sqlitePCacheUnlink(cache, page);
+                sqlitePageFree(page);
+            }
+            page = next;
+        }
+    }
+    uv_mutex_unlock(&cache->mutex);
+}
+
+static void sqlitePCacheShrink(sqlite3_pcache *pcache)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&cache->mutex);
+    for (unsigned i = 0; i < cache->nhash; i++) {
+        SQLitePage *page = cache->hash[i];
+        while (page) {
+            SQLitePage *next = page->hnext;
+            if (!page->pinned) {
+                sqlitePCacheUnlink(cache, page);
+                sqlitePageFree(page);
+            }
+            page = next;
+        }
+    }
+    uv_mutex_unlock(&cache->mutex);
+}
+
+// Once out of the list no other thread can take pages from the cache
+static void sqlitePCacheDestroy(sqlite3_pcache *pcache)
+{
+    SQLitePCache *cache = (SQLitePCache*)pcache;
+    uv_mutex_lock(&_pcache.mutex);
+    if (cache->prev) cache->prev->next = cache->next; else _pcache.caches = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    _pcache.count--;
+    uv_mutex_unlock(&_pcache.mutex);
+
+    while (cache->hand) {
+        SQLitePage *page = cache->hand;
+        sqlitePCacheUnlink(cache, page);
+        sqlitePageFree(page);
+    }
+    sqlitePageRelease(cache->stats);
+    uv_mutex_destroy(&cache->mutex);
+    sqlite3_free(cache->hash);
+    sqlite3_free(cache);
+}
+
+static sqlite3_pcache_methods2 _pcache_methods = {
+    1,
+    NULL,
+    sqlitePCacheInitMethod,
+    sqlitePCacheShutdown,
+    sqlitePCacheCreate,
+    sqlitePCacheCachesize,
+    sqlitePCachePagecount,
+    sqlitePCacheFetch,
+    sqlitePCacheUnpin,
+    sqlitePCacheRekey,
+    sqlitePCacheTruncate,
+    sqlitePCacheDestroy,
+    sqlitePCacheShrink
+};
+
+// Must be installed before SQLite is initialized, if SQLite is already in use by someone else the default cache stays
+static void sqlitePCacheInit()
+{
+    if (_pcache.installed) return;
+    uv_mutex_init(&_pcache.mutex);
+    _pcache.installed = sqlite3_config(SQLITE_CONFIG_PCACHE2, &_pcache_methods) == SQLITE_OK;
+}
+
+// The budget applies to new pages, caches over it shrink as pages are needed, 0 returns to per connection cache_size
+static void sqlitePCacheConfigure(double budget, int hugepages)
+{
+    if (!_pcache.installed) return;
+    if (budget >= 0) __atomic_store_n(&_pcache.budget, (sqlite3_int64)budget, __ATOMIC_RELAXED);
+    if (hugepages >= 0) {
+        uv_mutex_lock(&_pcache.mutex);
+        _pcache.hugepages = hugepages;
+        uv_mutex_unlock(&_pcache.mutex);
+    }
+}
+
+static Local<Object> sqlitePCacheStats()
+{
+    Nan::EscapableHandleScope scope;
+    Local<Object> obj = Nan::New<Object>();
+    uv_mutex_lock(&_pcache.mutex);
+    int count = _pcache.count;
+    double chunks = _pcache.chunks;
+    uv_mutex_unlock(&_pcache.mutex);
+    Nan::Set(obj, Nan::New("installed").ToLocalChecked(), Nan::New(_pcache.installed));
+    Nan::Set(obj, Nan::New("budget").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_pcache.budget, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("used").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_pcache.used, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("caches").ToLocalChecked(), Nan::New(count));
+    Nan::Set(obj, Nan::New("hugepages").ToLocalChecked(), Nan::New(_pcache.hugepages));
+    Nan::Set(obj, Nan::New("huge_bytes").ToLocalChecked(), Nan::New(chunks * PCACHE_CHUNK));
+    Nan::Set(obj, Nan::New("other_pages").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_pcache_other.pages, __ATOMIC_RELAXED)));
+    return scope.Escape(obj);
+}
+
+#ifdef SQLITE_IO_URING
+
+// The io_uring VFS wraps the default unix VFS, locking, shared memory and mmap stay with the unix VFS,
+// reads, writes and syncs go through a per thread ring. SQLite calls are synchronous so every call is one
+// submission and one wait, readahead for sequential reads is submitted in the same call without waiting for it.
+// Threads where the ring cannot be created use the unix VFS as is.
+
+#define URING_ENTRIES 64
+#define URING_SYNC 1
+#define URING_READAHEAD 2
+
+static sqlite3_uint64 _uring_reads = 0;
+static sqlite3_uint64 _uring_writes = 0;
+static sqlite3_uint64 _uring_syncs = 0;
+static sqlite3_uint64 _uring_readahead = 0;
+static sqlite3_uint64 _uring_fallback = 0;
+static sqlite3_uint64 _uring_files = 0;
+static sqlite3_uint64 _uring_fallback_files = 0;
+
+struct SQLiteRing {
+    SQLiteRing(): fd(-2), sq_ptr(NULL), cq_ptr(NULL), sqes(NULL), queued(0) {}
+    ~SQLiteRing() {
+        if (fd < 0) return;
+        munmap(sqes, sqe_size);
+        if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        close(fd);
+    }
+
+    bool Ready() {
+        if (fd == -2) Init();
+        return fd >= 0;
+    }
+
+    void Init() {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if (fd < 0) {
+            fd = -1;
+            return;
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = max(sq_size, cq_size);
+        sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP ? sq_ptr : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = (struct io_uring_sqe*)mmap(NULL, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) munmap(sqes, sqe_size);
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+            if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+            close(fd);
+            fd = -1;
+            return;
+        }
+        sq_head = (unsigned*)((char*)sq_ptr + p.sq_off.head);
+        sq_tail = (unsigned*)((char*)sq_ptr + p.sq_off.tail);
+        sq_mask = (unsigned*)((char*)sq_ptr + p.sq_off.ring_mask);
+        sq_array = (unsigned*)((char*)sq_ptr + p.sq_off.array);
+        cq_head = (unsigned*)((char*)cq_ptr + p.cq_off.head);
+        cq_tail = (unsigned*)((char*)cq_ptr + p.cq_off.tail);
+        cq_mask = (unsigned*)((char*)cq_ptr + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)((char*)cq_ptr + p.cq_off.cqes);
+        entries = p.sq_entries;
+    }
+
+    // Queue a request, it is submitted by the next Exec
+    struct io_uring_sqe *Queue(int op, int file, const void *addr, unsigned len, sqlite3_int64 offset, __u64 tag) {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) return NULL;
+        unsigned idx = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op;
+        sqe->fd = file;
+        sqe->addr = (__u64)(uintptr_t)addr;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return sqe;
+    }
+
+    // Submit everything queued and wait for the synchronous request, completed readaheads are reaped on the way.
+    // Returns 0 and the completion result in res, or -errno if the request could not be submitted at all,
+    // once the request is taken by the kernel it is always waited for because it owns the caller's buffer
+    int Exec(int op, int file, const void *addr, unsigned len, sqlite3_int64 offset, int *res, unsigned flags = 0) {
+        struct io_uring_sqe *sqe = Queue(op, file, addr, len, offset, URING_SYNC);
+        while (!sqe) {
+            if (Enter(1) < 0 && !Busy(errno)) return -errno;
+            Reap(NULL);
+            sqe = Queue(op, file, addr, len, offset, URING_SYNC);
+        }
+        if (op == IORING_OP_FSYNC) sqe->fsync_flags = flags;
+        while (true) {
+            if (Enter(1) < 0 && !Busy(errno) && Cancel()) return -errno;
+            if (Reap(res)) return 0;
+        }
+    }
+
+    // Temporary conditions, the completion queue is reaped and the call repeated
+    static bool Busy(int err) {
+        return err == EINTR || err == EAGAIN || err == EBUSY;
+    }
+
+    // Turn requests the kernel has not taken yet into no-ops, false if the synchronous request is already in flight
+    bool Cancel() {
+        unsigned tail = *sq_tail;
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (head == tail) return false;
+        for (; head != tail; head++) {
+            struct io_uring_sqe *sqe = &sqes[sq_array[head & *sq_mask]];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+        }
+        return true;
+    }
+
+    int Enter(unsigned wait) {
+        int rc = syscall(__NR_io_uring_enter, fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc > 0) queued -= min((unsigned)rc, queued);
+        return rc;
+    }
+
+    bool Reap(int *res) {
+        bool found = false;
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if (cqe->user_data == URING_SYNC && res) {
+                *res = cqe->res;
+                found = true;
+            }
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return found;
+    }
+
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqe_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued;
+};
+
+static thread_local SQLiteRing _ring;
+
+struct SQLiteUringFile {
+    sqlite3_file base;
+    sqlite3_file *real;
+    int fd;
+    bool synced;
+    // End of the last read and how far readahead was requested
+    sqlite3_int64 next;
+    sqlite3_int64 ahead;
+};
+
+// The unix VFS keeps the descriptor after the methods, VFS and inode pointers, same layout from 3.7.0 up to the bundled
+// version as checked where SQLITE_IO_URING is defined, it is also verified against the file name on open. There is no
+// public way to get the descriptor, and a second descriptor of our own is not an option: closing it would drop the POSIX
+// locks the unix VFS holds on the same file
+struct SQLiteUnixFile {
+    const sqlite3_io_methods *pMethod;
+    sqlite3_vfs *pVfs;
+    void *pInode;
+    int h;
+};
+
+static int sqliteUringClose(sqlite3_file *file)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xClose(p->real);
+}
+
+static int sqliteUringRead(sqlite3_file *file, void *buf, int amt, sqlite3_int64 offset)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    if (p->fd < 0 || !_ring.Ready()) {
+        __atomic_add_fetch(&_uring_fallback, 1, __ATOMIC_RELAXED);
+        return p->real->pMethods->xRead(p->real, buf, amt, offset);
+    }
+    // Sequential reads, ask for the next window in the same submission
+    if (offset == p->next && offset + amt > p->ahead) {
+        sqlite3_int64 window = min(amt * 32, 1024 * 1024);
+        struct io_uring_sqe *sqe = _ring.Queue(IORING_OP_FADVISE, p->fd, NULL, window, offset + amt, URING_READAHEAD);
+        if (sqe) {
+            sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+            p->ahead = offset + amt + window;
+            __atomic_add_fetch(&_uring_readahead, 1, __ATOMIC_RELAXED);
+        }
+    }
+    p->next = offset + amt;
+    __atomic_add_fetch(&_uring_reads, 1, __ATOMIC_RELAXED);
+
+    int got = 0, n;
+    while (got < amt) {
+        if (_ring.Exec(IORING_OP_READ, p->fd, (char*)buf + got, amt - got, offset + got, &n)) {
+            __atomic_add_fetch(&_uring_fallback, 1, __ATOMIC_RELAXED);
+            return p->real->pMethods->xRead(p->real, buf, amt, offset);
+        }
+        if (n == -EINTR || n == -EAGAIN) continue;
+        if (n < 0) return SQLITE_IOERR_READ;
+        if (n == 0) break;
+        got += n;
+    }
+    if (got < amt) {
+        memset((char*)buf + got, 0, amt - got);
+        return SQLITE_IOERR_SHORT_READ;
+    }
+    return SQLITE_OK;
+}
+
+static int sqliteUringWrite(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 offset)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    if (p->fd < 0 || !_ring.Ready()) {
+        __atomic_add_fetch(&_uring_fallback, 1, __ATOMIC_RELAXED);
+        return p->real->pMethods->xWrite(p->real, buf, amt, offset);
+    }
+    __atomic_add_fetch(&_uring_writes, 1, __ATOMIC_RELAXED);
+
+    int done = 0, n;
+    while (done < amt) {
+        if (_ring.Exec(IORING_OP_WRITE, p->fd, (const char*)buf + done, amt - done, offset + done, &n)) {
+            __atomic_add_fetch(&_uring_fallback, 1, __ATOMIC_RELAXED);
+            return p->real->pMethods->xWrite(p->real, (const char*)buf + done, amt - done, offset + done);
+        }
+        if (n == -EINTR || n == -EAGAIN) continue;
+        if (n == -ENOSPC || n == 0) return SQLITE_FULL;
+        if (n < 0) return SQLITE_IOERR_WRITE;
+        done += n;
+    }
+    return SQLITE_OK;
+}
+
+// The first sync goes through the unix VFS which also syncs the directory of a new file
+static int sqliteUringSync(sqlite3_file *file, int flags)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    if (p->fd < 0 || !p->synced || !_ring.Ready()) {
+        p->synced = true;
+        return p->real->pMethods->xSync(p->real, flags);
+    }
+    __atomic_add_fetch(&_uring_syncs, 1, __ATOMIC_RELAXED);
+    int n;
+    if (_ring.Exec(IORING_OP_FSYNC, p->fd, NULL, 0, 0, &n, flags & SQLITE_SYNC_DATAONLY ? IORING_FSYNC_DATASYNC : 0)) {
+        return p->real->pMethods->xSync(p->real, flags);
+    }
+    return n < 0 ? SQLITE_IOERR_FSYNC : SQLITE_OK;
+}
+
+static int sqliteUringTruncate(sqlite3_file *file, sqlite3_int64 size)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    p->next = p->ahead = 0;
+    return p->real->pMethods->xTruncate(p->real, size);
+}
+
+static int sqliteUringFileSize(sqlite3_file *file, sqlite3_int64 *size)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xFileSize(p->real, size);
+}
+
+static int sqliteUringLock(sqlite3_file *file, int lock)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xLock(p->real, lock);
+}
+
+static int sqliteUringUnlock(sqlite3_file *file, int lock)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xUnlock(p->real, lock);
+}
+
+static int sqliteUringCheckReservedLock(sqlite3_file *file, int *out)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xCheckReservedLock(p->real, out);
+}
+
+static int sqliteUringFileControl(sqlite3_file *file, int op, void *arg)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int sqliteUringSectorSize(sqlite3_file *file)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xSectorSize(p->real);
+}
+
+static int sqliteUringDeviceCharacteristics(sqlite3_file *file)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xDeviceCharacteristics(p->real);
+}
+
+static int sqliteUringShmMap(sqlite3_file *file, int page, int size, int extend, void volatile **out)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xShmMap(p->real, page, size, extend, out);
+}
+
+static int sqliteUringShmLock(sqlite3_file *file, int offset, int n, int flags)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xShmLock(p->real, offset, n, flags);
+}
+
+static void sqliteUringShmBarrier(sqlite3_file *file)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    p->real->pMethods->xShmBarrier(p->real);
+}
+
+static int sqliteUringShmUnmap(sqlite3_file *file, int remove)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xShmUnmap(p->real, remove);
+}
+
+static int sqliteUringFetch(sqlite3_file *file, sqlite3_int64 offset, int amt, void **out)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xFetch(p->real, offset, amt, out);
+}
+
+static int sqliteUringUnfetch(sqlite3_file *file, sqlite3_int64 offset, void *ptr)
+{
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    return p->real->pMethods->xUnfetch(p->real, offset, ptr);
+}
+
+static sqlite3_io_methods _uring_methods = {
+    3,
+    sqliteUringClose,
+    sqliteUringRead,
+    sqliteUringWrite,
+    sqliteUringTruncate,
+    sqliteUringSync,
+    sqliteUringFileSize,
+    sqliteUringLock,
+    sqliteUringUnlock,
+    sqliteUringCheckReservedLock,
+    sqliteUringFileControl,
+    sqliteUringSectorSize,
+    sqliteUringDeviceCharacteristics,
+    sqliteUringShmMap,
+    sqliteUringShmLock,
+    sqliteUringShmBarrier,
+    sqliteUringShmUnmap,
+    sqliteUringFetch,
+    sqliteUringUnfetch
+};
+
+static int sqliteUringOpen(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags, int *outFlags)
+{
+    sqlite3_vfs *orig = (sqlite3_vfs*)vfs->pAppData;
+    SQLiteUringFile *p = (SQLiteUringFile*)file;
+    memset(p, 0, sizeof(SQLiteUringFile));
+    p->real = (sqlite3_file*)&p[1];
+    p->fd = -1;
+
+    int rc = orig->xOpen(orig, name, p->real, flags, outFlags);
+    if (rc != SQLITE_OK) {
+        if (p->real->pMethods) p->real->pMethods->xClose(p->real);
+        return rc;
+    }
+    if (!p->real->pMethods) return rc;
+    // Files without a name and VFS versions with a different layout keep using the unix VFS
+    int h = ((SQLiteUnixFile*)p->real)->h;
+    struct stat st1, st2;
+    if (name && p->real->pMethods->iVersion >= 3 && h >= 0 && !fstat(h, &st1) && !stat(name, &st2) && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+        p->fd = h;
+        __atomic_add_fetch(&_uring_files, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&_uring_fallback_files, 1, __ATOMIC_RELAXED);
+    }
+    p->base.pMethods = &_uring_methods;
+    return SQLITE_OK;
+}
+
+static int sqliteUringDelete(sqlite3_vfs *vfs, const char *name, int dirSync)
+{
+    sqlite3_vfs *orig = (sqlite3_vfs*)vfs->pAppData;
+    return orig->xDelete(orig, name, dirSync);
+}
+
+static int sqliteUringAccess(sqlite3_vfs *vfs, const char *name, int flags, int *out)
+{
+    sqlite3_vfs *orig = (sqlite3_vfs*)vfs->pAppData;
+    return orig->xAccess(orig, name, flags, out);
+}
+
+static int sqliteUringFullPathname(sqlite3_vfs *vfs, const char *name, int size, char *out)
+{
+    sqlite3_vfs *orig = (sqlite3_vfs*)vfs->pAppData;
+    return orig->xFullPathname(orig, name, size, out);
+}
+
+static sqlite3_vfs _uring_vfs;
+
+// Registered as "io_uring", selected with vfs=io_uring in the URI
+static void sqliteUringInit()
+{
+    sqlite3_vfs *orig = sqlite3_vfs_find(NULL);
+    if (!orig || _uring_vfs.zName) return;
+    _uring_vfs = *orig;
+    _uring_vfs.szOsFile = sizeof(SQLiteUringFile) + orig->szOsFile;
+    _uring_vfs.pNext = NULL;
+    _uring_vfs.zName = "io_uring";
+    _uring_vfs.pAppData = orig;
+    _uring_vfs.xOpen = sqliteUringOpen;
+    _uring_vfs.xDelete = sqliteUringDelete;
+    _uring_vfs.xAccess = sqliteUringAccess;
+    _uring_vfs.xFullPathname = sqliteUringFullPathname;
+    sqlite3_vfs_register(&_uring_vfs, 0);
+}
+
+static Local<Object> sqliteUringStats()
+{
+    Nan::EscapableHandleScope scope;
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New("reads").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_reads, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("writes").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_writes, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("syncs").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_syncs, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("readahead").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_readahead, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("fallback").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_fallback, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("files").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_files, __ATOMIC_RELAXED)));
+    Nan::Set(obj, Nan::New("fallback_files").ToLocalChecked(), Nan::New((double)__atomic_load_n(&_uring_fallback_files, __ATOMIC_RELAXED)));
+    return scope.Escape(obj);
+}
+
+#endif
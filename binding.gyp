@@ -15,6 +15,7 @@
         "SQLITE_ENABLE_EXPLAIN_COMMENTS",
         "SQLITE_ENABLE_DBPAGE_VTAB",
         "SQLITE_ENABLE_STMTVTAB",
+        "SQLITE_ENABLE_NORMALIZE",
         "SQLITE_ENABLE_DBSTAT_VTAB",
         "SQLITE_MAX_EXPR_DEPTH=0",
         "SQLITE_OMIT_DEPRECATED",
@@ -0,0 +1,58 @@
+//
+//  Online backup in steps, progress, cancel and locked destinations
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function source()
+{
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000) INSERT INTO test SELECT i, randomblob(200) FROM n");
+    return db;
+}
+
+test("backup copies the database in steps and reports progress", async () => {
+    var db = source();
+    var dest = new sqlite.Database(":memory:");
+    var steps = [];
+    var err = await new Promise((resolve) => db.backup(dest, { pagesPerStep: 10, onProgress: (p) => steps.push(p) }, resolve));
+    assert.strictEqual(err, null);
+    assert.ok(steps.length > 10);
+    assert.strictEqual(steps[steps.length - 1].remaining, 0);
+    assert.deepStrictEqual(dest.querySync("SELECT count(*) AS n FROM test"), [{ n: 2000 }]);
+
+    var cancelled = new sqlite.Database(":memory:");
+    err = await new Promise((resolve) => db.backup(cancelled, { pagesPerStep: 10, onProgress: () => false }, resolve));
+    assert.match(err.message, /cancelled/);
+    db.closeSync();
+    dest.closeSync();
+    cancelled.closeSync();
+});
+
+test("backup into a locked database fails after the busy timeout", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-backup-" + process.pid + ".db");
+    // A private cache connection locks the file like another process would
+    var lock = new sqlite.Database(file, sqlite.OPEN_READWRITE | sqlite.OPEN_CREATE | sqlite.OPEN_PRIVATECACHE);
+    lock.runSync("CREATE TABLE other(a)");
+    lock.runSync("BEGIN EXCLUSIVE");
+
+    var db = source();
+    var started = Date.now();
+    var err = await new Promise((resolve) => db.backup(file, { busyTimeoutMs: 200 }, resolve));
+    var elapsed = Date.now() - started;
+    assert.match(err.message, /locked|busy/);
+    assert.ok(elapsed >= 200 && elapsed < 3000, "elapsed " + elapsed);
+
+    lock.runSync("ROLLBACK");
+    lock.closeSync();
+    db.closeSync();
+    fs.unlinkSync(file);
+});
@@ -0,0 +1,89 @@
+//
+//  runBatch and insertColumns: per row errors, rollback and exclusive use of the main connection
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open()
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(":memory:", (err) => {
+            if (err) return reject(err);
+            db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a text NOT NULL)");
+            resolve(db);
+        });
+    });
+}
+
+function call(obj, method, ...args)
+{
+    return new Promise((resolve, reject) => obj[method](...args, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+function batch(db, sql, rows, options)
+{
+    return new Promise((resolve) => db.runBatch(sql, rows, options || {}, (err, result) => resolve({ err, result })));
+}
+
+test("failed rows are reported by index and the rest is committed", async () => {
+    var db = await open();
+    var { err, result } = await batch(db, "INSERT INTO test VALUES(?,?)", [[1, "a"], [2, null], [3, "c"], [1, "d"]]);
+    assert.ifError(err);
+    assert.strictEqual(result.changes, 2);
+    assert.deepStrictEqual(result.errors.map((x) => (x.index)), [1, 3]);
+    assert.strictEqual(result.errors[0].code, "SQLITE_CONSTRAINT");
+    assert.deepStrictEqual(db.querySync("SELECT id FROM test ORDER BY id"), [{ id: 1 }, { id: 3 }]);
+});
+
+test("stop_on_error rolls back the whole batch", async () => {
+    var db = await open();
+    var { err, result } = await batch(db, "INSERT INTO test VALUES(?,?)", [[1, "a"], [2, null], [3, "c"]], { stop_on_error: true });
+    assert.ok(err);
+    assert.strictEqual(result.changes, 0);
+    assert.deepStrictEqual(result.errors.map((x) => (x.index)), [1]);
+    assert.deepStrictEqual(db.querySync("SELECT id FROM test"), []);
+});
+
+test("a row that makes SQLite roll back the transaction fails the batch", async () => {
+    var db = await open();
+    db.runSync("PRAGMA max_page_count=20");
+    var rows = [];
+    for (var i = 1; i <= 100; i++) rows.push([i, "x".repeat(2000)]);
+    var { err, result } = await batch(db, "INSERT INTO test VALUES(?,?)", rows);
+    assert.ok(err);
+    assert.strictEqual(err.code, "SQLITE_FULL");
+    assert.strictEqual(result.changes, 0);
+    assert.strictEqual(result.errors.length, 1);
+    // Nothing was written in autocommit after the rollback
+    assert.deepStrictEqual(db.querySync("SELECT count(*) AS n FROM test"), [{ n: 0 }]);
+});
+
+test("insertColumns rolls back with stop_on_error", async () => {
+    var db = await open();
+    var err = await new Promise((resolve) => db.insertColumns("test", { id: new Int32Array([1, 2, 2]), a: ["a", "b", "c"] }, { stop_on_error: true }, resolve));
+    assert.ok(err);
+    assert.deepStrictEqual(db.querySync("SELECT id FROM test"), []);
+});
+
+test("other writes do not run inside a batch", async () => {
+    var db = await open();
+    var rows = [], order = [];
+    for (var i = 1; i <= 20000; i++) rows.push([i, "row" + i]);
+    rows.push([1, "duplicate"]);
+    var done = batch(db, "INSERT INTO test VALUES(?,?)", rows, { stop_on_error: true }).then((x) => { order.push("batch"); return x });
+    assert.throws(() => db.runSync("INSERT INTO test VALUES(0, 'sync')"), /locked/);
+    var writes = [];
+    for (var i = 0; i < 10; i++) {
+        writes.push(call(db, "run", "INSERT INTO test VALUES(?, 'run')", [100000 + i]).then(() => order.push("run")));
+        writes.push(call(db, "exec", "INSERT INTO test VALUES(" + (200000 + i) + ", 'exec')").then(() => order.push("exec")));
+    }
+    var { err } = await done;
+    await Promise.all(writes);
+    assert.ok(err);
+    assert.strictEqual(order[0], "batch");
+    assert.deepStrictEqual(db.querySync("SELECT count(*) AS n FROM test"), [{ n: 20 }]);
+});
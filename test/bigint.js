@@ -0,0 +1,81 @@
+//
+//  BigInt parameters and results: range checks and exact ids
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+var MAX = 2n ** 63n - 1n;
+
+function open()
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(":memory:", (err) => {
+            if (err) return reject(err);
+            db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a INTEGER)");
+            resolve(db);
+        });
+    });
+}
+
+function run(db, sql, values, options)
+{
+    return new Promise((resolve, reject) => db.run(sql, values, options || {}, function(err) {
+        if (err) return reject(err);
+        resolve(this.lastID);
+    }));
+}
+
+test("BigInt parameters outside of 64 bits throw a RangeError", async () => {
+    var db = await open();
+    assert.throws(() => db.runSync("INSERT INTO test(a) VALUES(?)", [MAX + 1n]), RangeError);
+    assert.throws(() => db.querySync("SELECT ?", [-MAX - 2n]), RangeError);
+    assert.throws(() => db.run("INSERT INTO test(a) VALUES(?)", [MAX + 1n], () => {}), RangeError);
+    assert.throws(() => db.query("SELECT ?", [2n ** 64n], () => {}), RangeError);
+    assert.throws(() => db.runBatch("INSERT INTO test(a) VALUES(?)", [[1], [MAX + 1n]], () => {}), RangeError);
+    assert.throws(() => db.insertColumns("test", { a: [1n, MAX + 1n] }, () => {}), RangeError);
+    assert.throws(() => db.pipeline([{ sql: "SELECT ?", params: [MAX + 1n] }], () => {}), RangeError);
+    assert.throws(() => db.iterate("SELECT ?", [MAX + 1n]), RangeError);
+
+    db.runSync("INSERT INTO test(a) VALUES(?)", [MAX]);
+    db.runSync("INSERT INTO test(a) VALUES(?)", [-MAX - 1n]);
+    var rows = db.querySync("SELECT a FROM test ORDER BY id", [], { bigint: "auto" });
+    assert.deepStrictEqual(rows.map(x => x.a), [MAX, -MAX - 1n]);
+    db.closeSync();
+});
+
+test("lastID follows the bigint option, inserted_oid is exact", async () => {
+    var db = await open();
+    var id = 2n ** 62n + 1n;
+
+    assert.strictEqual(await run(db, "INSERT INTO test(id, a) VALUES(?, 1)", [id], { bigint: "auto" }), id);
+    assert.strictEqual(await run(db, "INSERT INTO test(a) VALUES(2)", [], { bigint: "always" }), id + 1n);
+    assert.strictEqual(typeof await run(db, "INSERT INTO test(a) VALUES(3)", []), "number");
+
+    db.runSync("INSERT INTO test(a) VALUES(4)");
+    assert.strictEqual(db.inserted_oid, id + 3n);
+
+    await new Promise((resolve) => db.runBatch("INSERT INTO test(a) VALUES(?)", [[5]], resolve));
+    assert.strictEqual(db.inserted_oid, id + 4n);
+
+    db.run("DELETE FROM test", () => {});
+    assert.strictEqual(await run(db, "INSERT INTO test(id, a) VALUES(5, 1)", [], { bigint: "auto" }), 5);
+    assert.strictEqual(db.inserted_oid, 5);
+    db.closeSync();
+});
+
+test("BigUint64Array values above the 64-bit signed range are row errors", async () => {
+    var db = await open();
+    var columns = { id: new Int32Array([1, 2, 3]), a: new BigUint64Array([1n, MAX + 1n, MAX]) };
+    var result = await new Promise((resolve, reject) => db.insertColumns("test", columns, (err, rc) => (err ? reject(err) : resolve(rc))));
+    assert.strictEqual(result.changes, 2);
+    assert.strictEqual(result.errors.length, 1);
+    assert.strictEqual(result.errors[0].index, 1);
+    assert.match(result.errors[0].message, /out of the 64-bit integer range/);
+    var rows = db.querySync("SELECT id, a FROM test ORDER BY id", [], { bigint: "auto" });
+    assert.deepStrictEqual(rows, [{ id: 1, a: 1 }, { id: 3, a: MAX }]);
+    db.closeSync();
+});
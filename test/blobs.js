@@ -0,0 +1,45 @@
+//
+//  BLOB results are returned as Buffers that own the memory read in the worker
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var crypto = require("crypto");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function query(db, sql, params, options)
+{
+    return new Promise((resolve, reject) => db.query(sql, params, options || {}, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("large and empty blobs keep their content in async and sync queries", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, b BLOB)");
+    var blobs = [crypto.randomBytes(2 * 1024 * 1024), crypto.randomBytes(100 * 1024), Buffer.alloc(0), null];
+    for (var i = 0; i < blobs.length; i++) db.runSync("INSERT INTO test VALUES(?, ?)", [i + 1, blobs[i]]);
+
+    var rows = await query(db, "SELECT id, b FROM test ORDER BY id", []);
+    var sync = db.querySync("SELECT id, b FROM test ORDER BY id");
+    for (var result of [rows, sync]) {
+        assert.strictEqual(result.length, 4);
+        assert.ok(Buffer.isBuffer(result[0].b));
+        assert.ok(result[0].b.equals(blobs[0]));
+        assert.ok(result[1].b.equals(blobs[1]));
+        assert.ok(Buffer.isBuffer(result[2].b));
+        assert.strictEqual(result[2].b.length, 0);
+        assert.strictEqual(result[3].b, null);
+    }
+
+    // Every row gets its own memory
+    rows = await query(db, "SELECT b FROM test WHERE id = 2 UNION ALL SELECT b FROM test WHERE id = 2", []);
+    rows[0].b.fill(0);
+    assert.ok(rows[1].b.equals(blobs[1]));
+
+    // The memory stays valid after the statement and the database are gone
+    rows = await query(db, "SELECT b FROM test WHERE id = 1", [], { format: "raw" });
+    db.closeSync();
+    global.gc && global.gc();
+    assert.ok(rows[0][0].equals(blobs[0]));
+});
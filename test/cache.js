@@ -0,0 +1,60 @@
+//
+//  Per-connection cache of prepared statements for query/run
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function cache(file)
+{
+    return sqlite.stats().databases.filter((x) => x.name == file)[0].cache;
+}
+
+function query(db, sql, values)
+{
+    return new Promise((resolve, reject) => db.query(sql, values || [], (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("repeated statements are taken from the cache and the least recently used is evicted", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-cache-" + process.pid + ".db");
+    var db = new sqlite.Database(file, { stmt_cache: 2 });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    var start = cache(file);
+
+    for (var i = 0; i < 5; i++) db.runSync("INSERT INTO test(a) VALUES(?)", [i]);
+    for (var i = 0; i < 5; i++) assert.deepStrictEqual(await query(db, "SELECT a FROM test WHERE id = ?", [i + 1]), [{ a: i }]);
+    var stats = cache(file);
+    assert.strictEqual(stats.max, 2);
+    assert.strictEqual(stats.misses - start.misses, 2);
+    assert.strictEqual(stats.hits - start.hits, 8);
+    assert.strictEqual(stats.size, 2);
+
+    db.querySync("SELECT count(*) FROM test");
+    var after = cache(file);
+    assert.strictEqual(after.size, 2);
+    assert.strictEqual(after.evictions - stats.evictions, 1);
+
+    // A cached statement still works after the schema changed
+    db.runSync("ALTER TABLE test ADD COLUMN b DEFAULT 'b'");
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test WHERE id = ?", [1]), [{ id: 1, a: 0, b: "b" }]);
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test WHERE id = ?", [1]), [{ id: 1, a: 0, b: "b" }]);
+    db.closeSync();
+    fs.unlinkSync(file);
+});
+
+test("stmt_cache 0 disables the cache", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-nocache-" + process.pid + ".db");
+    var db = new sqlite.Database(file, { stmt_cache: 0 });
+    for (var i = 0; i < 3; i++) assert.deepStrictEqual(db.querySync("SELECT ? AS a", [i]), [{ a: i }]);
+    var stats = cache(file);
+    assert.strictEqual(stats.size, 0);
+    assert.strictEqual(stats.hits, 0);
+    db.closeSync();
+    fs.unlinkSync(file);
+});
@@ -0,0 +1,52 @@
+//
+//  Coalescing async calls made in the same event loop iteration into one worker call
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open(file, options)
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, options, (err) => (err ? reject(err) : resolve(db)));
+    });
+}
+
+function stats(db)
+{
+    return sqlite.stats().databases.filter((x) => x.name == db.name)[0];
+}
+
+test("calls in one tick run in one worker call with their own callbacks and errors", async () => {
+    var db = await open(":memory:", { coalesce: true });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a TEXT NOT NULL)");
+    var before = stats(db);
+
+    var order = [], calls = [];
+    for (var i = 1; i <= 20; i++) {
+        calls.push(new Promise((resolve) => {
+            var n = i;
+            if (n % 5 == 0) {
+                db.query("SELECT count(*) AS n FROM test", [], (err, rows) => { order.push(n); resolve({ err, rows }); });
+            } else {
+                db.run("INSERT INTO test VALUES(?, ?)", [n, n == 7 ? null : "a" + n], function(err) { order.push(n); resolve({ err, id: this.lastID }); });
+            }
+        }));
+    }
+    var results = await Promise.all(calls);
+    assert.deepStrictEqual(order, Array.from({ length: 20 }, (x, i) => i + 1));
+    assert.match(results[6].err.message, /NOT NULL/);
+    assert.strictEqual(results[7].err, null);
+    assert.strictEqual(results[7].id, 8);
+    assert.deepStrictEqual(results[4].rows, [{ n: 4 }]);
+    assert.deepStrictEqual(results[9].rows, [{ n: 7 }]);
+    assert.deepStrictEqual(results[19].rows, [{ n: 15 }]);
+
+    var after = stats(db);
+    assert.ok(after.batches > before.batches);
+    assert.ok(after.batch_avg > 1);
+    db.closeSync();
+});
@@ -0,0 +1,54 @@
+//
+//  Column metadata of prepared statements after schema changes
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open()
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(":memory:", (err) => {
+            if (err) return reject(err);
+            db.runSync("CREATE TABLE test(a, b)");
+            db.runSync("INSERT INTO test VALUES(1, 2)");
+            resolve(db);
+        });
+    });
+}
+
+function call(obj, method, ...args)
+{
+    return new Promise((resolve, reject) => obj[method](...args, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("cached statements return new columns after a schema change", async () => {
+    var db = await open();
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test"), [{ a: 1, b: 2 }]);
+    assert.deepStrictEqual(await call(db, "query", "SELECT * FROM test"), [{ a: 1, b: 2 }]);
+    db.runSync("ALTER TABLE test ADD COLUMN c DEFAULT 3");
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test"), [{ a: 1, b: 2, c: 3 }]);
+    assert.deepStrictEqual(await call(db, "query", "SELECT * FROM test"), [{ a: 1, b: 2, c: 3 }]);
+    db.runSync("ALTER TABLE test RENAME COLUMN a TO x");
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test", [], { format: "raw" }).columns, ["x", "b", "c"]);
+    db.closeSync();
+});
+
+test("statement objects return new columns after a schema change", async () => {
+    var db = await open();
+    var stmt = await new Promise((resolve, reject) => {
+        var stmt = new sqlite.Statement(db, "SELECT * FROM test", (err) => (err ? reject(err) : resolve(stmt)));
+    });
+    assert.deepStrictEqual(stmt.querySync(), [{ a: 1, b: 2 }]);
+    db.runSync("ALTER TABLE test ADD COLUMN c DEFAULT 3");
+    assert.deepStrictEqual(stmt.querySync(), [{ a: 1, b: 2, c: 3 }]);
+    db.runSync("ALTER TABLE test ADD COLUMN d DEFAULT 4");
+    assert.deepStrictEqual(await call(stmt, "query"), [{ a: 1, b: 2, c: 3, d: 4 }]);
+    db.runSync("ALTER TABLE test RENAME COLUMN a TO x");
+    assert.deepStrictEqual(await call(stmt, "query"), [{ x: 1, b: 2, c: 3, d: 4 }]);
+    stmt.finalize();
+    db.closeSync();
+});
@@ -0,0 +1,90 @@
+//
+//  Cursors on the readers pool: early exit releases the reader, reads wait for a free reader
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open(readers)
+{
+    var file = os.tmpdir() + "/bkjs-sqlite-cursor-" + process.pid + ".db";
+    for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    var db = new sqlite.Database(file);
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a int)");
+    for (var i = 1; i <= 10; i++) db.runSync("INSERT INTO test VALUES(?,?)", [i, i * 10]);
+    db.closeSync();
+    return new Promise((resolve, reject) => {
+        db = new sqlite.Database(file, { readers: readers }, (err) => (err ? reject(err) : resolve(db)));
+        db.file = file;
+    });
+}
+
+function close(db)
+{
+    return new Promise((resolve) => {
+        db.close(() => {
+            for (const f of [db.file, db.file + "-wal", db.file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+            resolve();
+        });
+    });
+}
+
+function query(db, sql, params)
+{
+    return new Promise((resolve, reject) => db.query(sql, params || [], (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("early return releases the reader", async () => {
+    var db = await open(1);
+    var n = 0;
+    for await (const row of db.iterate("SELECT * FROM test", [], { batch: 2 })) {
+        assert.strictEqual(row.id, 1);
+        if (++n == 1) break;
+    }
+    var stats = sqlite.stats().databases.find((x) => (x.name == db.file && x.open));
+    assert.strictEqual(stats.readers_idle, 1);
+    assert.strictEqual((await query(db, "SELECT count(*) AS n FROM test"))[0].n, 10);
+    await close(db);
+});
+
+test("idle cursors do not block worker threads", async () => {
+    var db = await open(2);
+    await query(db, "SELECT a FROM test WHERE id=?", [1]);
+    var cursors = [db.iterate("SELECT * FROM test", [], { batch: 1 }), db.iterate("SELECT * FROM test", [], { batch: 1 })];
+    for (const c of cursors) assert.strictEqual((await c.next()).value.id, 1);
+
+    // More queries than worker threads while both readers are held by idle cursors
+    var queries = [];
+    for (var i = 1; i <= 10; i++) queries.push(query(db, "SELECT a FROM test WHERE id=?", [i]));
+    await new Promise((resolve) => setTimeout(resolve, 50));
+    assert.strictEqual(sqlite.stats().databases.find((x) => (x.name == db.file && x.open)).reads_waiting, 10);
+
+    for (const c of cursors) await c.return();
+    var rows = await Promise.all(queries);
+    assert.deepStrictEqual(rows.map((x) => (x[0].a)), [10, 20, 30, 40, 50, 60, 70, 80, 90, 100]);
+    await close(db);
+});
+
+test("a cursor does not use the main connection of a transaction", async () => {
+    var db = await open(1);
+    await query(db, "SELECT count(*) AS n FROM test");
+    var cursor = db.iterate("SELECT * FROM test", [], { batch: 1 });
+    await cursor.next();
+
+    var tx = db.transaction();
+    await new Promise((resolve, reject) => tx.run("INSERT INTO test VALUES(11, 110)", (err) => (err ? reject(err) : resolve())));
+    var count = db.iterate("SELECT count(*) AS n FROM test");
+    var next = count.next();
+    await cursor.return();
+    assert.strictEqual((await next).value.n, 10);
+    await count.return();
+
+    await new Promise((resolve, reject) => tx.commit((err) => (err ? reject(err) : resolve())));
+    assert.strictEqual((await query(db, "SELECT count(*) AS n FROM test"))[0].n, 11);
+    await close(db);
+});
@@ -0,0 +1,48 @@
+//
+//  Statement.each streams results in batches
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function prepare(db, sql)
+{
+    return new Promise((resolve, reject) => {
+        var stmt = new sqlite.Statement(db, sql, (err) => (err ? reject(err) : resolve(stmt)));
+    });
+}
+
+function each(stmt, values, batch, stopAt)
+{
+    return new Promise((resolve, reject) => {
+        var batches = [];
+        stmt.each(values, batch, {}, (rows, next) => {
+            batches.push(rows.map((x) => x.id));
+            next(batches.length === stopAt);
+        }, (err, total) => (err ? reject(err) : resolve({ batches, total })));
+    });
+}
+
+test("each passes rows in batches and can stop early", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY)");
+    db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10) INSERT INTO test SELECT i FROM n");
+    var stmt = await prepare(db, "SELECT id FROM test WHERE id >= ? ORDER BY id");
+
+    var result = await each(stmt, [1], 3);
+    assert.deepStrictEqual(result.batches, [[1, 2, 3], [4, 5, 6], [7, 8, 9], [10]]);
+    assert.strictEqual(result.total, 10);
+
+    result = await each(stmt, [5], 2, 2);
+    assert.deepStrictEqual(result.batches, [[5, 6], [7, 8]]);
+    assert.strictEqual(result.total, 4);
+
+    // The statement is usable again once the cursor is done
+    result = await each(stmt, [9], 100);
+    assert.deepStrictEqual(result.batches, [[9, 10]]);
+    stmt.finalize();
+    db.closeSync();
+});
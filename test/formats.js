@@ -0,0 +1,54 @@
+//
+//  Result formats: columns and raw
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open()
+{
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, x REAL, t TEXT, b BLOB)");
+    db.runSync("INSERT INTO test VALUES(1, 1.5, 'one', x'01'), (2, NULL, NULL, NULL), (3, -2, 'three', x'0304')");
+    return db;
+}
+
+function query(db, sql, options)
+{
+    return new Promise((resolve, reject) => db.query(sql, [], options, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("columns format returns typed arrays for numeric columns with a nulls bitmap", async () => {
+    var db = open();
+    for (var result of [db.querySync("SELECT * FROM test ORDER BY id", [], { format: "columns" }),
+                        await query(db, "SELECT * FROM test ORDER BY id", { format: "columns" })]) {
+        assert.strictEqual(result.count, 3);
+        assert.ok(result.columns.id instanceof Float64Array);
+        assert.deepStrictEqual(Array.from(result.columns.id), [1, 2, 3]);
+        assert.ok(result.columns.x instanceof Float64Array);
+        assert.deepStrictEqual(Array.from(result.columns.x), [1.5, 0, -2]);
+        assert.ok(result.nulls.x instanceof Uint8Array);
+        assert.strictEqual(result.nulls.x[0], 2);
+        assert.deepStrictEqual(result.columns.t, ["one", null, "three"]);
+        assert.deepStrictEqual(result.columns.b.map((x) => x && Array.from(x)), [[1], null, [3, 4]]);
+    }
+    var empty = db.querySync("SELECT * FROM test WHERE id > 10", [], { format: "columns" });
+    assert.strictEqual(empty.count, 0);
+    db.closeSync();
+});
+
+test("raw format returns positional arrays and the column names", async () => {
+    var db = open();
+    for (var rows of [db.querySync("SELECT id, t, id AS id2 FROM test ORDER BY id", [], { format: "raw" }),
+                      await query(db, "SELECT id, t, id AS id2 FROM test ORDER BY id", { format: "raw" })]) {
+        assert.deepStrictEqual(rows.columns, ["id", "t", "id2"]);
+        assert.deepStrictEqual(Array.from(rows), [[1, "one", 1], [2, null, 2], [3, "three", 3]]);
+    }
+    // Duplicate names keep all values, unlike objects
+    var rows = db.querySync("SELECT 1 AS a, 2 AS a", [], { format: "raw" });
+    assert.deepStrictEqual(Array.from(rows), [[1, 2]]);
+    db.closeSync();
+});
@@ -0,0 +1,80 @@
+//
+//  Group commit: per statement errors, rollback of the whole group and exclusive use of the main connection
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open(options)
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(":memory:", options, (err) => {
+            if (err) return reject(err);
+            db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a text NOT NULL)");
+            resolve(db);
+        });
+    });
+}
+
+function run(db, sql, params)
+{
+    return new Promise((resolve) => {
+        db.run(sql, params || [], function(err) {
+            resolve({ err, lastID: this.lastID, changes: this.changes });
+        });
+    });
+}
+
+test("a failed statement does not affect the rest of the group", async () => {
+    var db = await open({ group_commit: 20 });
+    var list = await Promise.all([
+        run(db, "INSERT INTO test VALUES(1, 'a')"),
+        run(db, "INSERT INTO test VALUES(2, NULL)"),
+        run(db, "INSERT INTO test VALUES(3, 'c')"),
+        run(db, "UPDATE test SET a='b' WHERE id<=3"),
+    ]);
+    assert.ifError(list[0].err);
+    assert.strictEqual(list[0].lastID, 1);
+    assert.strictEqual(list[1].err.code, "SQLITE_CONSTRAINT");
+    assert.ifError(list[2].err);
+    assert.strictEqual(list[2].lastID, 3);
+    assert.strictEqual(list[3].changes, 2);
+    assert.deepStrictEqual(db.querySync("SELECT id, a FROM test ORDER BY id"), [{ id: 1, a: "b" }, { id: 3, a: "b" }]);
+    var stats = sqlite.stats().databases.find((x) => (x.group_commits > 0 && x.open));
+    assert.strictEqual(stats.group_writes, 4);
+});
+
+test("a statement that rolls back the transaction fails the whole group", async () => {
+    var db = await open({ group_commit: 20 });
+    db.runSync("PRAGMA max_page_count=20");
+    var list = await Promise.all([
+        run(db, "INSERT INTO test VALUES(1, 'a')"),
+        run(db, "INSERT INTO test VALUES(2, ?)", ["x".repeat(200000)]),
+        run(db, "INSERT INTO test VALUES(3, 'c')"),
+    ]);
+    for (const x of list) assert.strictEqual(x.err && x.err.code, "SQLITE_FULL");
+    assert.deepStrictEqual(db.querySync("SELECT count(*) AS n FROM test"), [{ n: 0 }]);
+});
+
+test("the group runs alone and before later writes", async () => {
+    var db = await open({ group_commit: 1000, group_size: 5 });
+    db.runSync("PRAGMA max_page_count=20");
+    var order = [], list = [];
+    for (var i = 1; i <= 4; i++) list.push(run(db, "INSERT INTO test VALUES(?, 'group')", [i]).then((x) => { order.push("group"); return x }));
+    list.push(run(db, "INSERT INTO test VALUES(5, ?)", ["x".repeat(200000)]).then((x) => { order.push("group"); return x }));
+
+    // The group is full and queued, these must not run inside its transaction
+    var exec = new Promise((resolve, reject) => db.exec("INSERT INTO test VALUES(10, 'exec')", (err) => (err ? reject(err) : resolve()))).then(() => order.push("exec"));
+    var tx = db.transaction();
+    var txrun = new Promise((resolve, reject) => tx.run("INSERT INTO test VALUES(11, 'tx')", (err) => (err ? reject(err) : resolve())));
+    var commit = new Promise((resolve, reject) => tx.commit((err) => (err ? reject(err) : resolve()))).then(() => order.push("tx"));
+
+    var results = await Promise.all(list);
+    await Promise.all([exec, txrun, commit]);
+    for (const x of results) assert.ok(x.err);
+    assert.deepStrictEqual(order, ["group", "group", "group", "group", "group", "exec", "tx"]);
+    assert.deepStrictEqual(db.querySync("SELECT id FROM test ORDER BY id"), [{ id: 10 }, { id: 11 }]);
+});
@@ -0,0 +1,42 @@
+//
+//  Arena allocator for SQLite memory and its counters, must run in its own process before any database is opened
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function query(db, sql, values)
+{
+    return new Promise((resolve, reject) => db.query(sql, values || [], (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("arena allocator counts memory of all threads", async () => {
+    assert.strictEqual(sqlite.stats().memory.allocator, "system");
+    sqlite.configure({ allocator: "arena" });
+    var start = sqlite.stats().memory;
+    assert.strictEqual(start.allocator, "arena");
+
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, t TEXT, b BLOB)");
+    db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000) INSERT INTO test SELECT i, printf('%.*c', i, 'x'), zeroblob(i * 50) FROM n");
+    var rows = await query(db, "SELECT id, length(t) AS t, length(b) AS b FROM test WHERE id IN (1, 2000) ORDER BY id");
+    assert.deepStrictEqual(rows, [{ id: 1, t: 1, b: 50 }, { id: 2000, t: 2000, b: 100000 }]);
+
+    var used = sqlite.stats().memory;
+    assert.ok(used.current > start.current + 1000000);
+    assert.ok(used.peak >= used.current);
+    assert.ok(used.allocs > start.allocs);
+    assert.ok(used.threads >= 2);
+    assert.ok(used.arena > 0);
+
+    // The allocator cannot change under open databases
+    assert.throws(() => sqlite.configure({ allocator: "system" }), /before any database/);
+
+    db.closeSync();
+    var after = sqlite.stats().memory;
+    assert.ok(after.current < used.current - 1000000);
+    assert.ok(after.peak >= used.current);
+});
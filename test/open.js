@@ -0,0 +1,43 @@
+//
+//  A connection that fails its settings is closed, not left half open
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("open fails and closes the connection when the settings cannot be applied", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-open-" + process.pid + ".db");
+    fs.writeFileSync(file, Buffer.alloc(4096, "not a database"));
+
+    var db;
+    assert.throws(() => { db = new sqlite.Database(file, { journal_mode: "wal" }) }, /not a database/);
+
+    db = await new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, { journal_mode: "wal" }, (err) => (err ? resolve(db) : reject(new Error("opened"))));
+    });
+    assert.throws(() => db.querySync("SELECT 1"));
+    fs.unlinkSync(file);
+});
+
+test("open fails and closes the connection when the readers cannot be opened", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-open-readers-" + process.pid + ".db");
+    var db = new sqlite.Database(file);
+    db.runSync("CREATE TABLE test(a)");
+    db.closeSync();
+
+    var options = { mode: sqlite.OPEN_READONLY, readers: 2 };
+    assert.throws(() => { db = new sqlite.Database(file, options) }, /readonly|WAL/);
+
+    db = await new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, options, (err) => (err ? resolve(db) : reject(new Error("opened"))));
+    });
+    assert.throws(() => db.querySync("SELECT count(*) FROM test"));
+    assert.strictEqual(sqlite.stats().databases.filter((x) => x.name == file && x.open).length, 0);
+    fs.unlinkSync(file);
+});
@@ -0,0 +1,65 @@
+//
+//  Parameters bound in place are released once the statement is done
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var v8 = require("v8");
+var vm = require("vm");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+v8.setFlagsFromString("--expose-gc");
+var gc = vm.runInNewContext("gc");
+
+function call(obj, method, ...args)
+{
+    return new Promise((resolve, reject) => obj[method](...args, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+async function collected(ref)
+{
+    for (var i = 0; i < 5 && ref.deref(); i++) {
+        await new Promise((resolve) => setImmediate(resolve));
+        gc();
+    }
+    return !ref.deref();
+}
+
+test("a statement does not keep Buffer parameters after the call", async () => {
+    var db = await new Promise((resolve, reject) => {
+        var db = new sqlite.Database(":memory:", (err) => (err ? reject(err) : resolve(db)));
+    });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a BLOB)");
+    var stmt = await new Promise((resolve, reject) => {
+        var stmt = new sqlite.Statement(db, "INSERT INTO test(a) VALUES(?)", (err) => (err ? reject(err) : resolve(stmt)));
+    });
+    var query = await new Promise((resolve, reject) => {
+        var stmt = new sqlite.Statement(db, "SELECT length(a) AS n FROM test WHERE a = ?", (err) => (err ? reject(err) : resolve(stmt)));
+    });
+
+    var refs = [];
+    await (async () => {
+        var buf = Buffer.alloc(65536, 1);
+        refs.push(new WeakRef(buf));
+        await call(stmt, "run", [buf]);
+        buf = Buffer.alloc(65536, 2);
+        refs.push(new WeakRef(buf));
+        stmt.runSync([buf]);
+        buf = Buffer.alloc(65536, 1);
+        refs.push(new WeakRef(buf));
+        assert.deepStrictEqual(await call(query, "query", [buf]), [{ n: 65536 }]);
+        buf = Buffer.alloc(65536, 2);
+        refs.push(new WeakRef(buf));
+        assert.deepStrictEqual(query.querySync([buf]), [{ n: 65536 }]);
+    })();
+    for (var ref of refs) assert.ok(await collected(ref));
+
+    // Nothing stays bound, a call without values binds NULLs
+    await call(stmt, "run");
+    assert.deepStrictEqual(db.querySync("SELECT count(*) AS n FROM test WHERE a IS NULL"), [{ n: 1 }]);
+    stmt.finalize();
+    query.finalize();
+    db.closeSync();
+});
@@ -0,0 +1,33 @@
+//
+//  Page cache: pages are counted for the database that uses them
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("caches created after open and for ATTACH belong to the database", async () => {
+    var dir = fs.mkdtempSync(path.join(os.tmpdir(), "pcache"));
+    var file = path.join(dir, "main.db");
+    var db = await new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, (err) => (err ? reject(err) : resolve(db)));
+    });
+    var other = sqlite.stats().page_cache.other_pages;
+    db.runSync("CREATE TABLE test(a)");
+    db.runSync("ATTACH ? AS b", [path.join(dir, "b.db")]);
+    db.runSync("CREATE TABLE b.test(a)");
+    for (var i = 0; i < 1000; i++) db.runSync("INSERT INTO b.test VALUES(?)", ["x".repeat(100)]);
+    var rows = await new Promise((resolve, reject) => db.query("SELECT count(*) AS n FROM b.test", (err, rows) => (err ? reject(err) : resolve(rows))));
+    assert.deepStrictEqual(rows, [{ n: 1000 }]);
+
+    var stats = sqlite.stats();
+    assert.strictEqual(stats.page_cache.other_pages, other);
+    assert.ok(stats.databases.find((x) => (x.name == file && x.open)).page_cache.pages > 20);
+    db.closeSync();
+    fs.rmSync(dir, { recursive: true });
+});
@@ -0,0 +1,65 @@
+//
+//  Many independent statements in one worker call
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function pipeline(db, list, options)
+{
+    return new Promise((resolve, reject) => db.pipeline(list, options || {}, (err, results) => (err ? reject(err) : resolve(results))));
+}
+
+test("every statement gets its own result or error", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a TEXT)");
+
+    var results = await pipeline(db, [
+        { sql: "INSERT INTO test VALUES(?, ?)", params: [1, "one"] },
+        "INSERT INTO test VALUES(2, 'two')",
+        { sql: "SELECT a FROM nosuchtable" },
+        { sql: "INSERT INTO test VALUES(?, ?)", params: [1, "again"] },
+        { sql: "SELECT * FROM test WHERE id >= ? ORDER BY id", params: [1] },
+        "SELECT count(*) AS n FROM test",
+    ]);
+    assert.strictEqual(results.length, 6);
+    assert.deepStrictEqual(results[0], []);
+    assert.ok(results[2] instanceof Error);
+    assert.match(results[2].message, /no such table/);
+    assert.strictEqual(results[2].index, 2);
+    assert.ok(results[3] instanceof Error);
+    assert.match(results[3].message, /UNIQUE/);
+    assert.strictEqual(results[3].index, 3);
+    assert.deepStrictEqual(results[4], [{ id: 1, a: "one" }, { id: 2, a: "two" }]);
+    assert.deepStrictEqual(results[5], [{ n: 2 }]);
+
+    // Query options apply to all statements
+    results = await pipeline(db, ["SELECT id FROM test ORDER BY id", "SELECT a FROM test WHERE id = 2"], { format: "raw" });
+    assert.deepStrictEqual(results.map((x) => Array.from(x)), [[[1], [2]], [["two"]]]);
+    assert.deepStrictEqual(results[1].columns, ["a"]);
+
+    results = await pipeline(db, []);
+    assert.deepStrictEqual(results, []);
+    assert.throws(() => db.pipeline([1], () => {}), /string or an object/);
+    db.closeSync();
+});
+
+test("snapshot runs all statements in one transaction", async () => {
+    var db = new sqlite.Database(":memory:");
+
+    var results = await pipeline(db, ["BEGIN", "SELECT 1 AS a", "COMMIT"]);
+    assert.deepStrictEqual(results, [[], [{ a: 1 }], []]);
+
+    results = await pipeline(db, ["BEGIN", "SELECT 1 AS a"], { snapshot: true });
+    assert.ok(results[0] instanceof Error);
+    assert.match(results[0].message, /within a transaction/);
+    assert.deepStrictEqual(results[1], [{ a: 1 }]);
+
+    // The transaction is over once the pipeline is done
+    db.runSync("BEGIN");
+    db.runSync("COMMIT");
+    db.closeSync();
+});
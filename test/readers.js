@@ -0,0 +1,100 @@
+//
+//  Readers pool: reads see the main connection, close waits for reads and cursors
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open(file, options)
+{
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, options, (err) => (err ? reject(err) : resolve(db)));
+    });
+}
+
+function query(db, sql, values)
+{
+    return new Promise((resolve, reject) => db.query(sql, values || [], (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+function remove(file)
+{
+    for (var ext of ["", "-wal", "-shm"]) fs.rmSync(file + ext, { force: true });
+}
+
+test("reads run on the readers in parallel and see the writes", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-readers-" + process.pid + ".db");
+    var db = await open(file, { readers: 2 });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    db.runSync("INSERT INTO test VALUES(1, 'one')");
+    assert.strictEqual(db.querySync("PRAGMA journal_mode")[0].journal_mode, "wal");
+
+    var rows = await Promise.all([1, 2, 3, 4].map(() => query(db, "SELECT a FROM test WHERE id = ?", [1])));
+    assert.deepStrictEqual(rows, [[{ a: "one" }], [{ a: "one" }], [{ a: "one" }], [{ a: "one" }]]);
+    var stats = sqlite.stats().databases.filter((x) => x.name == file)[0];
+    assert.strictEqual(stats.readers, 2);
+
+    await new Promise((resolve) => db.close(resolve));
+    remove(file);
+});
+
+test("in-memory databases run without readers", async () => {
+    var db = await open(":memory:", { readers: 2 });
+    db.runSync("CREATE TABLE t(a)");
+    assert.deepStrictEqual(db.querySync("SELECT count(*) n FROM sqlite_master"), [{ n: 1 }]);
+    assert.deepStrictEqual(await query(db, "SELECT count(*) n FROM sqlite_master"), [{ n: 1 }]);
+    db.closeSync();
+});
+
+test("close waits for the queued reads and closeSync refuses while they run", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-readers-close-" + process.pid + ".db");
+    for (var n = 0; n < 4; n++) {
+        var db = await open(file, { readers: 4 });
+        db.runSync("CREATE TABLE IF NOT EXISTS test(id INTEGER PRIMARY KEY, a)");
+        db.runSync("INSERT OR REPLACE INTO test VALUES(1, 'one')");
+
+        var done = 0;
+        var reads = [];
+        for (var i = 0; i < 16; i++) {
+            reads.push(query(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 20000) SELECT count(*) AS n FROM n, test").then((rows) => {
+                done++;
+                return rows;
+            }));
+        }
+        assert.throws(() => db.closeSync(), /pending jobs/);
+        var closed = await new Promise((resolve) => db.close((err) => resolve({ err, done })));
+        assert.strictEqual(closed.err, null);
+        assert.strictEqual(closed.done, 16);
+        for (var rows of await Promise.all(reads)) assert.deepStrictEqual(rows, [{ n: 20000 }]);
+    }
+    remove(file);
+});
+
+test("close waits for a cursor that holds a reader", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-readers-cursor-" + process.pid + ".db");
+    var db = await open(file, { readers: 1 });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY)");
+    db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 10) INSERT INTO test SELECT i FROM n");
+
+    var cursor = db.iterate("SELECT id FROM test", [], { batch: 2 });
+    var first = await cursor.next();
+    assert.strictEqual(first.done, false);
+
+    var closed = false;
+    db.close(() => (closed = true));
+    await new Promise((resolve) => setTimeout(resolve, 50));
+    assert.strictEqual(closed, false);
+
+    var rows = 1;
+    for (var item = await cursor.next(); !item.done; item = await cursor.next()) rows++;
+    assert.strictEqual(rows, 10);
+    await new Promise((resolve) => setTimeout(resolve, 50));
+    assert.strictEqual(closed, true);
+    remove(file);
+});
@@ -0,0 +1,42 @@
+//
+//  Async results from the per query cell arena match the sync results
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function query(db, sql, params, options)
+{
+    return new Promise((resolve, reject) => db.query(sql, params, options || {}, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("mixed types over many rows", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, n REAL, t TEXT, b BLOB, v)");
+    db.runSync(`WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 5000)
+                INSERT INTO test SELECT i, CASE WHEN i % 7 THEN i / 3.0 END, CASE WHEN i % 5 THEN printf('тест %d %.*c', i, i % 300, 'x') END,
+                CASE WHEN i % 3 THEN randomblob(i % 50) END, CASE i % 4 WHEN 0 THEN i WHEN 1 THEN 'v' || i WHEN 2 THEN i + 0.5 END FROM n`);
+    var sql = "SELECT id, n, t, b, v, t AS t2 FROM test ORDER BY id";
+
+    var rows = await query(db, sql, []);
+    assert.strictEqual(rows.length, 5000);
+    assert.deepStrictEqual(rows, db.querySync(sql));
+    assert.deepStrictEqual(Object.keys(rows[0]), ["id", "n", "t", "b", "v", "t2"]);
+    assert.deepStrictEqual(rows[6], { id: 7, n: null, t: "тест 7 xxxxxxx", b: rows[6].b, v: null, t2: "тест 7 xxxxxxx" });
+    assert.strictEqual(rows[4].t, null);
+    assert.deepStrictEqual([rows[0].v, rows[1].v, rows[3].v], ["v1", 2.5, 4]);
+    assert.strictEqual(rows[5].b, null);
+
+    // Raw rows are built from the same cells
+    var raw = await query(db, sql + " LIMIT 10", [], { format: "raw" });
+    assert.deepStrictEqual(raw.map((x) => x[2]), rows.slice(0, 10).map((x) => x.t));
+
+    // Rows are converted in batches by the iterator
+    var ids = [];
+    for await (var row of db.iterate("SELECT id, t FROM test WHERE id > ? ORDER BY id", [4990], { batch: 3 })) ids.push(row.id);
+    assert.deepStrictEqual(ids, [4991, 4992, 4993, 4994, 4995, 4996, 4997, 4998, 4999, 5000]);
+    db.closeSync();
+});
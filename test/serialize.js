@@ -0,0 +1,42 @@
+//
+//  Serialize copies the image, deserialize refuses while jobs use the connection
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("serialize returns a copy that survives changes", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(a)");
+    db.runSync("INSERT INTO test VALUES(1)");
+    db.deserialize(db.serialize());
+    var image = db.serialize({ nocopy: true });
+    db.runSync("INSERT INTO test VALUES(2)");
+    db.runSync("CREATE TABLE test2(a)");
+
+    var db2 = new sqlite.Database(":memory:");
+    db2.deserialize(image);
+    assert.deepStrictEqual(db2.querySync("SELECT a FROM test"), [{ a: 1 }]);
+    db.closeSync();
+    db2.closeSync();
+});
+
+test("deserialize refuses while jobs are running or queued", async () => {
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(a)");
+    var image = db.serialize();
+
+    var done = [];
+    db.run("INSERT INTO test VALUES(1)", (err) => done.push(err));
+    db.query("SELECT * FROM test", (err) => done.push(err));
+    assert.throws(() => db.deserialize(image), /pending jobs/);
+
+    await new Promise((resolve) => db.query("SELECT 1", resolve));
+    assert.deepStrictEqual(done, [null, null]);
+    db.deserialize(image);
+    assert.deepStrictEqual(db.querySync("SELECT * FROM test"), []);
+    db.closeSync();
+});
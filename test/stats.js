@@ -0,0 +1,47 @@
+//
+//  Execution counters collected on many worker threads add up
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("query and statement counters from parallel readers are exact", async () => {
+    var file = path.join(os.tmpdir(), "sqlite-stats-" + process.pid + ".db");
+    var db = await new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, { readers: 4 }, (err) => (err ? reject(err) : resolve(db)));
+    });
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    db.runSync("INSERT INTO test VALUES(1, 1), (2, 2)");
+    var stmt = await new Promise((resolve, reject) => {
+        var stmt = new sqlite.Statement(db, "SELECT a FROM test WHERE id = ?", (err) => (err ? reject(err) : resolve(stmt)));
+    });
+
+    var sql = "SELECT a, 'stats' FROM test WHERE id = ?";
+    var calls = [];
+    for (var i = 0; i < 400; i++) {
+        calls.push(new Promise((resolve, reject) => db.query(sql, [i % 2 + 1], (err) => (err ? reject(err) : resolve()))));
+    }
+    for (var i = 0; i < 50; i++) {
+        await new Promise((resolve, reject) => stmt.query([1], (err) => (err ? reject(err) : resolve())));
+        sqlite.stats();
+    }
+    await Promise.all(calls);
+
+    var stats = sqlite.stats();
+    var item = stats.queries.filter((x) => x.sql == sql)[0] || {};
+    assert.strictEqual(item.count, 400);
+    assert.strictEqual(item.rows, 400);
+    assert.strictEqual(stats.filter((x) => x.sql == "SELECT a FROM test WHERE id = ?")[0].count, 50);
+    // Merged counters are kept
+    assert.strictEqual(sqlite.stats().queries.filter((x) => x.sql == sql)[0].count, 400);
+
+    stmt.finalize();
+    await new Promise((resolve) => db.close(resolve));
+    for (var ext of ["", "-wal", "-shm"]) fs.rmSync(file + ext, { force: true });
+});
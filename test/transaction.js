@@ -0,0 +1,103 @@
+//
+//  Transaction handles mixed with plain writes and reads on the readers pool
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+function open(options)
+{
+    var file = os.tmpdir() + "/bkjs-sqlite-txn-" + process.pid + ".db";
+    for (const f of [file, file + "-wal", file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+    return new Promise((resolve, reject) => {
+        var db = new sqlite.Database(file, options || {}, (err) => {
+            if (err) return reject(err);
+            db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a text)");
+            resolve(db);
+        });
+        db.file = file;
+    });
+}
+
+function close(db)
+{
+    return new Promise((resolve) => {
+        db.close(() => {
+            for (const f of [db.file, db.file + "-wal", db.file + "-shm"]) if (fs.existsSync(f)) fs.unlinkSync(f);
+            resolve();
+        });
+    });
+}
+
+function call(obj, method, ...args)
+{
+    return new Promise((resolve, reject) => obj[method](...args, (err, rows) => (err ? reject(err) : resolve(rows))));
+}
+
+test("plain writes do not run inside a transaction", async () => {
+    var db = await open();
+    var before = call(db, "run", "INSERT INTO test VALUES(1, 'before')");
+    var tx = db.transaction();
+    var during = call(db, "run", "INSERT INTO test VALUES(2, 'during')");
+    var order = [];
+    before.then(() => order.push("before"));
+    during.then(() => order.push("during"));
+
+    await call(tx, "run", "INSERT INTO test VALUES(3, 'tx')");
+    order.push("tx");
+    assert.deepStrictEqual(await call(tx, "query", "SELECT id FROM test ORDER BY id"), [{ id: 1 }, { id: 3 }]);
+    await call(tx, "rollback");
+    await during;
+
+    assert.deepStrictEqual(order, ["before", "tx", "during"]);
+    assert.deepStrictEqual(await call(db, "query", "SELECT id FROM test ORDER BY id"), [{ id: 1 }, { id: 2 }]);
+    await close(db);
+});
+
+test("transactions run one after another in order", async () => {
+    var db = await open();
+    var list = [];
+    for (var i = 0; i < 5; i++) {
+        var tx = db.transaction();
+        var nested = tx.transaction();
+        list.push(call(nested, "run", "INSERT INTO test VALUES(?, 'nested')", [i * 2 + 1]));
+        list.push(call(nested, "commit"));
+        list.push(call(tx, "run", "INSERT INTO test VALUES(?, ?)", [i * 2 + 2, "tx" + i]));
+        list.push(call(db, "run", "INSERT INTO test VALUES(?, 'plain')", [100 + i]));
+        list.push(call(tx, i % 2 ? "rollback" : "commit"));
+    }
+    await Promise.all(list);
+    var rows = await call(db, "query", "SELECT id FROM test ORDER BY id");
+    assert.deepStrictEqual(rows.map((x) => (x.id)), [1, 2, 5, 6, 9, 10, 100, 101, 102, 103, 104]);
+    await close(db);
+});
+
+test("reads on the readers do not starve a transaction", { timeout: 5000 }, async () => {
+    var db = await open({ readers: 2 });
+    db.runSync("INSERT INTO test VALUES(1, 'a')");
+    await call(db, "query", "SELECT count(*) AS n FROM test");
+
+    var stop = false, reads = 0;
+    function read() {
+        db.query("SELECT count(*) AS n FROM test", (err) => {
+            assert.ifError(err);
+            reads++;
+            if (!stop) read();
+        });
+    }
+    for (var i = 0; i < 8; i++) read();
+
+    var tx = db.transaction();
+    await call(tx, "run", "INSERT INTO test VALUES(2, 'b')");
+    await call(tx, "commit");
+    stop = true;
+    assert.ok(reads > 0);
+    await new Promise((resolve) => setTimeout(resolve, 50));
+    assert.deepStrictEqual(await call(db, "query", "SELECT count(*) AS n FROM test"), [{ n: 2 }]);
+    await close(db);
+});
@@ -0,0 +1,34 @@
+//
+//  io_uring VFS: reads, writes and syncs go through the ring
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("a database opened with vfs=io_uring reads and writes through the ring", { skip: !sqlite.stats().io_uring }, async () => {
+    var file = path.join(os.tmpdir(), "sqlite-vfs-" + process.pid + ".db");
+    var before = sqlite.stats().io_uring;
+    var db = new sqlite.Database("file:" + file + "?vfs=io_uring", sqlite.OPEN_READWRITE | sqlite.OPEN_CREATE | sqlite.OPEN_URI);
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    db.runSync("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO test SELECT i, randomblob(100) FROM n");
+    db.closeSync();
+
+    db = new sqlite.Database("file:" + file + "?vfs=io_uring", sqlite.OPEN_READWRITE | sqlite.OPEN_URI);
+    var rows = await new Promise((resolve, reject) => db.query("SELECT count(*) AS n, sum(length(a)) AS len FROM test", (err, rows) => (err ? reject(err) : resolve(rows))));
+    assert.deepStrictEqual(rows, [{ n: 1000, len: 100000 }]);
+    db.closeSync();
+
+    var after = sqlite.stats().io_uring;
+    assert.ok(after.files > before.files);
+    assert.ok(after.writes > before.writes);
+    assert.ok(after.syncs > before.syncs);
+    assert.ok(after.reads > before.reads);
+    assert.strictEqual(after.fallback, before.fallback);
+    fs.unlinkSync(file);
+});
@@ -0,0 +1,35 @@
+//
+//  Dedicated worker pool for async database calls
+//
+//  Usage: node --test test/
+//
+
+var test = require("node:test");
+var assert = require("assert");
+var sqlite = require(__dirname + "/../build/Release/binding");
+
+test("async calls run on the dedicated pool which only grows", async () => {
+    sqlite.configure({ threads: 3 });
+    var db = new sqlite.Database(":memory:");
+    db.runSync("CREATE TABLE test(id INTEGER PRIMARY KEY, a)");
+    var before = sqlite.stats().workers;
+    assert.strictEqual(before.threads, 3);
+
+    var calls = [];
+    for (var i = 0; i < 50; i++) {
+        calls.push(new Promise((resolve, reject) => db.run("INSERT INTO test(a) VALUES(?)", [i], (err) => (err ? reject(err) : resolve()))));
+    }
+    await Promise.all(calls);
+    assert.deepStrictEqual(db.querySync("SELECT count(*) AS n, sum(a) AS s FROM test"), [{ n: 50, s: 1225 }]);
+
+    var after = sqlite.stats().workers;
+    assert.ok(after.completed - before.completed >= 50);
+    assert.strictEqual(after.busy, 0);
+    assert.strictEqual(after.queue, 0);
+
+    sqlite.configure({ threads: 1 });
+    assert.strictEqual(sqlite.stats().workers.threads, 3);
+    sqlite.configure({ threads: 4 });
+    assert.strictEqual(sqlite.stats().workers.threads, 4);
+    await new Promise((resolve) => db.close(resolve));
+});